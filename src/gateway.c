@@ -16,23 +16,46 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
-#define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE
 #include <getopt.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <execinfo.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <drm_fourcc.h>
+#include <GLES3/gl3.h>
+#include <GLES2/gl2ext.h>
 #include <wayland-server-core.h>
 #include <wlr/backend.h>
 #include <wlr/backend/session.h>
+#include <wlr/backend/headless.h>
+#include <wlr/backend/multi.h>
 #include <wlr/render/wlr_renderer.h>
 #include <wlr/types/wlr_cursor.h>
 #include <wlr/types/wlr_compositor.h>
 #include <wlr/types/wlr_data_device.h>
 #include <wlr/types/wlr_input_device.h>
 #include <wlr/types/wlr_keyboard.h>
+#include <wlr/interfaces/wlr_keyboard.h>
 #include <wlr/types/wlr_matrix.h>
 #include <wlr/types/wlr_output.h>
 #include <wlr/types/wlr_output_layout.h>
@@ -45,11 +68,26 @@
 #include <wlr/xwayland.h>
 #include <wlr/types/wlr_layer_shell_v1.h>
 #include <wlr/types/wlr_screencopy_v1.h>
+#include <wlr/types/wlr_gamma_control_v1.h>
+#include <wlr/types/wlr_export_dmabuf_v1.h>
+#include <wlr/types/wlr_output_power_management_v1.h>
+#include <wlr/types/wlr_idle.h>
+#include <wlr/types/wlr_idle_inhibit_v1.h>
+#include <wlr/types/wlr_viewporter.h>
+#include <wlr/types/wlr_primary_selection_v1.h>
+#include <wlr/util/region.h>
+#include <wlr/render/gles2.h>
+#include <wlr/render/egl.h>
+#include "wlr-screencopy-unstable-v1-protocol.h"
+#include "gateway-window-capture-unstable-v1-protocol.h"
+#include "layout.h"
 #include <wlr/types/wlr_relative_pointer_v1.h>
 #include <wlr/types/wlr_pointer_constraints_v1.h>
 #include <wlr/util/log.h>
 #include <assert.h>
 #include <xkbcommon/xkbcommon.h>
+#include <xcb/xcb.h>
+#include <xcb/res.h>
 
 /* For brevity's sake, struct members are annotated where they are used. */
 enum tinywl_cursor_mode {
@@ -58,6 +96,12 @@ enum tinywl_cursor_mode {
 	TINYWL_CURSOR_RESIZE,
 };
 
+struct gateway_config_output {
+    char name[24];
+    float scale; // 0 for the default
+    char mirror[24]; // output to mirror, empty for none
+};
+
 struct gateway_config {
     char* kbd_layout;
     char* kbd_variant;
@@ -65,10 +109,420 @@ struct gateway_config {
     char* launcher;
     double mouse_sens;
     uint32_t window_gaps;
+    uint32_t watchdog_ms; // 0 disables the stall watchdog
+    uint32_t hud_keycode;
+    uint32_t xwayland_idle_timeout; // seconds, 0 keeps Xwayland around once started
+    uint32_t color_temperature; // kelvin, 6500 is neutral
+    uint32_t idle_timeout; // seconds without input before outputs turn off, 0 never
+    uint32_t unfocused_fps; // frame callback cap for clients without keyboard focus, 0 none
+    uint32_t power_keycode; // toggles the battery power profile
+    uint32_t battery_refresh; // Hz, outputs use the fastest mode up to this on battery
+    uint32_t battery_unfocused_fps; // unfocused_fps on battery
+    uint32_t overview_keycode;
+    uint32_t clipboard_max_kb; // selections up to this size are kept by the compositor, 0 off
+    int32_t realtime_priority; // SCHED_RR priority of the event loop, 0 off, startup only
+    int32_t nice; // of the event loop, 0 leaves it alone, startup only
+    uint64_t cpu_affinity; // bit per CPU the event loop may run on, 0 any, startup only
+    bool mlock; // lock the compositor's memory, startup only
+    float scale; // for outputs without an entry in outputs
+    struct gateway_config_output* outputs;
+    int32_t output_count;
+    int32_t* stack_max_items;
+    int32_t stack_count;
+};
+
+/* Log2 histogram of durations in microseconds. Bucket i holds samples in
+ * [2^(i-1), 2^i) us, bucket 0 holds everything below 1 us. */
+#define GATEWAY_HISTOGRAM_BUCKETS 32
+struct gateway_histogram {
+    uint64_t buckets[GATEWAY_HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+};
+
+enum gateway_latency_kind {
+    GATEWAY_LATENCY_KEY,
+    GATEWAY_LATENCY_MOTION,
+    GATEWAY_LATENCY_KIND_COUNT,
+};
+
+enum gateway_latency_stage {
+    GATEWAY_LATENCY_FREE,
+    GATEWAY_LATENCY_DELIVERED, // handed to the client, waiting for a commit
+    GATEWAY_LATENCY_COMMITTED, // client committed, waiting to be drawn
+    GATEWAY_LATENCY_RENDERED,  // drawn, waiting for the output commit
+};
+
+/* One input event followed from the device to the screen. */
+struct gateway_latency_event {
+    enum gateway_latency_kind kind;
+    enum gateway_latency_stage stage;
+    uint32_t device_msec;
+    uint64_t arrival_ns;
+    uint64_t delivered_ns;
+    uint64_t commit_ns;
+    struct wlr_surface* surface;
+    struct tinywl_output* output; // that drew the commit, it ends with that output's commit
+};
+
+#define GATEWAY_LATENCY_RING 256
+#define GATEWAY_LATENCY_TIMEOUT_NS 1000000000ull
+
+struct gateway_latency {
+    struct gateway_latency_event events[GATEWAY_LATENCY_RING];
+    uint32_t head;
+    uint32_t pending;
+    FILE* trace_file;
+
+    struct gateway_histogram device[GATEWAY_LATENCY_KIND_COUNT];   // device timestamp -> arrival
+    struct gateway_histogram delivery[GATEWAY_LATENCY_KIND_COUNT]; // arrival -> sent to client
+    struct gateway_histogram commit[GATEWAY_LATENCY_KIND_COUNT];   // sent -> client commit
+    struct gateway_histogram present[GATEWAY_LATENCY_KIND_COUNT];  // client commit -> output commit
+    struct gateway_histogram total[GATEWAY_LATENCY_KIND_COUNT];    // arrival -> output commit
+    uint64_t expired;
+    uint64_t overwritten;
+};
+
+struct gateway_stats {
+    struct gateway_latency latency;
+
+    struct gateway_histogram frame_interval; // between output frames, per output
+    struct gateway_histogram frame_layout;   // panel_update
+    struct gateway_histogram frame_render;   // renderer begin -> end
+    struct gateway_histogram frame_render_recording; // the same, for frames screencopy read
+    uint64_t frames;
+    uint64_t dropped_frames;
+    uint64_t background_renders; // cached background layers redrawn
+    uint64_t draws_submitted; // textured quads sent to the GPU
+    uint64_t draws_culled;    // surfaces skipped, covered or off the output
+    uint64_t hit_tests;       // desktop_view_at calls
+    uint64_t hit_test_ns;     // time spent in them
+};
+
+enum gateway_ipc_event {
+    GATEWAY_IPC_EVENT_FOCUS,
+    GATEWAY_IPC_EVENT_MAP,
+    GATEWAY_IPC_EVENT_UNMAP,
+    GATEWAY_IPC_EVENT_FRAME,
+    GATEWAY_IPC_EVENT_COUNT,
+};
+
+/* Per frame numbers kept around for the performance HUD. */
+#define GATEWAY_HUD_SAMPLES 120
+struct gateway_frame_sample {
+    uint32_t interval_us;
+    uint32_t layout_us;
+    uint32_t render_us;
+    bool dropped;
+};
+
+/* How the event loop ended up being scheduled, see sched_apply. */
+struct gateway_sched {
+    int policy; // SCHED_OTHER or SCHED_RR
+    int priority; // SCHED_RR priority
+    int nice;
+    int original_nice;
+    cpu_set_t original_cpus;
+    uint64_t cpus; // 0 when not pinned
+    bool locked, locked_future;
+};
+
+/* Notices listeners that hold the event loop for longer than budget_ms. */
+struct gateway_watchdog {
+    uint32_t budget_ms;
+    pthread_t thread;
+    pthread_t main_thread;
+    atomic_bool running;
+    /* listener and start_ns go together, they are written between two
+     * increments of seq and read again until seq was even and unchanged. */
+    _Atomic uint64_t seq;
+    _Atomic(const char*) listener;
+    _Atomic uint64_t start_ns;
+    _Atomic uint64_t heartbeat_ns;
+    struct wl_event_source* heartbeat;
+    int32_t depth;
+
+    uint64_t stalls;
+    uint64_t worst_us;
+    const char* worst_listener;
+    struct gateway_histogram stall_durations;
+};
+
+/* Timeline of the compositor start, marks are relative to the start of main. */
+#define GATEWAY_STARTUP_MARKS 48
+struct gateway_startup_mark {
+    char name[40];
+    uint64_t ns;
+};
+
+struct gateway_startup {
+    uint64_t start_ns;
+    uint64_t last_ns;
+    struct gateway_startup_mark marks[GATEWAY_STARTUP_MARKS];
+    int32_t mark_count;
+    bool first_frame;
+    bool deferred_done;
+    struct wl_event_source* deferred;          // idle source, runs after the first frame
+    struct wl_event_source* deferred_fallback; // in case no output ever renders
+};
+
+/* Benchmarks run gateway on the headless backend for a number of frames and
+ * log the results before exiting, see -b. */
+enum gateway_bench_kind {
+    GATEWAY_BENCH_NONE,
+    GATEWAY_BENCH_CAPTURE, // full vs damage-only readback of every frame
+    GATEWAY_BENCH_DRAWS,   // draw calls per frame, with whatever -s puts on screen
+    GATEWAY_BENCH_READBACK_SYNC,  // screencopy of every frame, read synchronously
+    GATEWAY_BENCH_READBACK_ASYNC, // the same through pixel buffer objects
+    GATEWAY_BENCH_READBACK_SCALED, // the same scaled down to 720 lines on the GPU
+    GATEWAY_BENCH_COUNT,
+};
+
+struct gateway_bench {
+    enum gateway_bench_kind kind;
+    uint32_t frames;
+    uint32_t target_frames;
+    uint64_t start_ns;
+    int32_t output_width, output_height;
+    uint64_t readback_bytes;
+
+    uint8_t* pixels;
+    size_t pixels_size;
+    struct gateway_histogram full_readback;
+    struct gateway_histogram damage_readback;
+    uint64_t full_bytes;
+    uint64_t damage_bytes;
+    uint32_t undamaged_frames;
+    uint64_t draws, culled; // over all frames
+    int32_t max_draws;
+};
+
+/* Input recording and replay, see -r and -p. A log is GATEWAY_RECORD_MAGIC
+ * followed by records, each a gateway_record_header and the fixed size
+ * payload of its type, in host byte order. Times are microseconds since the
+ * previous record. */
+#define GATEWAY_RECORD_MAGIC "GWREC\0\0\1"
+#define GATEWAY_RECORD_MAGIC_SIZE 8
+
+enum gateway_record_type {
+    GATEWAY_RECORD_OUTPUT = 1, // an output appeared
+    GATEWAY_RECORD_KEY,
+    GATEWAY_RECORD_MOTION,
+    GATEWAY_RECORD_MOTION_ABSOLUTE,
+    GATEWAY_RECORD_BUTTON,
+    GATEWAY_RECORD_AXIS,
+    GATEWAY_RECORD_FRAME, // pointer frame, no payload
+    GATEWAY_RECORD_SURFACE,
+    GATEWAY_RECORD_TYPE_COUNT,
+};
+
+/* Surfaces come from clients, a replay can't create them. They are logged to
+ * tell whether the replayed session saw the same ones. */
+enum gateway_record_surface_event {
+    GATEWAY_RECORD_SURFACE_NEW,     // id of the gateway_surface
+    GATEWAY_RECORD_SURFACE_DESTROY,
+    GATEWAY_RECORD_SURFACE_MAP,     // id of the view
+    GATEWAY_RECORD_SURFACE_UNMAP,
+    GATEWAY_RECORD_SURFACE_EVENT_COUNT,
+};
+
+struct __attribute__((packed)) gateway_record_header {
+    uint8_t type;
+    uint32_t delta_us;
+};
+
+struct __attribute__((packed)) gateway_record_output {
+    uint16_t width, height;
+    int32_t refresh; // mHz
+    float scale;
+};
+
+struct __attribute__((packed)) gateway_record_key {
+    uint32_t keycode;
+    uint8_t state;
+};
+
+struct __attribute__((packed)) gateway_record_motion {
+    float dx, dy;
+    float unaccel_dx, unaccel_dy;
+};
+
+struct __attribute__((packed)) gateway_record_motion_absolute {
+    float x, y;
+};
+
+struct __attribute__((packed)) gateway_record_button {
+    uint32_t button;
+    uint8_t state;
+};
+
+struct __attribute__((packed)) gateway_record_axis {
+    float delta;
+    int32_t delta_discrete;
+    uint8_t orientation;
+    uint8_t source;
+};
+
+struct __attribute__((packed)) gateway_record_surface {
+    uint32_t id;
+    uint8_t event;
+};
+
+struct gateway_record {
+    FILE* file;
+    uint64_t last_ns; // time of the previous record
+    uint64_t records;
+};
+
+struct gateway_replay {
+    uint8_t* data; // the whole log
+    size_t size;
+    size_t offset;
+    uint64_t start_ns;
+    uint64_t next_ns; // when the previous record was due
+    uint64_t records;
+    struct wl_event_source* timer;
+    struct wlr_backend* headless;
+    struct wlr_input_device* keyboard;
+    struct wlr_input_device* pointer;
+    uint32_t surfaces_recorded[GATEWAY_RECORD_SURFACE_EVENT_COUNT];
+    uint32_t surfaces_seen[GATEWAY_RECORD_SURFACE_EVENT_COUNT];
+};
+
+/* Offscreen colour buffer the renderer can draw or blit into. */
+struct gateway_fbo {
+    GLuint fbo;
+    GLuint texture;
+    int32_t width, height;
+};
+
+/* Overview shows every view of the focused panel as a thumbnail in a grid,
+ * picked with the keyboard. Thumbnails are drawn into small offscreen buffers
+ * when their view commits damage, so a frame of the overview is one blit per
+ * view. */
+struct gateway_overview {
+    bool active;
+    int32_t selected;
+    uint64_t thumbnail_renders;
+};
+
+/* Clipboard manager, see clipboard_load_start. The regular clipboard and the
+ * primary selection are handled the same way. */
+enum gateway_selection_kind {
+    GATEWAY_SELECTION_CLIPBOARD,
+    GATEWAY_SELECTION_PRIMARY,
+    GATEWAY_SELECTION_COUNT,
+};
+
+struct gateway_clipboard_load;
+
+struct gateway_clipboard {
+    struct tinywl_server* server;
+    struct gateway_clipboard_load* loads[GATEWAY_SELECTION_COUNT]; // being read from their client
+    uint64_t cached;    // selections now served by the compositor
+    uint64_t too_large; // left with their client, over clipboard_max_kb
+    uint64_t failed;    // the client didn't deliver in time
+    uint64_t pastes;
+    uint64_t paste_bytes;
+};
+
+/* zwlr_screencopy_manager_v1. Frames are read back into a pixel buffer object
+ * once the output frame they capture is drawn and handed to the client when
+ * its fence has signalled. Fences are polled, on the next frame of the output
+ * and from a short timer, so the compositor never waits on a readback.
+ * Without GLES 3 the pixels are read synchronously. */
+enum gateway_screencopy_state {
+    GATEWAY_SCREENCOPY_WAITING_COPY,  // buffer parameters sent, waiting for copy
+    GATEWAY_SCREENCOPY_WAITING_FRAME, // waiting for the next (damaged) output frame
+    GATEWAY_SCREENCOPY_IN_FLIGHT,     // readback started, waiting for the fence
+};
+
+struct gateway_screencopy_frame {
+    struct wl_list link;
+    struct gateway_screencopy* screencopy;
+    struct wl_resource* resource; // NULL once the client destroyed it
+    struct tinywl_output* output;
+    struct tinywl_view* view;     // window capture instead of output
+    bool view_dirty;              // the view committed since the frame was copied
+    struct wlr_box box;           // output buffer coordinates
+    int32_t width, height;        // of the buffer, smaller than box when scaled down
+    enum gateway_screencopy_state state;
+    bool with_damage;
+    bool overlay_cursor;          // read after the software cursors are drawn
+    bool cursor_locked;           // holds the output on software cursors until it is read
+    struct wl_resource* buffer;
+    struct wl_listener buffer_destroy;
+    uint8_t* bench_data;          // destination of benchmark frames, instead of buffer
+
+    GLuint pbo;
+    size_t pbo_size;
+    GLsync fence;
+    struct wlr_box damage;        // sent with copy_with_damage, frame coordinates
+    struct timespec rendered;
+    uint64_t copy_ns;
+};
+
+/* What changed on an output since a client last copied it with damage. */
+struct gateway_screencopy_damage {
+    struct wl_list link;
+    struct wl_client* client;
+    struct tinywl_output* output;
+    pixman_region32_t region;
+    struct wl_listener client_destroy;
+};
+
+#define GATEWAY_SCREENCOPY_PBOS 4
+#define GATEWAY_SCREENCOPY_POLL_MS 2
+struct gateway_screencopy {
+    struct tinywl_server* server;
+    struct wl_global* global;
+    struct wl_list frames;
+    struct wl_list damages;
+    bool async;
+    GLenum gl_format;
+    uint32_t shm_format;
+    bool orientation_known;
+    bool y_invert; // the renderer leaves the bottom row first, like wlroots reports
+    GLuint free_pbos[GATEWAY_SCREENCOPY_PBOS];
+    size_t free_pbo_sizes[GATEWAY_SCREENCOPY_PBOS];
+    int32_t free_pbo_count;
+    struct gateway_fbo scaled; // downscaled frames are blitted here before readback
+
+    struct wl_global* window_global;
+    struct gateway_fbo window; // window captures are drawn here
+    struct wl_event_source* window_idle;
+    struct wl_event_source* readback_timer; // polls the fences of readbacks in flight
+    int32_t window_frames;
+
+    uint64_t frames_copied;
+    uint64_t frame_readback_ns; // of the output frame being drawn, both passes
+    struct gateway_histogram readback; // time output_frame spends on readbacks
+    struct gateway_histogram latency;  // copy request -> ready
+};
+
+/* Where a surface was drawn in a frame, compared against the previous frame
+ * of the same output to find what changed. */
+struct gateway_draw {
+    uint64_t surface_id;
+    uint32_t commits;
+    struct wlr_box box;
+};
+
+struct gateway_damage {
+    struct gateway_draw* draws;
+    int32_t draw_count, draw_capacity;
+    struct gateway_draw* last_draws;
+    int32_t last_draw_count, last_draw_capacity;
+    pixman_region32_t region; // output-local, scaled
+    bool whole;               // damage everything in the next frame
+    double cursor_x, cursor_y;
 };
 
 struct tinywl_server {
     struct gateway_config* config;
+    struct wl_event_source* config_watch;
+    struct xkb_keymap* keymap;
 	struct wl_display *wl_display;
 	struct wlr_backend *backend;
 	struct wlr_renderer *renderer;
@@ -82,6 +536,14 @@ struct tinywl_server {
 
     struct wlr_xwayland* xwayland;
     struct wl_listener new_xwayland_surface;
+    struct wl_listener xwayland_ready;
+    struct wl_event_source* xwayland_idle_timer;
+    int32_t xwayland_view_count;
+    struct wl_event_source* xwayland_probe; // reply of a running client count
+    int xwayland_probe_fd;
+    pid_t xwayland_probe_pid;
+    bool xwayland_running;
+    uint32_t xwayland_starts;
 
     struct wlr_layer_shell_v1* layer_shell;
     struct wl_listener new_layer_surface;
@@ -112,17 +574,51 @@ struct tinywl_server {
     struct gateway_panel* focused_panel;
 	struct wl_listener new_output;
 
-    struct wlr_screencopy_manager_v1* screencopy;
+    struct gateway_screencopy* screencopy;
+    struct wlr_gamma_control_manager_v1* gamma_control_manager;
+    struct wlr_export_dmabuf_manager_v1* export_dmabuf;
+    struct wlr_output_power_manager_v1* output_power_manager;
+    struct wl_listener output_power_set_mode;
+
+    struct wlr_idle* idle;
+    struct wlr_idle_inhibit_manager_v1* idle_inhibit_manager;
+    struct wl_listener new_idle_inhibitor;
+    int32_t idle_inhibitors;
+    struct wl_event_source* idle_timer;
+    uint64_t last_activity_ns;
+    bool idle_blanked; // outputs were turned off by the idle timer
     struct wlr_relative_pointer_manager_v1* relative_pointer;
     struct wlr_pointer_constraints_v1* pointer_constraints;
 
+    struct wl_listener new_surface;
+    struct wl_event_source* stats_signal;
+    struct gateway_stats stats;
+    struct gateway_watchdog watchdog;
+    struct gateway_startup startup;
+    struct gateway_bench bench;
+    struct gateway_record record;
+    struct gateway_sched sched;
+    struct gateway_replay replay;
+    struct gateway_overview overview;
+    struct gateway_clipboard clipboard;
+    struct wl_listener request_set_primary_selection;
+
+    int ipc_fd;
+    struct wl_event_source* ipc_source;
+    struct wl_list ipc_clients;
+    char ipc_path[108];
+
+    struct wl_list clients; // gateway_client
+
+    uint32_t next_view_id;
+    uint32_t next_output_index;
+    uint64_t next_surface_id;
     float brightness;
+    uint32_t color_temperature;
     bool passthrough_enabled;
-};
-
-struct gateway_panel_stack {
-    int32_t width, height, current_y, current_x, max_items, item_count;
-    bool mapped;
+    bool hud_enabled;
+    bool battery_profile;
+    bool gles3; // framebuffer blits, pixel buffer objects and fences
 };
 
 struct gateway_panel {
@@ -133,11 +629,31 @@ struct gateway_panel {
 
     struct gateway_panel_stack* stacks;
     int32_t stack_count;
+    struct gateway_layout_view* layout_views; // scratch for panel_update
+    int32_t layout_view_capacity;
 
     struct tinywl_output* main_output;
     struct wl_list outputs;
 };
 
+/* A surface to draw this frame, in output buffer coordinates. */
+struct gateway_draw_item {
+    struct wlr_surface* surface;
+    struct wlr_texture* texture;
+    struct wlr_box box;
+    struct gateway_damage* damage; // NULL when not drawn to the output itself
+    bool opaque; // covers its whole box
+};
+
+/* Surfaces are collected bottom to top and drawn in one go, see
+ * draw_list_submit. Reused every frame. */
+struct gateway_draw_list {
+    struct gateway_draw_item* items;
+    int32_t count;
+    int32_t capacity;
+    pixman_region32_t covered;
+};
+
 struct tinywl_output {
     struct wl_list link;
     struct wl_list plink; //panel list
@@ -145,13 +661,45 @@ struct tinywl_output {
     struct wlr_output *wlr_output;
     struct wl_listener frame;
     struct gateway_panel* panel;
+    uint32_t index; // bit in tinywl_view::outputs
+    struct wlr_output_mode* performance_mode; // picked when the output appeared
+    bool idle_off; // turned off by the idle timer, not by a client
     int32_t* stacks;
     int32_t stack_count;
+
+    uint64_t last_frame_ns;
+    int32_t frame_views, frame_surfaces, frame_culled;
+    struct gateway_frame_sample samples[GATEWAY_HUD_SAMPLES];
+    uint32_t sample_head;
+    struct wl_listener present;
+    bool present_pending; // the latest sample waits for its present event
+    uint64_t present_frame_ns; // when that frame started
+
+    bool gamma_dirty;  // brightness or temperature changed since the last frame
+    bool gamma_active; // brightness is in the gamma LUT, no need to blend
+    bool gamma_pending; // a ramp with the brightness goes out with the next commit
+    bool gamma_client; // a client owns the gamma of this output
+
+    struct gateway_damage damage;
+    struct gateway_draw_list draws;
+    struct gateway_fbo background; // layers 0 and 1, see output_update_background
+    bool background_dirty;
+    bool recording; // screencopy read this frame
+    double capture_scale; // screencopy frames are scaled down by this
+
+    /* Mirroring, see output_mirror_frame. */
+    char mirror_of[24]; // source output name, empty unless this is a mirror
+    struct gateway_fbo mirror_frame; // source: copy of the last frame
+    uint64_t frame_seq; // source: frames copied into mirror_frame
+    uint64_t mirror_seq; // mirror: the source frame on screen
+    bool mirror_shown;
+    bool mirror_gamma; // mirror: whether the source uses a gamma ramp
 };
 
 struct tinywl_view {
 	struct wl_list link;
 	struct tinywl_server *server;
+    uint32_t id; // stable handle for the IPC
 	struct wlr_xdg_surface *xdg_surface;
     struct wlr_xwayland_surface* xwayland_surface;
 	struct wl_listener map;
@@ -165,6 +713,10 @@ struct tinywl_view {
     bool is_fullscreen;
     struct gateway_panel* focused_by;
     int32_t stack_index;
+    bool mapped;
+    uint32_t outputs; // bit per tinywl_output::index the surfaces have entered
+    struct gateway_fbo thumbnail; // only while the overview is up
+    bool thumbnail_dirty;
 };
 
 struct gateway_layer_surface {
@@ -172,10 +724,52 @@ struct gateway_layer_surface {
     struct tinywl_server* server;
     struct wlr_layer_surface_v1* surface;
     bool mapped;
+    bool in_background; // in the background or bottom layer as of the last commit
 
     struct wl_listener map;
     struct wl_listener unmap;
     struct wl_listener destroy;
+    struct wl_listener commit;
+};
+
+/* What a wl_client costs the compositor. Rates are counted over windows of
+ * about a second. Outlives the wl_client until its last surface is gone,
+ * since libwayland may destroy the client before its resources. */
+struct gateway_client {
+    struct wl_list link;
+    struct tinywl_server* server;
+    struct wl_client* client; // NULL once disconnected
+    struct wl_listener destroy;
+    pid_t pid;
+    char name[16];
+
+    int32_t surfaces;
+    uint64_t shm_bytes, dmabuf_bytes; // attached buffers
+    uint64_t commits, frames, input_events;
+
+    uint64_t window_start_ns;
+    uint32_t window_commits, window_frames;
+    double commit_rate, frame_rate; // per second, of the last window
+
+    uint32_t fps_cap; // frame callbacks per second, 0 is no cap
+};
+
+/* Every wlr_surface a client creates, whatever its role. */
+struct gateway_surface {
+    struct tinywl_server* server;
+    struct wlr_surface* surface;
+    struct gateway_client* client;
+    uint64_t id;
+    uint32_t commits;
+    pixman_region32_t damage; // of the latest commit, surface coordinates
+    uint64_t buffer_bytes;
+    bool buffer_shm;
+    uint64_t last_frame_done_ns;
+    uint32_t outputs; // entered, bit per tinywl_output::index
+    bool outputs_checked; // a surface added to a placed view gets its outputs once
+
+    struct wl_listener commit;
+    struct wl_listener destroy;
 };
 
 struct tinywl_keyboard {
@@ -187,749 +781,3724 @@ struct tinywl_keyboard {
 	struct wl_listener key;
 };
 
-static void panel_update(struct gateway_panel* panel, struct tinywl_output* output);
+static uint64_t get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
 
-static void focus_view(struct tinywl_view *view, struct gateway_panel* panel, bool mouse_focus) {
-	/* Note: this function only deals with keyboard focus. */
-	if (view == NULL) {
-		return;
-	}
-	struct tinywl_server *server = view->server;
-	struct wlr_seat *seat = server->seat;
-	struct wlr_surface *prev_surface = seat->keyboard_state.focused_surface;
-    struct wlr_surface* surface;
-    if(view->xwayland_surface != NULL)
+static void histogram_add(struct gateway_histogram* hist, uint64_t us)
+{
+    uint32_t bucket = 0;
+    while(bucket + 1 < GATEWAY_HISTOGRAM_BUCKETS && (us >> bucket) != 0) { bucket++; }
+    hist->buckets[bucket]++;
+    hist->count++;
+    hist->sum_us += us;
+    if(us > hist->max_us) { hist->max_us = us; }
+}
+
+/* Returns the upper edge of the bucket holding the given percentile, so the
+ * result is an upper bound that is at most a factor of two off. */
+static uint64_t histogram_percentile(struct gateway_histogram* hist, double percentile)
+{
+    if(hist->count == 0) { return 0; }
+    uint64_t target = (uint64_t)(hist->count * percentile / 100.0);
+    if(target >= hist->count) { target = hist->count - 1; }
+    uint64_t seen = 0;
+    for(int i = 0; i < GATEWAY_HISTOGRAM_BUCKETS; i++)
     {
-        surface = view->xwayland_surface->surface;
-    } else if(view->xdg_surface != NULL)
+        seen += hist->buckets[i];
+        if(seen > target)
+        {
+            uint64_t edge = (uint64_t)1 << i;
+            return edge < hist->max_us ? edge : hist->max_us;
+        }
+    }
+    return hist->max_us;
+}
+
+static void histogram_log(const char* name, struct gateway_histogram* hist)
+{
+    if(hist->count == 0)
     {
-        surface = view->xdg_surface->surface;
+        wlr_log(WLR_INFO, "  %-28s no samples", name);
+        return;
     }
-    if(!mouse_focus)
+    wlr_log(WLR_INFO, "  %-28s n=%lu avg=%luus p50<=%luus p90<=%luus p99<=%luus max=%luus",
+        name, hist->count, hist->sum_us / hist->count,
+        histogram_percentile(hist, 50.0), histogram_percentile(hist, 90.0),
+        histogram_percentile(hist, 99.0), hist->max_us);
+}
+
+static const char* latency_kind_names[GATEWAY_LATENCY_KIND_COUNT] = { "key", "motion" };
+
+static void latency_init(struct gateway_latency* latency)
+{
+    const char* path = getenv("GATEWAY_LATENCY_TRACE");
+    if(path == NULL) { return; }
+    latency->trace_file = fopen(path, "w");
+    if(latency->trace_file == NULL)
     {
-        wlr_cursor_warp(view->server->cursor, NULL, view->x + (view->width / 2),
-            view->y + (view->height / 2));
+        wlr_log(WLR_ERROR, "Could not open latency trace %s", path);
+        return;
     }
-	if (prev_surface == surface) {
-		/* Don't re-focus an already focused surface. */// because X we can't do this. :(
-		return; // Oh no it's a lot worse. We have to have this because X
-	}
-    if(prev_surface) {
-		if(wlr_surface_is_xdg_surface(prev_surface))
+    fprintf(latency->trace_file,
+        "kind,device_ms,arrival_ns,device_us,delivery_us,commit_us,present_us,total_us\n");
+}
+
+/* Called once the input event has been handed to a client. surface is the
+ * surface that received it, NULL when nobody did and there is nothing to
+ * follow. */
+static void latency_input_delivered(struct gateway_latency* latency, enum gateway_latency_kind kind,
+    uint32_t device_msec, uint64_t arrival_ns, struct wlr_surface* surface)
+{
+    if(surface == NULL) { return; }
+    struct gateway_latency_event* event = &latency->events[latency->head];
+    latency->head = (latency->head + 1) % GATEWAY_LATENCY_RING;
+    if(event->stage != GATEWAY_LATENCY_FREE) { latency->overwritten++; latency->pending--; }
+
+    event->kind = kind;
+    event->stage = GATEWAY_LATENCY_DELIVERED;
+    event->device_msec = device_msec;
+    event->arrival_ns = arrival_ns;
+    event->delivered_ns = get_time_ns();
+    event->commit_ns = 0;
+    event->surface = surface;
+    latency->pending++;
+}
+
+static void latency_surface_commit(struct gateway_latency* latency, struct wlr_surface* surface)
+{
+    if(latency->pending == 0) { return; }
+    uint64_t now = get_time_ns();
+    for(int i = 0; i < GATEWAY_LATENCY_RING; i++)
+    {
+        struct gateway_latency_event* event = &latency->events[i];
+        if(event->stage == GATEWAY_LATENCY_FREE) { continue; }
+        if(event->stage == GATEWAY_LATENCY_DELIVERED && event->surface == surface)
         {
-            struct wlr_xdg_surface *previous = wlr_xdg_surface_from_wlr_surface(
-                    prev_surface);
-            wlr_xdg_toplevel_set_activated(previous, false);
-        } else if(wlr_surface_is_xwayland_surface(prev_surface))
+            event->stage = GATEWAY_LATENCY_COMMITTED;
+            event->commit_ns = now;
+        } else if(now - event->arrival_ns > GATEWAY_LATENCY_TIMEOUT_NS)
         {
-            struct wlr_xwayland_surface *previous = 
-                wlr_xwayland_surface_from_wlr_surface(
-                    prev_surface
-                );
-            wlr_xwayland_surface_activate(previous, false);
-        }
-	}
-    struct tinywl_view* other_view;
-    wl_list_for_each(other_view, &server->focused_panel->views, link) {
-        if(other_view->xwayland_surface != NULL) {
-            wlr_xwayland_surface_activate(other_view->xwayland_surface, false);
+            /* The client never drew anything in response, e.g. a key release
+             * or hovering over something static. */
+            event->stage = GATEWAY_LATENCY_FREE;
+            latency->pending--;
+            latency->expired++;
         }
     }
-	struct wlr_keyboard *keyboard = wlr_seat_get_keyboard(seat);
-    if(panel->focused_view != NULL) {
-        panel->focused_view->focused_by = NULL;
-    }
-    panel->focused_view = view;
-    view->focused_by = panel;
-	/* Activate the new surface */
-	if(view->xdg_surface != NULL)
+}
+
+static void latency_surface_rendered(struct gateway_latency* latency, struct wlr_surface* surface,
+    struct tinywl_output* output)
+{
+    if(latency->pending == 0) { return; }
+    for(int i = 0; i < GATEWAY_LATENCY_RING; i++)
     {
-        wlr_xdg_toplevel_set_activated(view->xdg_surface, true);
-        wlr_seat_keyboard_notify_enter(seat, surface,
-            keyboard->keycodes, keyboard->num_keycodes, &keyboard->modifiers);
-    } else if(view->xwayland_surface != NULL) {
-        wlr_xwayland_surface_activate(view->xwayland_surface, true);
-        wlr_seat_keyboard_notify_enter(seat, surface,
-            keyboard->keycodes, keyboard->num_keycodes, &keyboard->modifiers);
+        struct gateway_latency_event* event = &latency->events[i];
+        if(event->stage == GATEWAY_LATENCY_COMMITTED && event->surface == surface)
+        {
+            event->stage = GATEWAY_LATENCY_RENDERED;
+            event->output = output;
+        }
     }
 }
 
-static void center_mouse(struct tinywl_server* server)
+/* Called after wlr_output_commit of output succeeded, everything drawn in
+ * that frame is now on its way to the screen. */
+static void latency_frame_committed(struct gateway_latency* latency, struct tinywl_output* output)
 {
-    struct tinywl_output* output;
-    wl_list_for_each(output, &server->focused_panel->outputs, plink) {
-        panel_update(server->focused_panel, output);
+    if(latency->pending == 0) { return; }
+    uint64_t now = get_time_ns();
+    for(int i = 0; i < GATEWAY_LATENCY_RING; i++)
+    {
+        struct gateway_latency_event* event = &latency->events[i];
+        if(event->stage != GATEWAY_LATENCY_RENDERED || event->output != output) { continue; }
+
+        /* libinput timestamps are CLOCK_MONOTONIC milliseconds, the same
+         * clock we stamp the arrival with. */
+        uint32_t arrival_msec = (uint32_t)(event->arrival_ns / 1000000ull);
+        uint64_t device_us = (uint64_t)(uint32_t)(arrival_msec - event->device_msec) * 1000;
+        uint64_t delivery_us = (event->delivered_ns - event->arrival_ns) / 1000;
+        uint64_t commit_us = (event->commit_ns - event->delivered_ns) / 1000;
+        uint64_t present_us = (now - event->commit_ns) / 1000;
+        uint64_t total_us = (now - event->arrival_ns) / 1000;
+
+        // Devices which don't use the monotonic clock give nonsense here.
+        if(device_us < GATEWAY_LATENCY_TIMEOUT_NS / 1000)
+        { histogram_add(&latency->device[event->kind], device_us); }
+        histogram_add(&latency->delivery[event->kind], delivery_us);
+        histogram_add(&latency->commit[event->kind], commit_us);
+        histogram_add(&latency->present[event->kind], present_us);
+        histogram_add(&latency->total[event->kind], total_us);
+
+        if(latency->trace_file != NULL)
+        {
+            fprintf(latency->trace_file, "%s,%u,%lu,%lu,%lu,%lu,%lu,%lu\n",
+                latency_kind_names[event->kind], event->device_msec, event->arrival_ns,
+                device_us, delivery_us, commit_us, present_us, total_us);
+        }
+
+        event->stage = GATEWAY_LATENCY_FREE;
+        latency->pending--;
     }
-    focus_view(server->focused_panel->focused_view, server->focused_panel, false);
-    wlr_cursor_set_surface(server->cursor, NULL, 0, 0);
 }
 
-static void move_to_front(struct tinywl_view *view)
+static void latency_surface_destroyed(struct gateway_latency* latency, struct wlr_surface* surface)
 {
-    struct tinywl_server *server = view->server;
-    /* Move the view to the front */
-    wl_list_remove(&view->link);
-    wl_list_insert(&server->focused_panel->views, &view->link);
+    for(int i = 0; i < GATEWAY_LATENCY_RING; i++)
+    {
+        struct gateway_latency_event* event = &latency->events[i];
+        if(event->stage == GATEWAY_LATENCY_FREE || event->surface != surface) { continue; }
+        event->stage = GATEWAY_LATENCY_FREE;
+        latency->pending--;
+        latency->expired++;
+    }
 }
 
-static void keyboard_handle_modifiers(
-		struct wl_listener *listener, void *data) {
-	/* This event is raised when a modifier key, such as shift or alt, is
-	 * pressed. We simply communicate this to the client. */
-	struct tinywl_keyboard *keyboard =
-		wl_container_of(listener, keyboard, modifiers);
-	/*
-	 * A seat can only have one keyboard, but this is a limitation of the
-	 * Wayland protocol - not wlroots. We assign all connected keyboards to the
-	 * same seat. You can swap out the underlying wlr_keyboard like this and
-	 * wlr_seat handles this transparently.
-	 */
-	wlr_seat_set_keyboard(keyboard->server->seat, keyboard->device);
-	/* Send modifiers to the client. */
-	wlr_seat_keyboard_notify_modifiers(keyboard->server->seat,
-		&keyboard->device->keyboard->modifiers);
+static void latency_log(struct gateway_latency* latency)
+{
+    char name[64];
+    for(int k = 0; k < GATEWAY_LATENCY_KIND_COUNT; k++)
+    {
+        const char* kind = latency_kind_names[k];
+        snprintf(name, sizeof(name), "%s device->arrival", kind);
+        histogram_log(name, &latency->device[k]);
+        snprintf(name, sizeof(name), "%s arrival->client", kind);
+        histogram_log(name, &latency->delivery[k]);
+        snprintf(name, sizeof(name), "%s client->commit", kind);
+        histogram_log(name, &latency->commit[k]);
+        snprintf(name, sizeof(name), "%s commit->output", kind);
+        histogram_log(name, &latency->present[k]);
+        snprintf(name, sizeof(name), "%s input->output", kind);
+        histogram_log(name, &latency->total[k]);
+    }
+    wlr_log(WLR_INFO, "  latency events pending=%u expired=%lu overwritten=%lu",
+        latency->pending, latency->expired, latency->overwritten);
+    if(latency->trace_file != NULL) { fflush(latency->trace_file); }
 }
-static void list_swap(struct wl_list* a, struct wl_list* b) // swaps order in views a-b -> b-a
+
+/* The watchdog thread only looks at the atomics below, everything else in
+ * here is owned by the compositor thread. */
+static void watchdog_backtrace_signal(int signal)
 {
-    struct wl_list* linknext = b->next;
-    
-    struct wl_list* linkprev = a->prev;
+    void* frames[64];
+    int count = backtrace(frames, 64);
+    static const char header[] = "gateway: backtrace of the stalled event loop:\n";
+    if(write(STDERR_FILENO, header, sizeof(header) - 1) < 0) { return; }
+    backtrace_symbols_fd(frames, count, STDERR_FILENO);
+}
 
-    linkprev->next = b;
-    b->prev = linkprev;
+static void* watchdog_thread(void* data)
+{
+    struct gateway_watchdog* watchdog = data;
+    uint64_t budget_ns = (uint64_t)watchdog->budget_ms * 1000000ull;
+    struct timespec interval = {
+        .tv_sec = watchdog->budget_ms / 2000,
+        .tv_nsec = (long)(watchdog->budget_ms % 2000) * 500000l,
+    };
+    uint64_t reported_generation = 0;
+    while(atomic_load(&watchdog->running))
+    {
+        nanosleep(&interval, NULL);
+        uint64_t now = get_time_ns();
+        uint64_t generation;
+        const char* listener;
+        uint64_t start;
+        do {
+            generation = atomic_load(&watchdog->seq);
+            listener = atomic_load(&watchdog->listener);
+            start = atomic_load(&watchdog->start_ns);
+        } while((generation & 1) || generation != atomic_load(&watchdog->seq));
+        uint64_t heartbeat = atomic_load(&watchdog->heartbeat_ns);
+
+        bool stalled = false;
+        if(listener != NULL && now - start > budget_ns) {
+            stalled = true;
+        } else if(listener == NULL && now - heartbeat > 2 * budget_ns) {
+            /* No instrumented listener is running but the heartbeat timer
+             * didn't fire either, something else is holding the loop. */
+            listener = "(uninstrumented)";
+            start = heartbeat;
+            generation = heartbeat;
+            stalled = true;
+        }
+        if(!stalled || generation == reported_generation) { continue; }
+        reported_generation = generation;
 
-    b->next = a;
-    a->prev = b;
+        wlr_log(WLR_ERROR, "Watchdog: event loop stalled in %s for %lu ms and counting",
+            listener, (now - start) / 1000000);
+        pthread_kill(watchdog->main_thread, SIGUSR2);
+    }
+    return NULL;
+}
 
-    a->next = linknext;
-    linknext->prev = a;
+static int watchdog_heartbeat(void* data)
+{
+    struct gateway_watchdog* watchdog = data;
+    atomic_store(&watchdog->heartbeat_ns, get_time_ns());
+    wl_event_source_timer_update(watchdog->heartbeat, watchdog->budget_ms);
+    return 0;
 }
-static bool handle_keybinding(struct tinywl_server *server, uint32_t keycode, uint32_t modifiers) {
-    if(server->passthrough_enabled && keycode != 88) {
-        return false;
-    }
-    if(keycode == 88) {
-        server->passthrough_enabled = !server->passthrough_enabled;
-        return true;
-    }
 
-    if(keycode == 1)
+static void watchdog_init(struct gateway_watchdog* watchdog, struct wl_event_loop* loop, uint32_t budget_ms)
+{
+    watchdog->budget_ms = budget_ms;
+    if(budget_ms == 0) { return; }
+
+    /* backtrace() loads libgcc lazily, make sure that doesn't first happen
+     * inside the signal handler. */
+    void* frames[1];
+    backtrace(frames, 1);
+
+    struct sigaction action = {0};
+    action.sa_handler = watchdog_backtrace_signal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &action, NULL);
+
+    watchdog->main_thread = pthread_self();
+    atomic_store(&watchdog->heartbeat_ns, get_time_ns());
+    watchdog->heartbeat = wl_event_loop_add_timer(loop, watchdog_heartbeat, watchdog);
+    wl_event_source_timer_update(watchdog->heartbeat, budget_ms);
+
+    atomic_store(&watchdog->running, true);
+    if(pthread_create(&watchdog->thread, NULL, watchdog_thread, watchdog) != 0)
     {
-        wl_display_terminate(server->wl_display);
-        assert(0);
+        wlr_log(WLR_ERROR, "Could not start the watchdog thread");
+        atomic_store(&watchdog->running, false);
+        wl_event_source_remove(watchdog->heartbeat);
+        watchdog->heartbeat = NULL;
     }
-    else if(keycode == 36 && (modifiers & WLR_MODIFIER_SHIFT) == 0)
-    {
-        if (wl_list_length(&server->focused_panel->views) < 2) {
-            return false;
-        }
-        struct tinywl_view* current_view = server->focused_panel->focused_view;
-        struct wl_list* linknext = current_view->link.prev;
-        if(linknext == &server->focused_panel->views) { linknext = linknext->prev; }
-        struct tinywl_view* next_view = wl_container_of(
-            linknext, next_view, link);
+}
 
-        focus_view(next_view, server->focused_panel, false);
-        center_mouse(server);
-    }
-    else if(keycode == 37 && (modifiers & WLR_MODIFIER_SHIFT) == 0)
-    {
-        if (wl_list_length(&server->focused_panel->views) < 2) {
-            return false;
-        }
-        struct tinywl_view* current_view = server->focused_panel->focused_view;
-        struct wl_list* linknext = current_view->link.next;
-        if(linknext == &server->focused_panel->views) { linknext = linknext->next; }
-        struct tinywl_view* next_view = wl_container_of(
-            linknext, next_view, link);
+static void watchdog_finish(struct gateway_watchdog* watchdog)
+{
+    if(!atomic_load(&watchdog->running)) { return; }
+    atomic_store(&watchdog->running, false);
+    pthread_join(watchdog->thread, NULL);
+    wl_event_source_remove(watchdog->heartbeat);
+}
 
-        focus_view(next_view, server->focused_panel, false);
-        center_mouse(server);
-    }
-    else if(keycode == 38)
-    {
-        if (wl_list_length(&server->focused_panel->views) < 2) {
-            return false;
-        }
+/* Brackets a listener so a stall can be attributed to it. Nested calls are
+ * counted towards the outermost listener. */
+static void watchdog_enter(struct gateway_watchdog* watchdog, const char* listener)
+{
+    if(watchdog->depth++ > 0) { return; }
+    atomic_fetch_add(&watchdog->seq, 1);
+    atomic_store(&watchdog->start_ns, get_time_ns());
+    atomic_store(&watchdog->listener, listener);
+    atomic_fetch_add(&watchdog->seq, 1);
+}
 
-        struct tinywl_view* next_view = wl_container_of(
-            server->focused_panel->views.prev, next_view, link);
- 
-        focus_view(next_view, server->focused_panel, false);
-        center_mouse(server);
-    }
-    else if(keycode == 36 && (modifiers & WLR_MODIFIER_SHIFT) != 0)
-    {
-        if (wl_list_length(&server->focused_panel->views) < 2) {
-            return false;
-        }
-        struct tinywl_view* current_view = server->focused_panel->focused_view;
-        list_swap(current_view->link.prev, &current_view->link);
-        center_mouse(server);
-    }
-    else if(keycode == 37 && (modifiers & WLR_MODIFIER_SHIFT) != 0)
-    {
-        if (wl_list_length(&server->focused_panel->views) < 2) {
-            return false;
-        }
-        struct tinywl_view* current_view = server->focused_panel->focused_view;
-        list_swap(&current_view->link, current_view->link.next);
-        center_mouse(server);
-    }
-    else if(keycode == 49)
+static void watchdog_leave(struct gateway_watchdog* watchdog)
+{
+    if(--watchdog->depth > 0) { return; }
+    const char* listener = atomic_load(&watchdog->listener);
+    atomic_fetch_add(&watchdog->seq, 1);
+    atomic_store(&watchdog->listener, NULL);
+    atomic_fetch_add(&watchdog->seq, 1);
+    if(watchdog->budget_ms == 0) { return; }
+
+    uint64_t duration_us = (get_time_ns() - atomic_load(&watchdog->start_ns)) / 1000;
+    if(duration_us <= (uint64_t)watchdog->budget_ms * 1000) { return; }
+
+    watchdog->stalls++;
+    histogram_add(&watchdog->stall_durations, duration_us);
+    if(duration_us > watchdog->worst_us)
     {
-        if(server->focused_panel->focused_view != NULL)
-        {
-            move_to_front(server->focused_panel->focused_view);
-            center_mouse(server);
-        }
+        watchdog->worst_us = duration_us;
+        watchdog->worst_listener = listener;
     }
-    else if(keycode == 21)
+    wlr_log(WLR_ERROR, "Watchdog: %s blocked the event loop for %lu ms (budget %u ms)",
+        listener, duration_us / 1000, watchdog->budget_ms);
+}
+
+static void watchdog_log(struct gateway_watchdog* watchdog)
+{
+    if(watchdog->budget_ms == 0)
     {
-        server->focused_panel->focused_view->is_fullscreen = 
-                !server->focused_panel->focused_view->is_fullscreen;
+        wlr_log(WLR_INFO, "  watchdog disabled");
+        return;
     }
-    else if(keycode == 28)
+    wlr_log(WLR_INFO, "  event loop stalls over %u ms: %lu, worst %lu ms in %s",
+        watchdog->budget_ms, watchdog->stalls, watchdog->worst_us / 1000,
+        watchdog->worst_listener != NULL ? watchdog->worst_listener : "-");
+    histogram_log("stall duration", &watchdog->stall_durations);
+}
+
+/* Logged with the frame times so runs with and without the scheduling
+ * options can be told apart. */
+static void sched_log(struct gateway_sched* sched)
+{
+    char cpus[32] = "any";
+    if(sched->cpus != 0) { snprintf(cpus, sizeof(cpus), "0x%lx", sched->cpus); }
+    if(sched->policy == SCHED_RR)
+    { wlr_log(WLR_INFO, "  event loop SCHED_RR %d, cpus %s", sched->priority, cpus); }
+    else
+    { wlr_log(WLR_INFO, "  event loop nice %d, cpus %s", sched->nice, cpus); }
+    wlr_log(WLR_INFO, "  memory %s", !sched->locked ? "not locked" :
+        sched->locked_future ? "locked" : "locked at startup");
+}
+
+static void startup_init(struct gateway_startup* startup)
+{
+    startup->start_ns = get_time_ns();
+    startup->last_ns = startup->start_ns;
+}
+
+static void startup_mark(struct gateway_startup* startup, const char* format, ...)
+{
+    uint64_t now = get_time_ns();
+    char name[sizeof(startup->marks[0].name)];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(name, sizeof(name), format, args);
+    va_end(args);
+
+    wlr_log(WLR_INFO, "Startup: %-32s %8.2f ms (+%.2f ms)", name,
+        (now - startup->start_ns) / 1000000.0, (now - startup->last_ns) / 1000000.0);
+    startup->last_ns = now;
+    if(startup->mark_count == GATEWAY_STARTUP_MARKS) { return; }
+    struct gateway_startup_mark* mark = &startup->marks[startup->mark_count++];
+    strcpy(mark->name, name);
+    mark->ns = now - startup->start_ns;
+}
+
+static void startup_log(struct gateway_startup* startup)
+{
+    for(int32_t i = 0; i < startup->mark_count; i++)
     {
-        char cmd[512];
-        strcpy(cmd, server->config->terminal);
-        strcat(cmd, " &");
-        system(cmd);
+        wlr_log(WLR_INFO, "  startup %-32s %8.2f ms", startup->marks[i].name,
+            startup->marks[i].ns / 1000000.0);
     }
-    else if(keycode == 35)
+}
+
+static void server_log_stats(struct tinywl_server* server)
+{
+    wlr_log(WLR_INFO, "Gateway runtime stats:");
+    wlr_log(WLR_INFO, "  frames %lu, dropped %lu", server->stats.frames, server->stats.dropped_frames);
+    histogram_log("frame interval", &server->stats.frame_interval);
+    histogram_log("frame layout", &server->stats.frame_layout);
+    histogram_log("frame render", &server->stats.frame_render);
+    histogram_log("frame render recording", &server->stats.frame_render_recording);
+    wlr_log(WLR_INFO, "  hit tests %lu, %.0f ns on average", server->stats.hit_tests,
+        server->stats.hit_tests > 0 ? (double)server->stats.hit_test_ns / server->stats.hit_tests : 0.0);
+    if(server->screencopy != NULL)
     {
-        char cmd[512];
-        strcpy(cmd, server->config->launcher);
-        strcat(cmd, " &");
-        system(cmd);
+        wlr_log(WLR_INFO, "  screencopy frames %lu", server->screencopy->frames_copied);
+        histogram_log("screencopy readback", &server->screencopy->readback);
+        histogram_log("screencopy latency", &server->screencopy->latency);
     }
-    else if(keycode == 53 && (modifiers && WLR_MODIFIER_SHIFT) == 1)
-    {
-        if(server->focused_panel->focused_view == NULL) { return false; }
+    latency_log(&server->stats.latency);
+    sched_log(&server->sched);
+    watchdog_log(&server->watchdog);
+    startup_log(&server->startup);
+    wlr_log(WLR_INFO, "  Xwayland started %u times, %s now with %d windows", server->xwayland_starts,
+        server->xwayland_running ? "running" : "not running", server->xwayland_view_count);
+}
 
-        struct tinywl_view* current_view = server->focused_panel->focused_view;
-        struct wl_list* linknext = current_view->link.next;
-        if(linknext == &server->focused_panel->views) { linknext = linknext->next; }
-        struct tinywl_view* next_view = wl_container_of(
-            linknext, next_view, link);
-        if(current_view->xdg_surface != NULL){ wlr_xdg_toplevel_send_close(current_view->xdg_surface); }
-        if(current_view->xwayland_surface != NULL)
-        { wlr_xwayland_surface_close(current_view->xwayland_surface); }
+static int handle_stats_signal(int signal, void* data)
+{
+    server_log_stats(data);
+    return 0;
+}
 
-        if(next_view == current_view) { server->focused_panel->focused_view = NULL; }
-        else { server->focused_panel->focused_view = next_view; }
-        center_mouse(server);
-    }
-    else
+static bool record_open(struct gateway_record* record, const char* path)
+{
+    record->file = fopen(path, "wb");
+    if(record->file == NULL)
     {
+        wlr_log(WLR_ERROR, "Could not open %s to record input: %s", path, strerror(errno));
         return false;
     }
+    fwrite(GATEWAY_RECORD_MAGIC, GATEWAY_RECORD_MAGIC_SIZE, 1, record->file);
+    record->last_ns = get_time_ns();
     return true;
 }
 
-static void keyboard_handle_key(
-		struct wl_listener *listener, void *data) {
-	/* This event is raised when a key is pressed or released. */
-	struct tinywl_keyboard *keyboard =
-		wl_container_of(listener, keyboard, key);
-	struct tinywl_server *server = keyboard->server;
-	struct wlr_event_keyboard_key *event = data;
-	struct wlr_seat *seat = server->seat;
-
-	/* Translate libinput keycode -> xkbcommon */
-	uint32_t keycode = event->keycode + 8;
-	/* Get a list of keysyms based on the keymap for this keyboard */
-	const xkb_keysym_t *syms;
-	int nsyms = xkb_state_key_get_syms(
-			keyboard->device->keyboard->xkb_state, keycode, &syms);
+static void record_close(struct gateway_record* record)
+{
+    if(record->file == NULL) { return; }
+    fclose(record->file);
+    wlr_log(WLR_INFO, "Recorded %lu events", record->records);
+    record->file = NULL;
+}
 
-	bool handled = false;
-	uint32_t modifiers = wlr_keyboard_get_modifiers(keyboard->device->keyboard);
+/* Buffered by stdio, a record costs a memcpy. */
+static void record_write(struct tinywl_server* server, enum gateway_record_type type,
+    const void* payload, size_t size)
+{
+    struct gateway_record* record = &server->record;
+    if(record->file == NULL) { return; }
+    uint64_t delta_us = (get_time_ns() - record->last_ns) / 1000;
+    if(delta_us > UINT32_MAX) { delta_us = UINT32_MAX; }
+    record->last_ns += delta_us * 1000;
+    struct gateway_record_header header = { .type = type, .delta_us = delta_us };
+    fwrite(&header, sizeof(header), 1, record->file);
+    if(size > 0) { fwrite(payload, size, 1, record->file); }
+    record->records++;
+}
 
-	if ((modifiers & WLR_MODIFIER_LOGO) && event->state == WL_KEYBOARD_KEY_STATE_PRESSED) {
-        handled = handle_keybinding(server, event->keycode, modifiers);
-	}
-    struct wlr_session* session = wlr_backend_get_session(server->backend); //Virtual terminals
-    if(session != NULL && (modifiers & WLR_MODIFIER_CTRL) && (modifiers & WLR_MODIFIER_ALT)){
-        for(int i = 0; i < nsyms; i++) {
-            for(int x = 1; x <= 12; x++){
-                if(syms[i] == 269024768 + x) {
-                    wlr_session_change_vt(session, x);
-                }
-            }
-        }
+static void record_surface(struct tinywl_server* server, enum gateway_record_surface_event event,
+    uint32_t id)
+{
+    if(server->replay.data != NULL)
+    {
+        server->replay.surfaces_seen[event]++;
+        return;
     }
+    struct gateway_record_surface payload = { .id = id, .event = event };
+    record_write(server, GATEWAY_RECORD_SURFACE, &payload, sizeof(payload));
+}
 
-    if(event->state != WL_KEYBOARD_KEY_STATE_RELEASED) {
-    for(int i = 0; i < nsyms; i++) {
-        if(syms[i] == XKB_KEY_XF86MonBrightnessUp) {
-            server->brightness += 0.05;
-        }
-        if(syms[i] == XKB_KEY_XF86MonBrightnessDown) {
-            server->brightness -= 0.05;
-        }
-        if(syms[i] == XKB_KEY_XF86AudioRaiseVolume) {
-            system("pamixer -i 10");
-        }
-        if(syms[i] == XKB_KEY_XF86AudioLowerVolume) {
-            system("pamixer -d 10");
-        }
-        if(syms[i] == XKB_KEY_XF86AudioMute) {
-            system("pamixer -t");
-        }
-    }}
-    if(server->brightness > 1.0) { server->brightness = 1.0; }
-else if(server->brightness< 0.0) { server->brightness = 0.0; }
+static void screencopy_surface_commit(struct gateway_screencopy* screencopy, struct wlr_surface* surface);
+static void screencopy_view_destroyed(struct gateway_screencopy* screencopy, struct tinywl_view* view);
+static struct gateway_surface* gateway_surface_from_wlr(struct wlr_surface* surface);
+static void overview_surface_commit(struct tinywl_server* server, struct gateway_surface* gsurface);
+static void surface_enter_view_outputs(struct gateway_surface* gsurface);
+static void overview_view_destroyed(struct tinywl_server* server, struct tinywl_view* view);
+static void overview_handle_key(struct tinywl_server* server, uint32_t keycode);
+static void server_set_overview(struct tinywl_server* server, bool active);
 
-	if (!handled) {
-        struct wlr_keyboard *wkeyboard = wlr_seat_get_keyboard(seat);
-        struct gateway_layer_surface* ls;
-        wl_list_for_each(ls, &server->layer_surfaces, link) {
-            if(!ls->mapped || !ls->surface->current.keyboard_interactive) { continue; }
-            handled = true;
+static void gateway_client_free(struct gateway_client* client)
+{
+    if(client->client != NULL)
+    {
+        wl_list_remove(&client->destroy.link);
+        wl_list_remove(&client->link);
+    }
+    free(client);
+}
 
-            wlr_seat_keyboard_notify_enter(seat, ls->surface->surface,
-                wkeyboard->keycodes, wkeyboard->num_keycodes, &wkeyboard->modifiers);
-            break;
-        }
-        if(!handled && server->focused_panel->focused_view != NULL)
-        {
-        if(server->focused_panel->focused_view->xdg_surface != NULL) {
-            wlr_seat_keyboard_notify_enter(seat, server->focused_panel->focused_view->xdg_surface->surface,
-                wkeyboard->keycodes, wkeyboard->num_keycodes, &wkeyboard->modifiers);
-        }else if(server->focused_panel->focused_view->xwayland_surface != NULL) {
-            wlr_seat_keyboard_notify_enter(seat, server->focused_panel->focused_view->xwayland_surface->surface,
-                wkeyboard->keycodes, wkeyboard->num_keycodes, &wkeyboard->modifiers);
-        }
-        }
-		/* Otherwise, we pass it along to the client. */
-		wlr_seat_set_keyboard(seat, keyboard->device);
-		wlr_seat_keyboard_notify_key(seat, event->time_msec,
-			event->keycode, event->state);
-	}
+static void gateway_client_destroy(struct wl_listener* listener, void* data)
+{
+    struct gateway_client* client = wl_container_of(listener, client, destroy);
+    if(client->surfaces == 0) { gateway_client_free(client); return; }
+    wl_list_remove(&client->destroy.link);
+    wl_list_remove(&client->link);
+    client->client = NULL;
 }
 
-static void server_new_keyboard(struct tinywl_server *server,
-		struct wlr_input_device *device) {
-	struct tinywl_keyboard *keyboard =
-		calloc(1, sizeof(struct tinywl_keyboard));
-	keyboard->server = server;
-	keyboard->device = device;
+static struct gateway_client* gateway_client_get(struct tinywl_server* server, struct wl_client* wl_client)
+{
+    struct wl_listener* listener = wl_client_get_destroy_listener(wl_client, gateway_client_destroy);
+    if(listener != NULL)
+    {
+        struct gateway_client* client = wl_container_of(listener, client, destroy);
+        return client;
+    }
+    struct gateway_client* client = calloc(1, sizeof(struct gateway_client));
+    client->server = server;
+    client->client = wl_client;
+    client->window_start_ns = get_time_ns();
+    wl_client_get_credentials(wl_client, &client->pid, NULL, NULL);
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/comm", client->pid);
+    FILE* comm = fopen(path, "r");
+    if(comm != NULL)
+    {
+        if(fgets(client->name, sizeof(client->name), comm) != NULL)
+        { client->name[strcspn(client->name, "\n")] = '\0'; }
+        fclose(comm);
+    }
+    client->destroy.notify = gateway_client_destroy;
+    wl_client_add_destroy_listener(wl_client, &client->destroy);
+    wl_list_insert(&server->clients, &client->link);
+    return client;
+}
 
-	/* We need to prepare an XKB keymap and assign it to the keyboard. This
-	 * assumes the defaults (e.g. layout = "us"). */
-	struct xkb_rule_names rules = { 0 };
-    rules.layout = server->config->kbd_layout;
-    rules.variant = server->config->kbd_variant;
+static void gateway_client_tick(struct gateway_client* client, uint64_t now_ns)
+{
+    uint64_t elapsed_ns = now_ns - client->window_start_ns;
+    if(elapsed_ns < 1000000000) { return; }
+    client->commit_rate = client->window_commits * 1e9 / elapsed_ns;
+    client->frame_rate = client->window_frames * 1e9 / elapsed_ns;
+    client->window_commits = 0;
+    client->window_frames = 0;
+    client->window_start_ns = now_ns;
+}
 
-	struct xkb_context *context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
-	struct xkb_keymap *keymap = xkb_map_new_from_names(context, &rules,
-		XKB_KEYMAP_COMPILE_NO_FLAGS);
+/* The effective frame callback cap, the tighter of the client's own cap and
+ * the one for clients without keyboard focus. */
+static uint32_t gateway_client_fps_cap(struct gateway_client* client)
+{
+    struct gateway_config* config = client->server->config;
+    uint32_t cap = client->fps_cap;
+    uint32_t unfocused = config->unfocused_fps;
+    if(client->server->battery_profile && config->battery_unfocused_fps > 0 &&
+        (unfocused == 0 || config->battery_unfocused_fps < unfocused))
+    {
+        unfocused = config->battery_unfocused_fps;
+    }
+    if(unfocused == 0 || client->client == NULL) { return cap; }
+    struct wlr_surface* focused = client->server->seat->keyboard_state.focused_surface;
+    if(focused != NULL && wl_resource_get_client(focused->resource) == client->client) { return cap; }
+    return cap == 0 || unfocused < cap ? unfocused : cap;
+}
 
-    assert(keymap != NULL);
+/* Attached buffers are accounted when committed. Anything that isn't shm is
+ * a GPU buffer and assumed to be 32 bits per pixel. */
+static void gateway_surface_account_buffer(struct gateway_surface* gsurface)
+{
+    struct gateway_client* client = gsurface->client;
+    if(gsurface->buffer_shm) { client->shm_bytes -= gsurface->buffer_bytes; }
+    else { client->dmabuf_bytes -= gsurface->buffer_bytes; }
+    gsurface->buffer_bytes = 0;
+    gsurface->buffer_shm = false;
+
+    struct wlr_client_buffer* buffer = gsurface->surface->buffer;
+    if(buffer == NULL) { return; }
+    struct wl_shm_buffer* shm = buffer->resource != NULL ? wl_shm_buffer_get(buffer->resource) : NULL;
+    if(shm != NULL)
+    {
+        gsurface->buffer_bytes = (uint64_t)wl_shm_buffer_get_stride(shm) * wl_shm_buffer_get_height(shm);
+        gsurface->buffer_shm = true;
+        client->shm_bytes += gsurface->buffer_bytes;
+    } else
+    {
+        gsurface->buffer_bytes = (uint64_t)buffer->base.width * buffer->base.height * 4;
+        client->dmabuf_bytes += gsurface->buffer_bytes;
+    }
+}
 
-	wlr_keyboard_set_keymap(device->keyboard, keymap);
-	xkb_keymap_unref(keymap);
-	xkb_context_unref(context);
-	wlr_keyboard_set_repeat_info(device->keyboard, 25, 600);
+/* Sends the surface its frame callbacks, unless its client is over its frame
+ * rate cap. Then they stay queued for a later frame and the client waits. */
+static void gateway_surface_frame_done(struct wlr_surface* surface, const struct timespec* when)
+{
+    struct gateway_surface* gsurface = gateway_surface_from_wlr(surface);
+    if(gsurface != NULL && gsurface->client != NULL)
+    {
+        uint64_t now_ns = (uint64_t)when->tv_sec * 1000000000 + when->tv_nsec;
+        uint32_t cap = gateway_client_fps_cap(gsurface->client);
+        // An eighth of slack, or a 30 fps cap on a 60 Hz output would make 20
+        uint64_t interval_ns = cap > 0 ? 1000000000 / cap : 0;
+        if(now_ns - gsurface->last_frame_done_ns < interval_ns - interval_ns / 8) { return; }
+        gsurface->last_frame_done_ns = now_ns;
+        gsurface->client->frames++;
+        gsurface->client->window_frames++;
+        gateway_client_tick(gsurface->client, get_time_ns());
+    }
+    wlr_surface_send_frame_done(surface, when);
+}
 
-	/* Here we set up listeners for keyboard events. */
-	keyboard->modifiers.notify = keyboard_handle_modifiers;
-	wl_signal_add(&device->keyboard->events.modifiers, &keyboard->modifiers);
-	keyboard->key.notify = keyboard_handle_key;
-	wl_signal_add(&device->keyboard->events.key, &keyboard->key);
+static void gateway_client_input(struct wlr_surface* surface)
+{
+    if(surface == NULL) { return; }
+    struct gateway_surface* gsurface = gateway_surface_from_wlr(surface);
+    if(gsurface != NULL && gsurface->client != NULL) { gsurface->client->input_events++; }
+}
 
-	wlr_seat_set_keyboard(server->seat, device);
+static void gateway_surface_commit(struct wl_listener* listener, void* data)
+{
+    struct gateway_surface* gsurface = wl_container_of(listener, gsurface, commit);
+    watchdog_enter(&gsurface->server->watchdog, __func__);
+    latency_surface_commit(&gsurface->server->stats.latency, gsurface->surface);
+    gsurface->commits++;
+    if(gsurface->client != NULL)
+    {
+        gsurface->client->commits++;
+        gsurface->client->window_commits++;
+        gateway_client_tick(gsurface->client, get_time_ns());
+        gateway_surface_account_buffer(gsurface);
+    }
+    wlr_surface_get_effective_damage(gsurface->surface, &gsurface->damage);
+    screencopy_surface_commit(gsurface->server->screencopy, gsurface->surface);
+    overview_surface_commit(gsurface->server, gsurface);
+    if(!gsurface->outputs_checked && wlr_surface_has_buffer(gsurface->surface))
+    {
+        gsurface->outputs_checked = true;
+        surface_enter_view_outputs(gsurface);
+    }
+    watchdog_leave(&gsurface->server->watchdog);
+}
 
-	/* And add the keyboard to our list of keyboards */
-	wl_list_insert(&server->keyboards, &keyboard->link);
+static void gateway_surface_destroy(struct wl_listener* listener, void* data)
+{
+    struct gateway_surface* gsurface = wl_container_of(listener, gsurface, destroy);
+    record_surface(gsurface->server, GATEWAY_RECORD_SURFACE_DESTROY, gsurface->id);
+    latency_surface_destroyed(&gsurface->server->stats.latency, gsurface->surface);
+    wl_list_remove(&gsurface->commit.link);
+    wl_list_remove(&gsurface->destroy.link);
+    pixman_region32_fini(&gsurface->damage);
+    struct gateway_client* client = gsurface->client;
+    if(client != NULL)
+    {
+        if(gsurface->buffer_shm) { client->shm_bytes -= gsurface->buffer_bytes; }
+        else { client->dmabuf_bytes -= gsurface->buffer_bytes; }
+        if(--client->surfaces == 0 && client->client == NULL) { gateway_client_free(client); }
+    }
+    free(gsurface);
 }
 
-static void server_new_pointer(struct tinywl_server *server,
-		struct wlr_input_device *device) {
-	/* We don't do anything special with pointers. All of our pointer handling
-	 * is proxied through wlr_cursor. On another compositor, you might take this
-	 * opportunity to do libinput configuration on the device to set
-	 * acceleration, etc. */
-	wlr_cursor_attach_input_device(server->cursor, device);
+static struct gateway_surface* gateway_surface_from_wlr(struct wlr_surface* surface)
+{
+    struct wl_listener* listener = wl_signal_get(&surface->events.destroy, gateway_surface_destroy);
+    if(listener == NULL) { return NULL; }
+    struct gateway_surface* gsurface = wl_container_of(listener, gsurface, destroy);
+    return gsurface;
 }
 
-static void server_new_input(struct wl_listener *listener, void *data) {
-	/* This event is raised by the backend when a new input device becomes
-	 * available. */
-	struct tinywl_server *server =
-		wl_container_of(listener, server, new_input);
-	struct wlr_input_device *device = data;
-	switch (device->type) {
-	case WLR_INPUT_DEVICE_KEYBOARD:
-		server_new_keyboard(server, device);
-		break;
-	case WLR_INPUT_DEVICE_POINTER:
-		server_new_pointer(server, device);
-		break;
-	default:
-		break;
+static void server_new_surface(struct wl_listener* listener, void* data)
+{
+    struct tinywl_server* server = wl_container_of(listener, server, new_surface);
+    struct wlr_surface* surface = data;
+
+    struct gateway_surface* gsurface = calloc(1, sizeof(struct gateway_surface));
+    gsurface->server = server;
+    gsurface->surface = surface;
+    gsurface->id = ++server->next_surface_id;
+    gsurface->client = gateway_client_get(server, wl_resource_get_client(surface->resource));
+    gsurface->client->surfaces++;
+    pixman_region32_init(&gsurface->damage);
+    gsurface->commit.notify = gateway_surface_commit;
+    wl_signal_add(&surface->events.commit, &gsurface->commit);
+    gsurface->destroy.notify = gateway_surface_destroy;
+    wl_signal_add(&surface->events.destroy, &gsurface->destroy);
+    record_surface(server, GATEWAY_RECORD_SURFACE_NEW, gsurface->id);
+}
+
+static void panel_update(struct gateway_panel* panel, struct tinywl_output* output);
+static void ipc_event(struct tinywl_server* server, enum gateway_ipc_event event, const char* format, ...);
+static void server_xwayland_idle_check(struct tinywl_server* server);
+static void server_set_brightness(struct tinywl_server* server, float brightness,
+    uint32_t temperature);
+static void server_damage_whole(struct tinywl_server* server);
+static void screencopy_create(struct tinywl_server* server);
+static void server_notify_activity(struct tinywl_server* server);
+static void server_idle_arm(struct tinywl_server* server);
+static void server_set_power_profile(struct tinywl_server* server, bool battery);
+static void output_apply_profile(struct tinywl_output* output);
+
+static void focus_view(struct tinywl_view *view, struct gateway_panel* panel, bool mouse_focus) {
+	/* Note: this function only deals with keyboard focus. */
+	if (view == NULL) {
+		return;
 	}
-	/* We need to let the wlr_seat know what our capabilities are, which is
-	 * communiciated to the client. In TinyWL we always have a cursor, even if
-	 * there are no pointer devices, so we always include that capability. */
-	uint32_t caps = WL_SEAT_CAPABILITY_POINTER;
-	if (!wl_list_empty(&server->keyboards)) {
-		caps |= WL_SEAT_CAPABILITY_KEYBOARD;
+	struct tinywl_server *server = view->server;
+	struct wlr_seat *seat = server->seat;
+	struct wlr_surface *prev_surface = seat->keyboard_state.focused_surface;
+    struct wlr_surface* surface;
+    if(view->xwayland_surface != NULL)
+    {
+        surface = view->xwayland_surface->surface;
+    } else if(view->xdg_surface != NULL)
+    {
+        surface = view->xdg_surface->surface;
+    }
+    if(!mouse_focus)
+    {
+        wlr_cursor_warp(view->server->cursor, NULL, view->x + (view->width / 2),
+            view->y + (view->height / 2));
+    }
+	if (prev_surface == surface) {
+		/* Don't re-focus an already focused surface. */// because X we can't do this. :(
+		return; // Oh no it's a lot worse. We have to have this because X
 	}
-	wlr_seat_set_capabilities(server->seat, caps);
+    if(prev_surface) {
+		if(wlr_surface_is_xdg_surface(prev_surface))
+        {
+            struct wlr_xdg_surface *previous = wlr_xdg_surface_from_wlr_surface(
+                    prev_surface);
+            wlr_xdg_toplevel_set_activated(previous, false);
+        } else if(wlr_surface_is_xwayland_surface(prev_surface))
+        {
+            struct wlr_xwayland_surface *previous = 
+                wlr_xwayland_surface_from_wlr_surface(
+                    prev_surface
+                );
+            wlr_xwayland_surface_activate(previous, false);
+        }
+	}
+    struct tinywl_view* other_view;
+    wl_list_for_each(other_view, &server->focused_panel->views, link) {
+        if(other_view->xwayland_surface != NULL) {
+            wlr_xwayland_surface_activate(other_view->xwayland_surface, false);
+        }
+    }
+	struct wlr_keyboard *keyboard = wlr_seat_get_keyboard(seat);
+    if(panel->focused_view != NULL) {
+        panel->focused_view->focused_by = NULL;
+    }
+    panel->focused_view = view;
+    view->focused_by = panel;
+	/* Activate the new surface */
+	if(view->xdg_surface != NULL)
+    {
+        wlr_xdg_toplevel_set_activated(view->xdg_surface, true);
+    } else if(view->xwayland_surface != NULL) {
+        wlr_xwayland_surface_activate(view->xwayland_surface, true);
+    }
+    // The overview holds the keyboard, closing it enters the focused view
+    if(!server->overview.active)
+    {
+        wlr_seat_keyboard_notify_enter(seat, surface,
+            keyboard->keycodes, keyboard->num_keycodes, &keyboard->modifiers);
+    }
+    ipc_event(server, GATEWAY_IPC_EVENT_FOCUS, "%u", view->id);
 }
 
-static void seat_request_cursor(struct wl_listener *listener, void *data) {
-	struct tinywl_server *server = wl_container_of(
-			listener, server, request_cursor);
-	/* This event is rasied by the seat when a client provides a cursor image */
-	struct wlr_seat_pointer_request_set_cursor_event *event = data;
-	struct wlr_seat_client *focused_client =
-		server->seat->pointer_state.focused_client;
-	/* This can be sent by any client, so we check to make sure this one is
-	 * actually has pointer focus first. */
-	if (focused_client == event->seat_client) {
-		/* Once we've vetted the client, we can tell the cursor to use the
-		 * provided surface as the cursor image. It will set the hardware cursor
-		 * on the output that it's currently on and continue to do so as the
-		 * cursor moves between outputs. */
-		wlr_cursor_set_surface(server->cursor, event->surface,
-				event->hotspot_x, event->hotspot_y);
-	}
+static void center_mouse(struct tinywl_server* server)
+{
+    struct tinywl_output* output;
+    wl_list_for_each(output, &server->focused_panel->outputs, plink) {
+        panel_update(server->focused_panel, output);
+    }
+    focus_view(server->focused_panel->focused_view, server->focused_panel, false);
+    wlr_cursor_set_surface(server->cursor, NULL, 0, 0);
 }
 
-static void seat_request_set_selection(struct wl_listener *listener, void *data) {
-	/* This event is raised by the seat when a client wants to set the selection,
-	 * usually when the user copies something. wlroots allows compositors to
-	 * ignore such requests if they so choose, but in tinywl we always honor
-	 */
-	struct tinywl_server *server = wl_container_of(
-			listener, server, request_set_selection);
-	struct wlr_seat_request_set_selection_event *event = data;
-	wlr_seat_set_selection(server->seat, event->source, event->serial);
+static void move_to_front(struct tinywl_view *view)
+{
+    struct tinywl_server *server = view->server;
+    /* Move the view to the front */
+    wl_list_remove(&view->link);
+    wl_list_insert(&server->focused_panel->views, &view->link);
 }
 
-static bool view_at(struct tinywl_view *view,
-		double lx, double ly, struct wlr_surface **surface,
-		double *sx, double *sy) {
+static void keyboard_handle_modifiers(
+		struct wl_listener *listener, void *data) {
+	/* This event is raised when a modifier key, such as shift or alt, is
+	 * pressed. We simply communicate this to the client. */
+	struct tinywl_keyboard *keyboard =
+		wl_container_of(listener, keyboard, modifiers);
 	/*
-	 * XDG toplevels may have nested surfaces, such as popup windows for context
-	 * menus or tooltips. This function tests if any of those are underneath the
-	 * coordinates lx and ly (in output Layout Coordinates). If so, it sets the
-	 * surface pointer to that wlr_surface and the sx and sy coordinates to the
-	 * coordinates relative to that surface's top-left corner.
+	 * A seat can only have one keyboard, but this is a limitation of the
+	 * Wayland protocol - not wlroots. We assign all connected keyboards to the
+	 * same seat. You can swap out the underlying wlr_keyboard like this and
+	 * wlr_seat handles this transparently.
 	 */
-	double view_sx = lx - view->x;
-	double view_sy = ly - view->y;
+	wlr_seat_set_keyboard(keyboard->server->seat, keyboard->device);
+	/* Send modifiers to the client. */
+	wlr_seat_keyboard_notify_modifiers(keyboard->server->seat,
+		&keyboard->device->keyboard->modifiers);
+}
+static void list_swap(struct wl_list* a, struct wl_list* b) // swaps order in views a-b -> b-a
+{
+    struct wl_list* linknext = b->next;
+    
+    struct wl_list* linkprev = a->prev;
 
-    if(view->focused_by == NULL && view->is_fullscreen)
-    {
-        uint32_t gap = view->server->config->window_gaps; // lazy
-        if(view_sx < gap || view_sy < gap || view_sx > view->width - gap || view_sy > view->height - gap)
-        { return false; }
-    }
+    linkprev->next = b;
+    b->prev = linkprev;
 
-	double _sx, _sy;
-	struct wlr_surface *_surface = NULL;
-    if(view->xdg_surface != NULL)
+    b->next = a;
+    a->prev = b;
+
+    a->next = linknext;
+    linknext->prev = a;
+}
+/* The event loop can run at SCHED_RR or a raised nice value and pinned to
+ * some CPUs, so that compile jobs and the like don't delay frames and input.
+ * All of it is opt-in and applied once, right before the event loop runs. On
+ * Linux these are per thread, so the watchdog and the threads the GPU driver
+ * started with the renderer keep the defaults. Threads created after that
+ * inherit the settings from the event loop. SCHED_RR falls back to a raised
+ * nice value without the privilege for it, and that to normal priority. */
+static void sched_apply(struct gateway_sched* sched, struct gateway_config* config)
+{
+    sched->policy = SCHED_OTHER;
+    sched->original_nice = getpriority(PRIO_PROCESS, 0);
+    sched->nice = sched->original_nice;
+    CPU_ZERO(&sched->original_cpus);
+    sched_getaffinity(0, sizeof(sched->original_cpus), &sched->original_cpus);
+
+    if(config->cpu_affinity != 0)
     {
-        double _scale_x = 1.0, _scale_y=1.0;
-        if(view->width != 0 && view->xdg_surface->toplevel->server_pending.width != 0)
-        {
-            _scale_x= ((double)view->xdg_surface->toplevel->server_pending.width) / ((double)view->width);
-        }
-        if(view->height != 0 && view->xdg_surface->toplevel->server_pending.height != 0)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for(int i = 0; i < 64; i++)
         {
-            _scale_y= ((double)view->xdg_surface->toplevel->server_pending.height) / ((double)view->height);
+            if(config->cpu_affinity & (1ull << i)) { CPU_SET(i, &set); }
         }
+        if(sched_setaffinity(0, sizeof(set), &set) == 0)
+        { sched->cpus = config->cpu_affinity; }
+        else
+        { wlr_log(WLR_ERROR, "Could not pin the event loop to cpu_affinity: %s", strerror(errno)); }
+    }
 
-        _surface = wlr_xdg_surface_surface_at(
-                view->xdg_surface, view_sx * _scale_x, view_sy * _scale_y, &_sx, &_sy);
-    } else if(view->xwayland_surface != NULL)
+    /* SCHED_RESET_ON_FORK hands children SCHED_OTHER and nice 0 back, which
+     * covers Xwayland and anything else wlroots forks. */
+    if(config->realtime_priority > 0)
     {
-        if(view_sx >= 0 && view_sx < view->width
-            && view_sy >= 0 && view_sy < view->height)
+        int min = sched_get_priority_min(SCHED_RR), max = sched_get_priority_max(SCHED_RR);
+        struct sched_param param = { .sched_priority = config->realtime_priority };
+        if(param.sched_priority < min) { param.sched_priority = min; }
+        if(param.sched_priority > max) { param.sched_priority = max; }
+        if(sched_setscheduler(0, SCHED_RR | SCHED_RESET_ON_FORK, &param) == 0)
         {
-            double scale_x = 1.0; double scale_y = 1.0;
-            _surface = view->xwayland_surface->surface;
-            if(view->width != 0 && view->xwayland_surface->width != 0)
-            {
-                scale_x= ((double)view->xwayland_surface->width) / ((double)view->width);
-            }
-            if(view->height != 0 && view->xwayland_surface->height != 0)
-            {
-                scale_y= ((double)view->xwayland_surface->height) / ((double)view->height);
-            }
-            _sx = view_sx * scale_x;
-            _sy = view_sy * scale_y;
+            sched->policy = SCHED_RR;
+            sched->priority = param.sched_priority;
+            return;
         }
+        wlr_log(WLR_INFO, "Could not switch to SCHED_RR: %s, raising the nice value instead", strerror(errno));
     }
 
-	if (_surface != NULL) {
-		*sx = _sx;
-		*sy = _sy;
-		*surface = _surface;
-		return true;
-	}
+    int nice_value = config->nice;
+    if(nice_value == 0 && config->realtime_priority > 0) { nice_value = -10; }
+    if(nice_value == 0) { return; }
+    struct sched_param param = {0};
+    sched_setscheduler(0, SCHED_OTHER | SCHED_RESET_ON_FORK, &param);
+    if(setpriority(PRIO_PROCESS, 0, nice_value) == 0)
+    { sched->nice = nice_value; }
+    else
+    { wlr_log(WLR_INFO, "Could not set the nice value to %d: %s, running at normal priority", nice_value, strerror(errno)); }
+}
 
-	return false;
+/* Locks what is mapped once the backend is up, so the event loop never waits
+ * for its own pages to come back from swap. Later mappings are only locked
+ * with an unlimited RLIMIT_MEMLOCK, otherwise allocations would start to fail
+ * once the heap grows past the limit. */
+static void sched_lock_memory(struct gateway_sched* sched)
+{
+    int flags = MCL_CURRENT;
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur == RLIM_INFINITY)
+    { flags |= MCL_FUTURE; }
+    if(mlockall(flags) != 0)
+    {
+        wlr_log(WLR_ERROR, "Could not lock memory: %s, raise RLIMIT_MEMLOCK or grant CAP_IPC_LOCK",
+            strerror(errno));
+        return;
+    }
+    sched->locked = true;
+    sched->locked_future = flags & MCL_FUTURE;
 }
 
-static struct tinywl_view *desktop_view_at(
-		struct tinywl_server *server, double lx, double ly,
-		struct wlr_surface **surface, double *sx, double *sy)
+/* In a forked child, before exec. SCHED_RESET_ON_FORK already took care of
+ * the policy and nice value, this also undoes the CPU pinning and covers a
+ * nice value set without it. Memory locks are never inherited. */
+static void sched_reset_child(struct gateway_sched* sched)
 {
-	/* This iterates over all of our surfaces and attempts to find one under the
-	 * cursor. This relies on server->views being ordered from top-to-bottom. */
-	struct tinywl_view *view;
-    wl_list_for_each(view, &server->focused_panel->views, link) {
-        if(view->focused_by == NULL) { continue; }
-        if (view_at(view, lx, ly, surface, sx, sy)) {
-            return view;
-        }
+    if(sched->policy != SCHED_OTHER)
+    {
+        struct sched_param param = {0};
+        sched_setscheduler(0, SCHED_OTHER, &param);
     }
-    wl_list_for_each(view, &server->focused_panel->views, link) {
-        if(!view->is_fullscreen || view->focused_by != NULL) { continue; }
-        if (view_at(view, lx, ly, surface, sx, sy)) {
-            return view;
-        }
+    if(sched->nice != sched->original_nice)
+    { setpriority(PRIO_PROCESS, 0, sched->original_nice); }
+    if(sched->cpus != 0)
+    { sched_setaffinity(0, sizeof(sched->original_cpus), &sched->original_cpus); }
+}
+
+/* Runs path with argv without waiting for it. */
+static void server_spawn_argv(struct tinywl_server* server, const char* path, char* const argv[])
+{
+    pid_t child = fork();
+    if(child < 0)
+    {
+        wlr_log(WLR_ERROR, "Could not fork to run %s: %s", path, strerror(errno));
+        return;
     }
-    wl_list_for_each(view, &server->focused_panel->views, link) {
-        if(view->is_fullscreen || view->focused_by != NULL) { continue; }
-        if (view_at(view, lx, ly, surface, sx, sy)) {
-            return view;
+    if(child == 0)
+    {
+        /* The event loop blocks the signals it handles through signalfd, don't
+         * pass that on. Forking twice reparents the command to init so we
+         * never have to reap it. */
+        sigset_t set;
+        sigemptyset(&set);
+        sigprocmask(SIG_SETMASK, &set, NULL);
+        sched_reset_child(&server->sched);
+        setsid();
+        if(fork() == 0)
+        {
+            execv(path, argv);
+            _exit(127);
         }
+        _exit(0);
     }
-	return NULL;
+    waitpid(child, NULL, 0);
 }
 
-static void process_cursor_move(struct tinywl_server *server, uint32_t time) {
-	/* Move the grabbed view to the new position. */
-	server->grabbed_view->x = server->cursor->x - server->grab_x;
-	server->grabbed_view->y = server->cursor->y - server->grab_y;
+/* Runs cmd through the shell without waiting for it. */
+static void server_spawn(struct tinywl_server* server, const char* cmd)
+{
+    char* argv[] = { "/bin/sh", "-c", (char*)cmd, NULL };
+    server_spawn_argv(server, "/bin/sh", argv);
 }
 
-static void process_cursor_resize(struct tinywl_server *server, uint32_t time) {
-	/*
-	 * Resizing the grabbed view can be a little bit complicated, because we
-	 * could be resizing from any corner or edge. This not only resizes the view
-	 * on one or two axes, but can also move the view if you resize from the top
-	 * or left edges (or top-left corner).
-	 *
-	 * Note that I took some shortcuts here. In a more fleshed-out compositor,
-	 * you'd wait for the client to prepare a buffer at the new size, then
-	 * commit any movement that was prepared.
-	 */
-	struct tinywl_view *view = server->grabbed_view;
-	double border_x = server->cursor->x - server->grab_x;
-	double border_y = server->cursor->y - server->grab_y;
-	int new_left = server->grab_geobox.x;
-	int new_right = server->grab_geobox.x + server->grab_geobox.width;
-	int new_top = server->grab_geobox.y;
-	int new_bottom = server->grab_geobox.y + server->grab_geobox.height; 
+static void view_close(struct tinywl_view* view)
+{
+    if(view->xdg_surface != NULL) { wlr_xdg_toplevel_send_close(view->xdg_surface); }
+    if(view->xwayland_surface != NULL) { wlr_xwayland_surface_close(view->xwayland_surface); }
+}
 
-	if (server->resize_edges & WLR_EDGE_TOP) {
-		new_top = border_y;
-		if (new_top >= new_bottom) {
-			new_top = new_bottom - 1;
-		}
-	} else if (server->resize_edges & WLR_EDGE_BOTTOM) {
-		new_bottom = border_y;
-		if (new_bottom <= new_top) {
-			new_bottom = new_top + 1;
-		}
+static void server_close_view(struct tinywl_server* server, struct tinywl_view* view)
+{
+    struct tinywl_view* current_view = server->focused_panel->focused_view;
+    view_close(view);
+    if(view != current_view) { return; }
+
+    struct wl_list* linknext = current_view->link.next;
+    if(linknext == &server->focused_panel->views) { linknext = linknext->next; }
+    struct tinywl_view* next_view = wl_container_of(
+        linknext, next_view, link);
+
+    if(next_view == current_view) { server->focused_panel->focused_view = NULL; }
+    else { server->focused_panel->focused_view = next_view; }
+    center_mouse(server);
+}
+
+static bool handle_keybinding(struct tinywl_server *server, uint32_t keycode, uint32_t modifiers) {
+    if(server->passthrough_enabled && keycode != 88) {
+        return false;
+    }
+    if(keycode == 88) {
+        server->passthrough_enabled = !server->passthrough_enabled;
+        return true;
+    }
+    if(keycode == server->config->hud_keycode) {
+        server->hud_enabled = !server->hud_enabled;
+        server_damage_whole(server);
+        return true;
+    }
+    if(keycode == server->config->overview_keycode) {
+        server_set_overview(server, !server->overview.active);
+        return true;
+    }
+    if(keycode == server->config->power_keycode) {
+        server_set_power_profile(server, !server->battery_profile);
+        return true;
+    }
+
+    if(keycode == 1)
+    {
+        wl_display_terminate(server->wl_display);
+        assert(0);
+    }
+    else if(keycode == 36 && (modifiers & WLR_MODIFIER_SHIFT) == 0)
+    {
+        if (wl_list_length(&server->focused_panel->views) < 2) {
+            return false;
+        }
+        struct tinywl_view* current_view = server->focused_panel->focused_view;
+        struct wl_list* linknext = current_view->link.prev;
+        if(linknext == &server->focused_panel->views) { linknext = linknext->prev; }
+        struct tinywl_view* next_view = wl_container_of(
+            linknext, next_view, link);
+
+        focus_view(next_view, server->focused_panel, false);
+        center_mouse(server);
+    }
+    else if(keycode == 37 && (modifiers & WLR_MODIFIER_SHIFT) == 0)
+    {
+        if (wl_list_length(&server->focused_panel->views) < 2) {
+            return false;
+        }
+        struct tinywl_view* current_view = server->focused_panel->focused_view;
+        struct wl_list* linknext = current_view->link.next;
+        if(linknext == &server->focused_panel->views) { linknext = linknext->next; }
+        struct tinywl_view* next_view = wl_container_of(
+            linknext, next_view, link);
+
+        focus_view(next_view, server->focused_panel, false);
+        center_mouse(server);
+    }
+    else if(keycode == 38)
+    {
+        if (wl_list_length(&server->focused_panel->views) < 2) {
+            return false;
+        }
+
+        struct tinywl_view* next_view = wl_container_of(
+            server->focused_panel->views.prev, next_view, link);
+ 
+        focus_view(next_view, server->focused_panel, false);
+        center_mouse(server);
+    }
+    else if(keycode == 36 && (modifiers & WLR_MODIFIER_SHIFT) != 0)
+    {
+        if (wl_list_length(&server->focused_panel->views) < 2) {
+            return false;
+        }
+        struct tinywl_view* current_view = server->focused_panel->focused_view;
+        list_swap(current_view->link.prev, &current_view->link);
+        center_mouse(server);
+    }
+    else if(keycode == 37 && (modifiers & WLR_MODIFIER_SHIFT) != 0)
+    {
+        if (wl_list_length(&server->focused_panel->views) < 2) {
+            return false;
+        }
+        struct tinywl_view* current_view = server->focused_panel->focused_view;
+        list_swap(&current_view->link, current_view->link.next);
+        center_mouse(server);
+    }
+    else if(keycode == 49)
+    {
+        if(server->focused_panel->focused_view != NULL)
+        {
+            move_to_front(server->focused_panel->focused_view);
+            center_mouse(server);
+        }
+    }
+    else if(keycode == 21)
+    {
+        server->focused_panel->focused_view->is_fullscreen = 
+                !server->focused_panel->focused_view->is_fullscreen;
+    }
+    else if(keycode == 28)
+    {
+        server_spawn(server, server->config->terminal);
+    }
+    else if(keycode == 35)
+    {
+        server_spawn(server, server->config->launcher);
+    }
+    else if(keycode == 53 && (modifiers && WLR_MODIFIER_SHIFT) == 1)
+    {
+        if(server->focused_panel->focused_view == NULL) { return false; }
+        server_close_view(server, server->focused_panel->focused_view);
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+static void keyboard_handle_key(
+		struct wl_listener *listener, void *data) {
+	/* This event is raised when a key is pressed or released. */
+	struct tinywl_keyboard *keyboard =
+		wl_container_of(listener, keyboard, key);
+	struct tinywl_server *server = keyboard->server;
+	struct wlr_event_keyboard_key *event = data;
+	struct wlr_seat *seat = server->seat;
+    uint64_t arrival_ns = get_time_ns();
+    struct gateway_record_key record = { .keycode = event->keycode, .state = event->state };
+    record_write(server, GATEWAY_RECORD_KEY, &record, sizeof(record));
+    watchdog_enter(&server->watchdog, __func__);
+    server_notify_activity(server);
+
+	/* Translate libinput keycode -> xkbcommon */
+	uint32_t keycode = event->keycode + 8;
+	/* Get a list of keysyms based on the keymap for this keyboard */
+	const xkb_keysym_t *syms;
+	int nsyms = xkb_state_key_get_syms(
+			keyboard->device->keyboard->xkb_state, keycode, &syms);
+
+	bool handled = false;
+	uint32_t modifiers = wlr_keyboard_get_modifiers(keyboard->device->keyboard);
+
+	if ((modifiers & WLR_MODIFIER_LOGO) && event->state == WL_KEYBOARD_KEY_STATE_PRESSED) {
+        handled = handle_keybinding(server, event->keycode, modifiers);
 	}
-	if (server->resize_edges & WLR_EDGE_LEFT) {
-		new_left = border_x;
-		if (new_left >= new_right) {
-			new_left = new_right - 1;
-		}
-	} else if (server->resize_edges & WLR_EDGE_RIGHT) {
-		new_right = border_x;
-		if (new_right <= new_left) {
-			new_right = new_left + 1;
-		}
+    /* The overview takes the keyboard, keys don't reach clients while it is up.
+     * No client has keyboard focus then, see server_set_overview. */
+    if(!handled && server->overview.active)
+    {
+        if(event->state == WL_KEYBOARD_KEY_STATE_PRESSED) { overview_handle_key(server, event->keycode); }
+        handled = true;
+    }
+    struct wlr_session* session = wlr_backend_get_session(server->backend); //Virtual terminals
+    if(session != NULL && (modifiers & WLR_MODIFIER_CTRL) && (modifiers & WLR_MODIFIER_ALT)){
+        for(int i = 0; i < nsyms; i++) {
+            for(int x = 1; x <= 12; x++){
+                if(syms[i] == 269024768 + x) {
+                    wlr_session_change_vt(session, x);
+                }
+            }
+        }
+    }
+
+    if(event->state != WL_KEYBOARD_KEY_STATE_RELEASED) {
+    for(int i = 0; i < nsyms; i++) {
+        if(syms[i] == XKB_KEY_XF86MonBrightnessUp) {
+            server_set_brightness(server, server->brightness + 0.05, server->color_temperature);
+        }
+        if(syms[i] == XKB_KEY_XF86MonBrightnessDown) {
+            server_set_brightness(server, server->brightness - 0.05, server->color_temperature);
+        }
+        if(syms[i] == XKB_KEY_XF86AudioRaiseVolume) {
+            server_spawn(server, "pamixer -i 10");
+        }
+        if(syms[i] == XKB_KEY_XF86AudioLowerVolume) {
+            server_spawn(server, "pamixer -d 10");
+        }
+        if(syms[i] == XKB_KEY_XF86AudioMute) {
+            server_spawn(server, "pamixer -t");
+        }
+    }}
+
+	if (!handled) {
+        struct wlr_keyboard *wkeyboard = wlr_seat_get_keyboard(seat);
+        struct gateway_layer_surface* ls;
+        wl_list_for_each(ls, &server->layer_surfaces, link) {
+            if(!ls->mapped || !ls->surface->current.keyboard_interactive) { continue; }
+            handled = true;
+
+            wlr_seat_keyboard_notify_enter(seat, ls->surface->surface,
+                wkeyboard->keycodes, wkeyboard->num_keycodes, &wkeyboard->modifiers);
+            break;
+        }
+        if(!handled && server->focused_panel->focused_view != NULL)
+        {
+        if(server->focused_panel->focused_view->xdg_surface != NULL) {
+            wlr_seat_keyboard_notify_enter(seat, server->focused_panel->focused_view->xdg_surface->surface,
+                wkeyboard->keycodes, wkeyboard->num_keycodes, &wkeyboard->modifiers);
+        }else if(server->focused_panel->focused_view->xwayland_surface != NULL) {
+            wlr_seat_keyboard_notify_enter(seat, server->focused_panel->focused_view->xwayland_surface->surface,
+                wkeyboard->keycodes, wkeyboard->num_keycodes, &wkeyboard->modifiers);
+        }
+        }
+		/* Otherwise, we pass it along to the client. */
+		wlr_seat_set_keyboard(seat, keyboard->device);
+		wlr_seat_keyboard_notify_key(seat, event->time_msec,
+			event->keycode, event->state);
+        gateway_client_input(seat->keyboard_state.focused_surface);
+        if(event->state == WL_KEYBOARD_KEY_STATE_PRESSED) {
+            latency_input_delivered(&server->stats.latency, GATEWAY_LATENCY_KEY,
+                event->time_msec, arrival_ns, seat->keyboard_state.focused_surface);
+        }
 	}
+    watchdog_leave(&server->watchdog);
+}
+
+/* Gateway configuration lives in $HOME/.config/gateway/config, one
+ * "key = value" per line, '#' starts a comment. Anything not set keeps its
+ * default. The file is watched and re-applied whenever it changes. */
+
+#define GATEWAY_CONFIG_MAX_STACKS 64
+// The idle timer takes an int of milliseconds
+#define GATEWAY_IDLE_TIMEOUT_MAX (INT_MAX / 1000)
+
+// Higher scales leave less than a hundred logical pixels on a 4K output
+#define GATEWAY_MAX_SCALE 32.0
+
+/* A positive number and nothing else, strtod also takes nan and inf. */
+static bool config_parse_scale(const char* text, double* scale)
+{
+    char* end = NULL;
+    *scale = strtod(text, &end);
+    return end != text && *end == '\0' && isfinite(*scale) && *scale > 0 && *scale <= GATEWAY_MAX_SCALE;
+}
+
+static void config_set_defaults(struct gateway_config* config)
+{
+    config->terminal = strdup("foot");
+    config->launcher = strdup("fuzzel -b1f301fff -tffffffff -l20");
+    config->mouse_sens = 0.5;
+    config->kbd_layout = strdup("us");
+    config->kbd_variant = strdup("dvorak");
+    config->window_gaps = 8;
+    config->watchdog_ms = 0; // its timer and thread wake the machine, even when idle
+    config->hud_keycode = 87; // F11
+    config->xwayland_idle_timeout = 60;
+    config->color_temperature = 6500;
+    config->idle_timeout = 600;
+    config->scale = 1.0;
+    config->power_keycode = 25; // P
+    config->battery_refresh = 60;
+    config->battery_unfocused_fps = 30;
+    config->overview_keycode = 15; // Tab
+
+    config->stack_count = 4;
+    config->stack_max_items = calloc(config->stack_count, sizeof(int32_t));
+    config->stack_max_items[0] = 1;
+    config->stack_max_items[1] = 1;
+    config->stack_max_items[2] = 2;
+    config->stack_max_items[3] = 2;
+}
+
+static void config_free(struct gateway_config* config)
+{
+    free(config->terminal);
+    free(config->launcher);
+    free(config->kbd_layout);
+    free(config->kbd_variant);
+    free(config->stack_max_items);
+    free(config->outputs);
+    free(config);
+}
+
+static char* config_strip(char* str)
+{
+    while(*str == ' ' || *str == '\t') { str++; }
+    char* end = str + strlen(str);
+    while(end > str && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r')) { end--; }
+    *end = '\0';
+    if(end - str >= 2 && str[0] == '"' && end[-1] == '"')
+    {
+        end[-1] = '\0';
+        str++;
+    }
+    return str;
+}
+
+static void config_set_string(char** field, const char* value)
+{
+    free(*field);
+    *field = strdup(value);
+}
+
+/* The entry for the named output, added if there is none yet. */
+static struct gateway_config_output* config_output(struct gateway_config* config, const char* name)
+{
+    for(int32_t i = 0; i < config->output_count; i++)
+    {
+        if(strcmp(config->outputs[i].name, name) == 0) { return &config->outputs[i]; }
+    }
+    config->outputs = realloc(config->outputs,
+        (config->output_count + 1) * sizeof(struct gateway_config_output));
+    struct gateway_config_output* output = &config->outputs[config->output_count++];
+    *output = (struct gateway_config_output){0};
+    snprintf(output->name, sizeof(output->name), "%s", name);
+    return output;
+}
+
+static bool config_parse_line(struct gateway_config* config, char* line)
+{
+    char* comment = strchr(line, '#');
+    if(comment != NULL) { *comment = '\0'; }
+    char* equals = strchr(line, '=');
+    if(equals == NULL) { return config_strip(line)[0] == '\0'; }
+    *equals = '\0';
+    char* key = config_strip(line);
+    char* value = config_strip(equals + 1);
+
+    if(strcmp(key, "terminal") == 0) {
+        config_set_string(&config->terminal, value);
+    } else if(strcmp(key, "launcher") == 0) {
+        config_set_string(&config->launcher, value);
+    } else if(strcmp(key, "kbd_layout") == 0) {
+        config_set_string(&config->kbd_layout, value);
+    } else if(strcmp(key, "kbd_variant") == 0) {
+        config_set_string(&config->kbd_variant, value);
+    } else if(strcmp(key, "mouse_sens") == 0) {
+        config->mouse_sens = strtod(value, NULL);
+    } else if(strcmp(key, "window_gaps") == 0) {
+        config->window_gaps = strtoul(value, NULL, 10);
+    } else if(strcmp(key, "watchdog_ms") == 0) {
+        config->watchdog_ms = strtoul(value, NULL, 10);
+    } else if(strcmp(key, "hud_keycode") == 0) {
+        config->hud_keycode = strtoul(value, NULL, 10);
+    } else if(strcmp(key, "xwayland_idle_timeout") == 0) {
+        unsigned long timeout = strtoul(value, NULL, 10);
+        if(timeout > GATEWAY_IDLE_TIMEOUT_MAX) { return false; }
+        config->xwayland_idle_timeout = timeout;
+    } else if(strcmp(key, "color_temperature") == 0) {
+        config->color_temperature = strtoul(value, NULL, 10);
+    } else if(strcmp(key, "idle_timeout") == 0) {
+        unsigned long timeout = strtoul(value, NULL, 10);
+        if(timeout > GATEWAY_IDLE_TIMEOUT_MAX) { return false; }
+        config->idle_timeout = timeout;
+    } else if(strcmp(key, "unfocused_fps") == 0) {
+        config->unfocused_fps = strtoul(value, NULL, 10);
+    } else if(strcmp(key, "power_keycode") == 0) {
+        config->power_keycode = strtoul(value, NULL, 10);
+    } else if(strcmp(key, "battery_refresh") == 0) {
+        config->battery_refresh = strtoul(value, NULL, 10);
+    } else if(strcmp(key, "battery_unfocused_fps") == 0) {
+        config->battery_unfocused_fps = strtoul(value, NULL, 10);
+    } else if(strcmp(key, "overview_keycode") == 0) {
+        config->overview_keycode = strtoul(value, NULL, 10);
+    } else if(strcmp(key, "clipboard_max_kb") == 0) {
+        config->clipboard_max_kb = strtoul(value, NULL, 10);
+    } else if(strcmp(key, "realtime_priority") == 0) {
+        config->realtime_priority = strtol(value, NULL, 10);
+    } else if(strcmp(key, "nice") == 0) {
+        config->nice = strtol(value, NULL, 10);
+    } else if(strcmp(key, "cpu_affinity") == 0) {
+        /* The CPUs the event loop may run on, e.g. "2 3". */
+        uint64_t cpus = 0;
+        char* save = NULL;
+        for(char* word = strtok_r(value, " \t,", &save); word != NULL; word = strtok_r(NULL, " \t,", &save))
+        {
+            long cpu = strtol(word, NULL, 10);
+            if(cpu < 0 || cpu >= 64) { return false; }
+            cpus |= 1ull << cpu;
+        }
+        config->cpu_affinity = cpus;
+    } else if(strcmp(key, "mlock") == 0) {
+        config->mlock = strtol(value, NULL, 10) != 0;
+    } else if(strcmp(key, "scale") == 0) {
+        double scale;
+        if(!config_parse_scale(value, &scale)) { return false; }
+        config->scale = scale;
+    } else if(strcmp(key, "output_scale") == 0) {
+        /* "<output name> <scale>", once per output. */
+        char* save = NULL;
+        char* name = strtok_r(value, " \t", &save);
+        char* text = strtok_r(NULL, " \t", &save);
+        double scale;
+        if(name == NULL || text == NULL || !config_parse_scale(text, &scale)) { return false; }
+        config_output(config, name)->scale = scale;
+    } else if(strcmp(key, "mirror") == 0) {
+        /* "<output name> <source output name>" */
+        char* save = NULL;
+        char* name = strtok_r(value, " \t", &save);
+        char* source = strtok_r(NULL, " \t", &save);
+        if(name == NULL || source == NULL || strcmp(name, source) == 0) { return false; }
+        struct gateway_config_output* output = config_output(config, name);
+        snprintf(output->mirror, sizeof(output->mirror), "%s", source);
+    } else if(strcmp(key, "stacks") == 0) {
+        /* The max_items of every stack, in order, e.g. "1 1 2 2". */
+        int32_t items[GATEWAY_CONFIG_MAX_STACKS];
+        int32_t count = 0;
+        char* save = NULL;
+        for(char* word = strtok_r(value, " \t,", &save); word != NULL && count < GATEWAY_CONFIG_MAX_STACKS;
+            word = strtok_r(NULL, " \t,", &save))
+        {
+            items[count] = strtol(word, NULL, 10);
+            if(items[count] < 1) { items[count] = 1; }
+            count++;
+        }
+        if(count == 0) { return false; }
+        free(config->stack_max_items);
+        config->stack_max_items = calloc(count, sizeof(int32_t));
+        memcpy(config->stack_max_items, items, count * sizeof(int32_t));
+        config->stack_count = count;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static float config_output_scale(struct gateway_config* config, const char* name)
+{
+    for(int32_t i = 0; i < config->output_count; i++)
+    {
+        if(strcmp(config->outputs[i].name, name) == 0 && config->outputs[i].scale > 0)
+        { return config->outputs[i].scale; }
+    }
+    return config->scale;
+}
+
+/* Name of the output the named one mirrors, NULL if it is a normal output. */
+static const char* config_output_mirror(struct gateway_config* config, const char* name)
+{
+    for(int32_t i = 0; i < config->output_count; i++)
+    {
+        if(strcmp(config->outputs[i].name, name) == 0 && config->outputs[i].mirror[0] != '\0')
+        { return config->outputs[i].mirror; }
+    }
+    return NULL;
+}
+
+static void config_path(char* path, size_t size, const char* file)
+{
+    const char* home = getenv("HOME");
+    snprintf(path, size, "%s/.config/gateway%s%s", home != NULL ? home : "", file[0] ? "/" : "", file);
+}
+
+/* Returns a new config with the defaults overridden by the config file. */
+static struct gateway_config* config_load(void)
+{
+    struct gateway_config* config = calloc(1, sizeof(struct gateway_config));
+    config_set_defaults(config);
+
+    char path[512];
+    config_path(path, sizeof(path), "config");
+    FILE* file = fopen(path, "r");
+    if(file == NULL) { return config; }
+
+    char line[1024];
+    int line_number = 0;
+    while(fgets(line, sizeof(line), file) != NULL)
+    {
+        line_number++;
+        if(!config_parse_line(config, line))
+        { wlr_log(WLR_ERROR, "%s:%d: ignoring invalid line", path, line_number); }
+    }
+    fclose(file);
+    return config;
+}
+
+/* Compiles the keymap described by the config. Every keyboard shares it. */
+static struct xkb_keymap* config_compile_keymap(struct gateway_config* config)
+{
+    struct xkb_rule_names rules = { 0 };
+    rules.layout = config->kbd_layout;
+    rules.variant = config->kbd_variant;
+
+    struct xkb_context *context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+    struct xkb_keymap *keymap = xkb_map_new_from_names(context, &rules,
+        XKB_KEYMAP_COMPILE_NO_FLAGS);
+    xkb_context_unref(context);
+    return keymap;
+}
+
+/* Makes sure the panel has at least count stacks, new ones use max_items from
+ * the config when it has them. */
+static void panel_ensure_stacks(struct gateway_panel* panel, struct gateway_config* config, int32_t count)
+{
+    if(count <= panel->stack_count) { return; }
+    panel->stacks = realloc(panel->stacks, count * sizeof(struct gateway_panel_stack));
+    memset(panel->stacks + panel->stack_count, 0,
+        (count - panel->stack_count) * sizeof(struct gateway_panel_stack));
+    for(int i = panel->stack_count; i < count; i++)
+    {
+        panel->stacks[i].max_items = i < config->stack_count ? config->stack_max_items[i] : 1;
+    }
+    panel->stack_count = count;
+}
+
+static void panel_apply_config(struct gateway_panel* panel, struct gateway_config* config)
+{
+    panel_ensure_stacks(panel, config, config->stack_count);
+    for(int i = 0; i < panel->stack_count; i++)
+    {
+        panel->stacks[i].max_items = i < config->stack_count ? config->stack_max_items[i] : 1;
+    }
+}
+
+static void server_relayout(struct tinywl_server* server)
+{
+    struct tinywl_output* output;
+    wl_list_for_each(output, &server->outputs, link) {
+        wlr_output_schedule_frame(output->wlr_output);
+    }
+}
+
+/* wlroots picks the cursor image for the scale of the output it is on, so
+ * the theme has to be loaded at every scale in use. Loaded scales are skipped. */
+static void server_load_cursor_scales(struct tinywl_server* server)
+{
+    struct tinywl_output* output;
+    wl_list_for_each(output, &server->outputs, link) {
+        wlr_xcursor_manager_load(server->cursor_mgr, output->wlr_output->scale);
+    }
+}
+
+static void output_apply_scale(struct tinywl_output* output)
+{
+    struct tinywl_server* server = output->server;
+    struct wlr_output* wlr_output = output->wlr_output;
+    float scale = config_output_scale(server->config, wlr_output->name);
+    if(scale == wlr_output->scale) { return; }
+    wlr_output_set_scale(wlr_output, scale);
+    if(!wlr_output_commit(wlr_output))
+    {
+        wlr_log(WLR_ERROR, "Failed to set scale %.2f on output %s", scale, wlr_output->name);
+        return;
+    }
+    wlr_log(WLR_INFO, "Output %s scale %.2f", wlr_output->name, scale);
+    output->damage.whole = true;
+    output->background_dirty = true;
+    if(server->startup.deferred_done) { wlr_xcursor_manager_load(server->cursor_mgr, scale); }
+    wlr_output_schedule_frame(wlr_output);
+}
+
+static void server_reload_config(struct tinywl_server* server)
+{
+    struct gateway_config* old = server->config;
+    struct gateway_config* config = config_load();
+
+    /* Without a keyboard there is no keymap yet, the first one compiles the
+     * new config itself and falls back to the default on a bad layout. After
+     * that a bad layout keeps the keymap the session already has. */
+    if(server->keymap != NULL && (strcmp(old->kbd_layout, config->kbd_layout) != 0 ||
+        strcmp(old->kbd_variant, config->kbd_variant) != 0))
+    {
+        struct xkb_keymap* keymap = config_compile_keymap(config);
+        if(keymap == NULL)
+        {
+            wlr_log(WLR_ERROR, "Could not compile keymap %s(%s), keeping the old one",
+                config->kbd_layout, config->kbd_variant);
+            config_set_string(&config->kbd_layout, old->kbd_layout);
+            config_set_string(&config->kbd_variant, old->kbd_variant);
+        } else
+        {
+            xkb_keymap_unref(server->keymap);
+            server->keymap = keymap;
+            struct tinywl_keyboard* keyboard;
+            wl_list_for_each(keyboard, &server->keyboards, link) {
+                wlr_keyboard_set_keymap(keyboard->device->keyboard, server->keymap);
+            }
+            wlr_log(WLR_INFO, "Keymap changed to %s(%s)", config->kbd_layout, config->kbd_variant);
+        }
+    }
+
+    bool relayout = old->window_gaps != config->window_gaps ||
+        old->stack_count != config->stack_count ||
+        memcmp(old->stack_max_items, config->stack_max_items, config->stack_count * sizeof(int32_t)) != 0;
+    if(relayout) { panel_apply_config(server->focused_panel, config); }
+
+    if(old->watchdog_ms != config->watchdog_ms)
+    { wlr_log(WLR_INFO, "watchdog_ms only takes effect after a restart"); }
+    if(old->realtime_priority != config->realtime_priority || old->nice != config->nice ||
+        old->cpu_affinity != config->cpu_affinity || old->mlock != config->mlock)
+    { wlr_log(WLR_INFO, "realtime_priority, nice, cpu_affinity and mlock only take effect after a restart"); }
+
+    if(config->color_temperature != old->color_temperature)
+    {
+        server_set_brightness(server, server->brightness, config->color_temperature);
+    }
+    server->config = config;
+    config_free(old);
+    struct tinywl_output* output;
+    wl_list_for_each(output, &server->outputs, link) {
+        output_apply_scale(output);
+        output_apply_profile(output);
+    }
+    if(relayout) { server_relayout(server); }
+    server_xwayland_idle_check(server);
+    server_idle_arm(server);
+    wlr_log(WLR_INFO, "Reloaded config");
+}
+
+static int handle_config_change(int fd, uint32_t mask, void* data)
+{
+    struct tinywl_server* server = data;
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t len;
+    while((len = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        for(char* ptr = buffer; ptr < buffer + len;)
+        {
+            struct inotify_event* event = (struct inotify_event*)ptr;
+            if(event->len > 0 && strcmp(event->name, "config") == 0) { changed = true; }
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    if(changed)
+    {
+        watchdog_enter(&server->watchdog, __func__);
+        server_reload_config(server);
+        watchdog_leave(&server->watchdog);
+    }
+    return 0;
+}
+
+static void config_watch(struct tinywl_server* server)
+{
+    char dir[512];
+    config_path(dir, sizeof(dir), "");
+    /* Make sure the directory exists, so writing a config for the first time
+     * is picked up without a restart. ~/.config may be missing as well. */
+    char* slash = strrchr(dir, '/');
+    if(slash != NULL)
+    {
+        *slash = '\0';
+        mkdir(dir, 0755);
+        *slash = '/';
+    }
+    if(mkdir(dir, 0755) < 0 && errno != EEXIST)
+    {
+        wlr_log(WLR_INFO, "Could not create %s: %s", dir, strerror(errno));
+    }
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(fd < 0) { return; }
+    /* Watch the directory rather than the file, editors tend to replace the
+     * file instead of writing to it. */
+    if(inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) < 0)
+    {
+        wlr_log(WLR_INFO, "Not watching %s for config changes: %s", dir, strerror(errno));
+        close(fd);
+        return;
+    }
+    server->config_watch = wl_event_loop_add_fd(wl_display_get_event_loop(server->wl_display),
+        fd, WL_EVENT_READABLE, handle_config_change, server);
+}
+
+/* Compiled when the first keyboard shows up, so keys pressed right after
+ * startup aren't lost. */
+static void server_ensure_keymap(struct tinywl_server* server)
+{
+    if(server->keymap != NULL) { return; }
+    server->keymap = config_compile_keymap(server->config);
+    if(server->keymap == NULL)
+    {
+        /* A typo in the config shouldn't take the session down, xkb's
+         * default rule names give a keyboard that works. */
+        wlr_log(WLR_ERROR, "Could not compile keymap %s(%s), using the default one",
+            server->config->kbd_layout, server->config->kbd_variant);
+        struct xkb_rule_names rules = { 0 };
+        struct xkb_context* context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+        server->keymap = xkb_map_new_from_names(context, &rules, XKB_KEYMAP_COMPILE_NO_FLAGS);
+        xkb_context_unref(context);
+    }
+    assert(server->keymap != NULL);
+    startup_mark(&server->startup, "keymap");
+}
+
+static void server_new_keyboard(struct tinywl_server *server,
+		struct wlr_input_device *device) {
+	struct tinywl_keyboard *keyboard =
+		calloc(1, sizeof(struct tinywl_keyboard));
+	keyboard->server = server;
+	keyboard->device = device;
+
+	/* We need to prepare an XKB keymap and assign it to the keyboard. It is
+	 * compiled once from the config and shared by all keyboards. */
+    server_ensure_keymap(server);
+    wlr_keyboard_set_keymap(device->keyboard, server->keymap);
+	wlr_keyboard_set_repeat_info(device->keyboard, 25, 600);
+
+	/* Here we set up listeners for keyboard events. */
+	keyboard->modifiers.notify = keyboard_handle_modifiers;
+	wl_signal_add(&device->keyboard->events.modifiers, &keyboard->modifiers);
+	keyboard->key.notify = keyboard_handle_key;
+	wl_signal_add(&device->keyboard->events.key, &keyboard->key);
+
+	wlr_seat_set_keyboard(server->seat, device);
+
+	/* And add the keyboard to our list of keyboards */
+	wl_list_insert(&server->keyboards, &keyboard->link);
+}
+
+static void server_new_pointer(struct tinywl_server *server,
+		struct wlr_input_device *device) {
+	/* We don't do anything special with pointers. All of our pointer handling
+	 * is proxied through wlr_cursor. On another compositor, you might take this
+	 * opportunity to do libinput configuration on the device to set
+	 * acceleration, etc. */
+	wlr_cursor_attach_input_device(server->cursor, device);
+}
+
+/* Everything that isn't needed to get the first frame on screen is set up
+ * here, once the first output committed a frame or after a second at the
+ * latest. */
+static void server_deferred_init(struct tinywl_server* server)
+{
+    struct gateway_startup* startup = &server->startup;
+    if(startup->deferred_done) { return; }
+    startup->deferred_done = true;
+    if(startup->deferred_fallback != NULL)
+    {
+        wl_event_source_remove(startup->deferred_fallback);
+        startup->deferred_fallback = NULL;
+    }
+    startup->deferred = NULL;
+
+    screencopy_create(server);
+    startup_mark(startup, "global screencopy");
+    server->export_dmabuf = wlr_export_dmabuf_manager_v1_create(server->wl_display);
+    startup_mark(startup, "global export dmabuf");
+
+    // Scale 1 was loaded at startup
+    server_load_cursor_scales(server);
+    startup_mark(startup, "xcursor other scales");
+}
+
+static void handle_deferred_init(void* data)
+{
+    server_deferred_init(data);
+}
+
+static int handle_deferred_init_fallback(void* data)
+{
+    server_deferred_init(data);
+    return 0;
+}
+
+static void server_new_input(struct wl_listener *listener, void *data) {
+	/* This event is raised by the backend when a new input device becomes
+	 * available. */
+	struct tinywl_server *server =
+		wl_container_of(listener, server, new_input);
+	struct wlr_input_device *device = data;
+    watchdog_enter(&server->watchdog, __func__);
+	switch (device->type) {
+	case WLR_INPUT_DEVICE_KEYBOARD:
+		server_new_keyboard(server, device);
+		break;
+	case WLR_INPUT_DEVICE_POINTER:
+		server_new_pointer(server, device);
+		break;
+	default:
+		break;
+	}
+	/* We need to let the wlr_seat know what our capabilities are, which is
+	 * communiciated to the client. In TinyWL we always have a cursor, even if
+	 * there are no pointer devices, so we always include that capability. */
+	uint32_t caps = WL_SEAT_CAPABILITY_POINTER;
+	if (!wl_list_empty(&server->keyboards)) {
+		caps |= WL_SEAT_CAPABILITY_KEYBOARD;
+	}
+	wlr_seat_set_capabilities(server->seat, caps);
+    watchdog_leave(&server->watchdog);
+}
+
+static void seat_request_cursor(struct wl_listener *listener, void *data) {
+	struct tinywl_server *server = wl_container_of(
+			listener, server, request_cursor);
+	/* This event is rasied by the seat when a client provides a cursor image */
+	struct wlr_seat_pointer_request_set_cursor_event *event = data;
+	struct wlr_seat_client *focused_client =
+		server->seat->pointer_state.focused_client;
+	/* This can be sent by any client, so we check to make sure this one is
+	 * actually has pointer focus first. */
+	if (focused_client == event->seat_client) {
+		/* Once we've vetted the client, we can tell the cursor to use the
+		 * provided surface as the cursor image. It will set the hardware cursor
+		 * on the output that it's currently on and continue to do so as the
+		 * cursor moves between outputs. */
+		wlr_cursor_set_surface(server->cursor, event->surface,
+				event->hotspot_x, event->hotspot_y);
+	}
+}
+
+/* Clipboard manager. With clipboard_max_kb set, every selection a client
+ * offers is read into memory right away, all of its mime types. Once that is
+ * done the compositor offers the copy in place of the client, so pastes are
+ * written from memory without waking the client up and outlive it. Until
+ * then, and for selections that are too big or don't arrive in time, the
+ * client serves pastes itself like before. */
+
+#define GATEWAY_CLIPBOARD_TIMEOUT_MS 5000
+
+/* Contents of a selection, shared by the compositor's source offering it and
+ * the pastes still being written out. */
+struct gateway_clipboard_data {
+    int32_t refs;
+    int32_t mime_count;
+    char** mime_types;
+    uint8_t** contents;
+    size_t* sizes;
+    size_t size; // of all mime types together
+};
+
+struct gateway_clipboard_read {
+    struct gateway_clipboard_load* load;
+    int32_t index; // mime type
+    int fd;
+    struct wl_event_source* source;
+    size_t capacity;
+};
+
+struct gateway_clipboard_load {
+    struct gateway_clipboard* clipboard;
+    enum gateway_selection_kind kind;
+    void* client_source; // wlr_data_source or wlr_primary_selection_source
+    struct wl_listener client_source_destroy;
+    uint32_t serial;
+    struct gateway_clipboard_data* data;
+    struct gateway_clipboard_read* reads;
+    int32_t pending;
+    struct wl_event_source* timeout;
+};
+
+struct gateway_clipboard_source {
+    struct wlr_data_source base;
+    struct gateway_clipboard* clipboard;
+    struct gateway_clipboard_data* data;
+};
+
+struct gateway_primary_source {
+    struct wlr_primary_selection_source base;
+    struct gateway_clipboard* clipboard;
+    struct gateway_clipboard_data* data;
+};
+
+/* A paste being written into the pipe of the pasting client. */
+struct gateway_clipboard_send {
+    struct gateway_clipboard_data* data;
+    int32_t index;
+    size_t offset;
+    int fd;
+    struct wl_event_source* source;
+};
+
+static void clipboard_data_unref(struct gateway_clipboard_data* data)
+{
+    if(--data->refs > 0) { return; }
+    for(int32_t i = 0; i < data->mime_count; i++)
+    {
+        free(data->mime_types[i]);
+        free(data->contents[i]);
+    }
+    free(data->mime_types);
+    free(data->contents);
+    free(data->sizes);
+    free(data);
+}
+
+static void clipboard_send_finish(struct gateway_clipboard_send* send)
+{
+    if(send->source != NULL) { wl_event_source_remove(send->source); }
+    close(send->fd);
+    clipboard_data_unref(send->data);
+    free(send);
+}
+
+/* Writes as much as the pipe takes, returns whether the paste is over. */
+static bool clipboard_send_write(struct gateway_clipboard_send* send)
+{
+    size_t size = send->data->sizes[send->index];
+    while(send->offset < size)
+    {
+        ssize_t written = write(send->fd, send->data->contents[send->index] + send->offset,
+            size - send->offset);
+        if(written < 0 && errno == EINTR) { continue; }
+        if(written < 0 && errno == EAGAIN) { return false; }
+        if(written < 0) { return true; } // the client closed the pipe, EPIPE
+        send->offset += written;
+    }
+    return true;
+}
+
+static int handle_clipboard_send(int fd, uint32_t mask, void* data)
+{
+    struct gateway_clipboard_send* send = data;
+    if((mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR)) || clipboard_send_write(send))
+    {
+        clipboard_send_finish(send);
+    }
+    return 0;
+}
+
+static void clipboard_send(struct gateway_clipboard* clipboard, struct gateway_clipboard_data* data,
+    const char* mime_type, int fd)
+{
+    int32_t index = 0;
+    while(index < data->mime_count && strcmp(data->mime_types[index], mime_type) != 0) { index++; }
+    if(index == data->mime_count)
+    {
+        close(fd);
+        return;
+    }
+    clipboard->pastes++;
+    clipboard->paste_bytes += data->sizes[index];
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    struct gateway_clipboard_send* send = calloc(1, sizeof(struct gateway_clipboard_send));
+    send->data = data;
+    data->refs++;
+    send->index = index;
+    send->fd = fd;
+    /* Most pastes fit into the pipe, the rest is written as the client reads,
+     * a slow reader doesn't hold up anything else. */
+    if(clipboard_send_write(send))
+    {
+        clipboard_send_finish(send);
+        return;
+    }
+    send->source = wl_event_loop_add_fd(wl_display_get_event_loop(clipboard->server->wl_display),
+        fd, WL_EVENT_WRITABLE, handle_clipboard_send, send);
+}
+
+static void clipboard_source_send(struct wlr_data_source* wlr_source, const char* mime_type, int32_t fd)
+{
+    struct gateway_clipboard_source* source = wl_container_of(wlr_source, source, base);
+    clipboard_send(source->clipboard, source->data, mime_type, fd);
+}
+
+static void clipboard_source_destroy(struct wlr_data_source* wlr_source)
+{
+    struct gateway_clipboard_source* source = wl_container_of(wlr_source, source, base);
+    clipboard_data_unref(source->data);
+    free(source);
+}
+
+static const struct wlr_data_source_impl clipboard_source_impl = {
+    .send = clipboard_source_send,
+    .destroy = clipboard_source_destroy,
+};
+
+static void primary_source_send(struct wlr_primary_selection_source* wlr_source,
+    const char* mime_type, int fd)
+{
+    struct gateway_primary_source* source = wl_container_of(wlr_source, source, base);
+    clipboard_send(source->clipboard, source->data, mime_type, fd);
+}
+
+static void primary_source_destroy(struct wlr_primary_selection_source* wlr_source)
+{
+    struct gateway_primary_source* source = wl_container_of(wlr_source, source, base);
+    clipboard_data_unref(source->data);
+    free(source);
+}
+
+static const struct wlr_primary_selection_source_impl primary_source_impl = {
+    .send = primary_source_send,
+    .destroy = primary_source_destroy,
+};
+
+static void clipboard_load_destroy(struct gateway_clipboard_load* load)
+{
+    wl_list_remove(&load->client_source_destroy.link);
+    for(int32_t i = 0; i < load->data->mime_count; i++)
+    {
+        struct gateway_clipboard_read* reader = &load->reads[i];
+        if(reader->source != NULL) { wl_event_source_remove(reader->source); }
+        if(reader->fd >= 0) { close(reader->fd); }
+    }
+    wl_event_source_remove(load->timeout);
+    clipboard_data_unref(load->data);
+    load->clipboard->loads[load->kind] = NULL;
+    free(load->reads);
+    free(load);
+}
+
+static void clipboard_add_mime_types(struct wl_array* mime_types, struct gateway_clipboard_data* data)
+{
+    /* The seat frees them with the source. */
+    for(int32_t i = 0; i < data->mime_count; i++)
+    {
+        char** mime_type = wl_array_add(mime_types, sizeof(char*));
+        *mime_type = strdup(data->mime_types[i]);
+    }
+}
+
+/* Everything has been read, the compositor takes over the selection. Setting
+ * it cancels the client's source. */
+static void clipboard_load_done(struct gateway_clipboard_load* load)
+{
+    struct gateway_clipboard* clipboard = load->clipboard;
+    struct wlr_seat* seat = clipboard->server->seat;
+    struct gateway_clipboard_data* data = load->data;
+    wl_list_remove(&load->client_source_destroy.link);
+    wl_list_init(&load->client_source_destroy.link);
+    data->refs++;
+    if(load->kind == GATEWAY_SELECTION_CLIPBOARD)
+    {
+        struct gateway_clipboard_source* source = calloc(1, sizeof(struct gateway_clipboard_source));
+        wlr_data_source_init(&source->base, &clipboard_source_impl);
+        source->clipboard = clipboard;
+        source->data = data;
+        clipboard_add_mime_types(&source->base.mime_types, data);
+        wlr_seat_set_selection(seat, &source->base, load->serial);
+    } else
+    {
+        struct gateway_primary_source* source = calloc(1, sizeof(struct gateway_primary_source));
+        wlr_primary_selection_source_init(&source->base, &primary_source_impl);
+        source->clipboard = clipboard;
+        source->data = data;
+        clipboard_add_mime_types(&source->base.mime_types, data);
+        wlr_seat_set_primary_selection(seat, &source->base, load->serial);
+    }
+    clipboard->cached++;
+    wlr_log(WLR_DEBUG, "Clipboard: keeping %zu bytes in %d mime types", data->size, data->mime_count);
+    clipboard_load_destroy(load);
+}
+
+static int handle_clipboard_read(int fd, uint32_t mask, void* data)
+{
+    struct gateway_clipboard_read* reader = data;
+    struct gateway_clipboard_load* load = reader->load;
+    struct gateway_clipboard_data* contents = load->data;
+    size_t max = (size_t)load->clipboard->server->config->clipboard_max_kb * 1024;
+    while(true)
+    {
+        size_t* size = &contents->sizes[reader->index];
+        if(reader->capacity - *size < 4096)
+        {
+            reader->capacity = reader->capacity == 0 ? 4096 : reader->capacity * 2;
+            contents->contents[reader->index] = realloc(contents->contents[reader->index], reader->capacity);
+        }
+        ssize_t n = read(fd, contents->contents[reader->index] + *size, reader->capacity - *size);
+        if(n < 0 && errno == EINTR) { continue; }
+        if(n < 0 && errno == EAGAIN) { return 0; }
+        if(n < 0)
+        {
+            wlr_log(WLR_ERROR, "Clipboard: reading %s failed: %s",
+                contents->mime_types[reader->index], strerror(errno));
+            load->clipboard->failed++;
+            clipboard_load_destroy(load);
+            return 0;
+        }
+        if(n == 0) { break; }
+        *size += n;
+        contents->size += n;
+        if(contents->size > max)
+        {
+            load->clipboard->too_large++;
+            clipboard_load_destroy(load);
+            return 0;
+        }
+    }
+    wl_event_source_remove(reader->source);
+    reader->source = NULL;
+    close(reader->fd);
+    reader->fd = -1;
+    if(--load->pending == 0) { clipboard_load_done(load); }
+    return 0;
+}
+
+static int handle_clipboard_load_timeout(void* data)
+{
+    struct gateway_clipboard_load* load = data;
+    wlr_log(WLR_INFO, "Clipboard: the selection didn't arrive within %d ms, leaving it with its client",
+        GATEWAY_CLIPBOARD_TIMEOUT_MS);
+    load->clipboard->failed++;
+    clipboard_load_destroy(load);
+    return 0;
+}
+
+/* The selection changed before it was read. */
+static void clipboard_client_source_destroy(struct wl_listener* listener, void* data)
+{
+    struct gateway_clipboard_load* load = wl_container_of(listener, load, client_source_destroy);
+    clipboard_load_destroy(load);
+}
+
+/* Called once the seat has the client's source as its selection. */
+static void clipboard_load_start(struct gateway_clipboard* clipboard, enum gateway_selection_kind kind,
+    void* client_source, struct wl_array* mime_types, struct wl_signal* destroy_signal, uint32_t serial)
+{
+    if(clipboard->loads[kind] != NULL) { clipboard_load_destroy(clipboard->loads[kind]); }
+    if(client_source == NULL || clipboard->server->config->clipboard_max_kb == 0) { return; }
+    int32_t mime_count = mime_types->size / sizeof(char*);
+    if(mime_count == 0) { return; }
+
+    struct gateway_clipboard_load* load = calloc(1, sizeof(struct gateway_clipboard_load));
+    load->clipboard = clipboard;
+    load->kind = kind;
+    load->client_source = client_source;
+    load->serial = serial;
+    load->data = calloc(1, sizeof(struct gateway_clipboard_data));
+    load->data->refs = 1;
+    load->data->mime_count = mime_count;
+    load->data->mime_types = calloc(mime_count, sizeof(char*));
+    load->data->contents = calloc(mime_count, sizeof(uint8_t*));
+    load->data->sizes = calloc(mime_count, sizeof(size_t));
+    load->reads = calloc(mime_count, sizeof(struct gateway_clipboard_read));
+    load->client_source_destroy.notify = clipboard_client_source_destroy;
+    wl_signal_add(destroy_signal, &load->client_source_destroy);
+    struct wl_event_loop* loop = wl_display_get_event_loop(clipboard->server->wl_display);
+    load->timeout = wl_event_loop_add_timer(loop, handle_clipboard_load_timeout, load);
+    wl_event_source_timer_update(load->timeout, GATEWAY_CLIPBOARD_TIMEOUT_MS);
+    clipboard->loads[kind] = load;
+
+    int32_t i = 0;
+    char** mime_type;
+    wl_array_for_each(mime_type, mime_types) {
+        load->data->mime_types[i] = strdup(*mime_type);
+        load->reads[i].load = load;
+        load->reads[i].index = i;
+        load->reads[i].fd = -1;
+        i++;
+    }
+    for(i = 0; i < mime_count; i++)
+    {
+        struct gateway_clipboard_read* reader = &load->reads[i];
+        int fds[2];
+        if(pipe2(fds, O_CLOEXEC | O_NONBLOCK) < 0)
+        {
+            wlr_log(WLR_ERROR, "Clipboard: pipe failed: %s", strerror(errno));
+            clipboard_load_destroy(load);
+            return;
+        }
+        reader->fd = fds[0];
+        reader->source = wl_event_loop_add_fd(loop, fds[0], WL_EVENT_READABLE,
+            handle_clipboard_read, reader);
+        load->pending++;
+        /* The source closes the write end once it has passed it on. */
+        if(kind == GATEWAY_SELECTION_CLIPBOARD)
+        {
+            wlr_data_source_send(client_source, load->data->mime_types[i], fds[1]);
+        } else
+        {
+            wlr_primary_selection_source_send(client_source, load->data->mime_types[i], fds[1]);
+        }
+    }
+}
+
+static void clipboard_sigpipe(int signal) {}
+
+static void clipboard_init(struct gateway_clipboard* clipboard, struct tinywl_server* server)
+{
+    clipboard->server = server;
+    /* Pastes are written into pipes of clients that may have gone away, EPIPE
+     * is enough to notice that. A handler rather than SIG_IGN or a blocked
+     * mask, exec resets handlers so children still get the default. */
+    struct sigaction action = {0};
+    action.sa_handler = clipboard_sigpipe;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGPIPE, &action, NULL);
+}
+
+static void seat_request_set_selection(struct wl_listener *listener, void *data) {
+	/* This event is raised by the seat when a client wants to set the selection,
+	 * usually when the user copies something. wlroots allows compositors to
+	 * ignore such requests if they so choose, but in tinywl we always honor
+	 */
+	struct tinywl_server *server = wl_container_of(
+			listener, server, request_set_selection);
+	struct wlr_seat_request_set_selection_event *event = data;
+	wlr_seat_set_selection(server->seat, event->source, event->serial);
+    clipboard_load_start(&server->clipboard, GATEWAY_SELECTION_CLIPBOARD, event->source,
+        event->source != NULL ? &event->source->mime_types : NULL,
+        event->source != NULL ? &event->source->events.destroy : NULL, event->serial);
+}
+
+static void seat_request_set_primary_selection(struct wl_listener* listener, void* data)
+{
+    struct tinywl_server* server = wl_container_of(listener, server, request_set_primary_selection);
+    struct wlr_seat_request_set_primary_selection_event* event = data;
+    wlr_seat_set_primary_selection(server->seat, event->source, event->serial);
+    clipboard_load_start(&server->clipboard, GATEWAY_SELECTION_PRIMARY, event->source,
+        event->source != NULL ? &event->source->mime_types : NULL,
+        event->source != NULL ? &event->source->events.destroy : NULL, event->serial);
+}
+
+static bool view_at(struct tinywl_view *view,
+		double lx, double ly, struct wlr_surface **surface,
+		double *sx, double *sy) {
+	/*
+	 * XDG toplevels may have nested surfaces, such as popup windows for context
+	 * menus or tooltips. This function tests if any of those are underneath the
+	 * coordinates lx and ly (in output Layout Coordinates). If so, it sets the
+	 * surface pointer to that wlr_surface and the sx and sy coordinates to the
+	 * coordinates relative to that surface's top-left corner.
+	 */
+	double view_sx = lx - view->x;
+	double view_sy = ly - view->y;
+
+    if(view->focused_by == NULL && view->is_fullscreen)
+    {
+        uint32_t gap = view->server->config->window_gaps; // lazy
+        if(view_sx < gap || view_sy < gap || view_sx > view->width - gap || view_sy > view->height - gap)
+        { return false; }
+    }
+
+	double _sx, _sy;
+	struct wlr_surface *_surface = NULL;
+    if(view->xdg_surface != NULL)
+    {
+        /* render_surface stretches the surface to the view, so undo that. The
+         * surface size is the viewport destination if the client set one. */
+        struct wlr_surface* root = view->xdg_surface->surface;
+        double _scale_x = 1.0, _scale_y=1.0;
+        if(view->width != 0 && root->current.width != 0)
+        {
+            _scale_x= ((double)root->current.width) / ((double)view->width);
+        }
+        if(view->height != 0 && root->current.height != 0)
+        {
+            _scale_y= ((double)root->current.height) / ((double)view->height);
+        }
+
+        _surface = wlr_xdg_surface_surface_at(
+                view->xdg_surface, view_sx * _scale_x, view_sy * _scale_y, &_sx, &_sy);
+    } else if(view->xwayland_surface != NULL)
+    {
+        if(view_sx >= 0 && view_sx < view->width
+            && view_sy >= 0 && view_sy < view->height)
+        {
+            double scale_x = 1.0; double scale_y = 1.0;
+            _surface = view->xwayland_surface->surface;
+            if(view->width != 0 && view->xwayland_surface->width != 0)
+            {
+                scale_x= ((double)view->xwayland_surface->width) / ((double)view->width);
+            }
+            if(view->height != 0 && view->xwayland_surface->height != 0)
+            {
+                scale_y= ((double)view->xwayland_surface->height) / ((double)view->height);
+            }
+            _sx = view_sx * scale_x;
+            _sy = view_sy * scale_y;
+        }
+    }
+
+	if (_surface != NULL) {
+		*sx = _sx;
+		*sy = _sy;
+		*surface = _surface;
+		return true;
+	}
+
+	return false;
+}
+
+static struct tinywl_view *panel_view_at(
+		struct gateway_panel *panel, double lx, double ly,
+		struct wlr_surface **surface, double *sx, double *sy)
+{
+	/* This iterates over all of our surfaces and attempts to find one under the
+	 * cursor. This relies on panel->views being ordered from top-to-bottom. */
+	struct tinywl_view *view;
+    wl_list_for_each(view, &panel->views, link) {
+        if(view->focused_by == NULL) { continue; }
+        if (view_at(view, lx, ly, surface, sx, sy)) {
+            return view;
+        }
+    }
+    wl_list_for_each(view, &panel->views, link) {
+        if(!view->is_fullscreen || view->focused_by != NULL) { continue; }
+        if (view_at(view, lx, ly, surface, sx, sy)) {
+            return view;
+        }
+    }
+    wl_list_for_each(view, &panel->views, link) {
+        if(view->is_fullscreen || view->focused_by != NULL) { continue; }
+        if (view_at(view, lx, ly, surface, sx, sy)) {
+            return view;
+        }
+    }
+	return NULL;
+}
+
+static struct tinywl_view *desktop_view_at(
+		struct tinywl_server *server, double lx, double ly,
+		struct wlr_surface **surface, double *sx, double *sy)
+{
+    uint64_t start_ns = get_time_ns();
+    struct tinywl_view* view = panel_view_at(server->focused_panel, lx, ly, surface, sx, sy);
+    server->stats.hit_tests++;
+    server->stats.hit_test_ns += get_time_ns() - start_ns;
+    return view;
+}
+
+static void process_cursor_move(struct tinywl_server *server, uint32_t time) {
+	/* Move the grabbed view to the new position. */
+	server->grabbed_view->x = server->cursor->x - server->grab_x;
+	server->grabbed_view->y = server->cursor->y - server->grab_y;
+}
+
+static void process_cursor_resize(struct tinywl_server *server, uint32_t time) {
+	/*
+	 * Resizing the grabbed view can be a little bit complicated, because we
+	 * could be resizing from any corner or edge. This not only resizes the view
+	 * on one or two axes, but can also move the view if you resize from the top
+	 * or left edges (or top-left corner).
+	 *
+	 * Note that I took some shortcuts here. In a more fleshed-out compositor,
+	 * you'd wait for the client to prepare a buffer at the new size, then
+	 * commit any movement that was prepared.
+	 */
+	struct tinywl_view *view = server->grabbed_view;
+	double border_x = server->cursor->x - server->grab_x;
+	double border_y = server->cursor->y - server->grab_y;
+	int new_left = server->grab_geobox.x;
+	int new_right = server->grab_geobox.x + server->grab_geobox.width;
+	int new_top = server->grab_geobox.y;
+	int new_bottom = server->grab_geobox.y + server->grab_geobox.height; 
+
+	if (server->resize_edges & WLR_EDGE_TOP) {
+		new_top = border_y;
+		if (new_top >= new_bottom) {
+			new_top = new_bottom - 1;
+		}
+	} else if (server->resize_edges & WLR_EDGE_BOTTOM) {
+		new_bottom = border_y;
+		if (new_bottom <= new_top) {
+			new_bottom = new_top + 1;
+		}
+	}
+	if (server->resize_edges & WLR_EDGE_LEFT) {
+		new_left = border_x;
+		if (new_left >= new_right) {
+			new_left = new_right - 1;
+		}
+	} else if (server->resize_edges & WLR_EDGE_RIGHT) {
+		new_right = border_x;
+		if (new_right <= new_left) {
+			new_right = new_left + 1;
+		}
+	}
+
+	struct wlr_box geo_box;
+	wlr_xdg_surface_get_geometry(view->xdg_surface, &geo_box);
+	view->x = new_left - geo_box.x;
+	view->y = new_top - geo_box.y;
+
+	int new_width = new_right - new_left;
+	int new_height = new_bottom - new_top;
+	wlr_xdg_toplevel_set_size(view->xdg_surface, new_width, new_height);
+}
+
+static void process_cursor_motion(struct tinywl_server *server, uint32_t time) {
+	/* If the mode is non-passthrough, delegate to those functions. */
+//	if (server->cursor_mode == TINYWL_CURSOR_MOVE) {
+//		process_cursor_move(server, time);
+//		return;
+//	} else if (server->cursor_mode == TINYWL_CURSOR_RESIZE) {
+//		process_cursor_resize(server, time);
+//		return;
+//	}
+
+	/* Otherwise, find the view under the pointer and send the event along. */
+	double sx, sy;
+	struct wlr_seat *seat = server->seat;
+	struct wlr_surface *surface = NULL;
+	struct tinywl_view *view = desktop_view_at(server,
+			server->cursor->x, server->cursor->y, &surface, &sx, &sy);
+	if (!view) {
+		/* If there's no view under the cursor, set the cursor image to a
+		 * default. This is what makes the cursor image appear when you move it
+		 * around the screen, not over any views. */
+		wlr_xcursor_manager_set_cursor_image(
+				server->cursor_mgr, "left_ptr", server->cursor);
+	} else
+    {
+        focus_view(view, view->server->focused_panel, true);
+    }
+	if (surface) {
+		bool focus_changed = seat->pointer_state.focused_surface != surface;
+		/*
+		 * "Enter" the surface if necessary. This lets the client know that the
+		 * cursor has entered one of its surfaces.
+		 *
+		 * Note that this gives the surface "pointer focus", which is distinct
+		 * from keyboard focus. You get pointer focus by moving the pointer over
+		 * a window.
+		 */
+		wlr_seat_pointer_notify_enter(seat, surface, sx, sy);
+		if (!focus_changed) {
+			/* The enter event contains coordinates, so we only need to notify
+			 * on motion if the focus did not change. */
+			wlr_seat_pointer_notify_motion(seat, time, sx, sy);
+		}
+	} else {
+		/* Clear pointer focus so future button events and such are not sent to
+		 * the last client to have the cursor over it. */
+		wlr_seat_pointer_clear_focus(seat);
+	}
+}
+
+static void server_cursor_motion(struct wl_listener *listener, void *data) {
+    /* This event is forwarded by the cursor when a pointer emits a _relative_
+     * pointer motion event (i.e. a delta) */
+    struct tinywl_server *server =
+        wl_container_of(listener, server, cursor_motion);
+    struct wlr_event_pointer_motion *event = data;
+    uint64_t arrival_ns = get_time_ns();
+    struct gateway_record_motion record = {
+        .dx = event->delta_x, .dy = event->delta_y,
+        .unaccel_dx = event->unaccel_dx, .unaccel_dy = event->unaccel_dy,
+    };
+    record_write(server, GATEWAY_RECORD_MOTION, &record, sizeof(record));
+    watchdog_enter(&server->watchdog, __func__);
+    server_notify_activity(server);
+    /* The cursor doesn't move unless we tell it to. The cursor automatically
+     * handles constraining the motion to the output layout, as well as any
+     * special configuration applied for the specific input device which
+     * generated the event. You can pass NULL for the device if you want to move
+     * the cursor around without any input. */
+    wlr_relative_pointer_manager_v1_send_relative_motion(
+        server->relative_pointer,
+        server->seat,
+        ((uint64_t)event->time_msec) * 1000,
+        event->delta_x * server->config->mouse_sens, event->delta_y * server->config->mouse_sens,
+        event->unaccel_dx, event->unaccel_dy);
+    wlr_cursor_move(server->cursor, event->device,
+            event->delta_x * server->config->mouse_sens, event->delta_y * server->config->mouse_sens);
+    struct wlr_surface* surface;
+    if(server->focused_panel->focused_view != NULL) {
+    if(server->focused_panel->focused_view->xwayland_surface != NULL)
+    {
+        surface = server->focused_panel->focused_view->xwayland_surface->surface;
+    } else
+    {
+        surface = server->focused_panel->focused_view->xdg_surface->surface;
+    }
+    struct wlr_pointer_constraint_v1* constraint =
+        wlr_pointer_constraints_v1_constraint_for_surface(
+            server->pointer_constraints,
+            surface,
+            server->seat
+        );
+    if(constraint != NULL) {
+    if(constraint->type == WLR_POINTER_CONSTRAINT_V1_LOCKED) {
+        server->cursor->x = (double)server->focused_panel->focused_view->x + ((double)(server->focused_panel->focused_view->width) / 2.0);
+        server->cursor->y = (double)server->focused_panel->focused_view->y + ((double)(server->focused_panel->focused_view->height) / 2.0);
+    } else {
+        if(server->cursor->x < server->focused_panel->focused_view->x) { server->cursor->x = server->focused_panel->focused_view->x; }
+        else if(server->cursor->x > server->focused_panel->focused_view->x + server->focused_panel->focused_view->width)
+        { server->cursor->x = server->focused_panel->focused_view->x + server->focused_panel->focused_view->width; }
+
+        if(server->cursor->y < server->focused_panel->focused_view->y) { server->cursor->y = server->focused_panel->focused_view->y; }
+        else if(server->cursor->y > server->focused_panel->focused_view->y + server->focused_panel->focused_view->height)
+        { server->cursor->y = server->focused_panel->focused_view->y + server->focused_panel->focused_view->height; }
+    }
+    }
+    }
+    process_cursor_motion(server, event->time_msec);
+    gateway_client_input(server->seat->pointer_state.focused_surface);
+    latency_input_delivered(&server->stats.latency, GATEWAY_LATENCY_MOTION,
+        event->time_msec, arrival_ns, server->seat->pointer_state.focused_surface);
+    watchdog_leave(&server->watchdog);
+}
+
+static void server_cursor_motion_absolute(
+		struct wl_listener *listener, void *data) {
+	/* This event is forwarded by the cursor when a pointer emits an _absolute_
+	 * motion event, from 0..1 on each axis. This happens, for example, when
+	 * wlroots is running under a Wayland window rather than KMS+DRM, and you
+	 * move the mouse over the window. You could enter the window from any edge,
+	 * so we have to warp the mouse there. There is also some hardware which
+	 * emits these events. */
+	struct tinywl_server *server =
+		wl_container_of(listener, server, cursor_motion_absolute);
+	struct wlr_event_pointer_motion_absolute *event = data;
+    struct gateway_record_motion_absolute record = { .x = event->x, .y = event->y };
+    record_write(server, GATEWAY_RECORD_MOTION_ABSOLUTE, &record, sizeof(record));
+    watchdog_enter(&server->watchdog, __func__);
+    server_notify_activity(server);
+	wlr_cursor_warp_absolute(server->cursor, event->device, event->x, event->y);
+	process_cursor_motion(server, event->time_msec);
+    gateway_client_input(server->seat->pointer_state.focused_surface);
+    watchdog_leave(&server->watchdog);
+}
+
+static void server_cursor_button(struct wl_listener *listener, void *data) {
+	/* This event is forwarded by the cursor when a pointer emits a button
+	 * event. */
+	struct tinywl_server *server =
+		wl_container_of(listener, server, cursor_button);
+	struct wlr_event_pointer_button *event = data;
+    struct gateway_record_button record = { .button = event->button, .state = event->state };
+    record_write(server, GATEWAY_RECORD_BUTTON, &record, sizeof(record));
+    watchdog_enter(&server->watchdog, __func__);
+    server_notify_activity(server);
+	/* Notify the client with pointer focus that a button press has occurred */
+	wlr_seat_pointer_notify_button(server->seat,
+			event->time_msec, event->button, event->state);
+    gateway_client_input(server->seat->pointer_state.focused_surface);
+	double sx, sy;
+	struct wlr_surface *surface;
+	struct tinywl_view *view = desktop_view_at(server,
+			server->cursor->x, server->cursor->y, &surface, &sx, &sy);
+	if (event->state == WLR_BUTTON_RELEASED) {
+		/* If you released any buttons, we exit interactive move/resize mode. */
+		server->cursor_mode = TINYWL_CURSOR_PASSTHROUGH;
+	}
+    watchdog_leave(&server->watchdog);
+}
+
+static void server_cursor_axis(struct wl_listener *listener, void *data) {
+	/* This event is forwarded by the cursor when a pointer emits an axis event,
+	 * for example when you move the scroll wheel. */
+	struct tinywl_server *server =
+		wl_container_of(listener, server, cursor_axis);
+	struct wlr_event_pointer_axis *event = data;
+    struct gateway_record_axis record = {
+        .delta = event->delta, .delta_discrete = event->delta_discrete,
+        .orientation = event->orientation, .source = event->source,
+    };
+    record_write(server, GATEWAY_RECORD_AXIS, &record, sizeof(record));
+    watchdog_enter(&server->watchdog, __func__);
+    server_notify_activity(server);
+	/* Notify the client with pointer focus of the axis event. */
+	wlr_seat_pointer_notify_axis(server->seat,
+			event->time_msec, event->orientation, event->delta,
+			event->delta_discrete, event->source);
+    gateway_client_input(server->seat->pointer_state.focused_surface);
+    watchdog_leave(&server->watchdog);
+}
+
+static void server_cursor_frame(struct wl_listener *listener, void *data) {
+	/* This event is forwarded by the cursor when a pointer emits an frame
+	 * event. Frame events are sent after regular pointer events to group
+	 * multiple events together. For instance, two axis events may happen at the
+	 * same time, in which case a frame event won't be sent in between. */
+	struct tinywl_server *server =
+		wl_container_of(listener, server, cursor_frame);
+    record_write(server, GATEWAY_RECORD_FRAME, NULL, 0);
+	/* Notify the client with pointer focus of the frame event. */
+	wlr_seat_pointer_notify_frame(server->seat);
+}
+
+/* Used to move all of the data necessary to render a surface from the top-level
+ * frame handler to the per-surface render function. */
+/* Damage tracking. Each surface drawn is recorded with its box and commit
+ * count, anything that moved, appeared, vanished or was committed to since the
+ * last frame of the output is damaged. The damage is handed to the output with
+ * the commit, which is what lets screencopy clients copy with damage. Every
+ * frame is still drawn in full. */
+static void damage_box(struct gateway_damage* damage, struct wlr_box* box)
+{
+    pixman_region32_union_rect(&damage->region, &damage->region,
+        box->x, box->y, box->width, box->height);
+}
+
+static void damage_surface_drawn(struct gateway_damage* damage, struct wlr_surface* surface,
+    struct wlr_box* box, float scale)
+{
+    if(damage == NULL) { return; } // not drawn to the output
+    struct gateway_surface* gsurface = gateway_surface_from_wlr(surface);
+    if(gsurface == NULL) { return; }
+    if(damage->draw_count == damage->draw_capacity)
+    {
+        damage->draw_capacity = damage->draw_capacity == 0 ? 32 : damage->draw_capacity * 2;
+        damage->draws = realloc(damage->draws, damage->draw_capacity * sizeof(struct gateway_draw));
+    }
+    int32_t index = damage->draw_count++;
+    struct gateway_draw* draw = &damage->draws[index];
+    draw->surface_id = gsurface->id;
+    draw->commits = gsurface->commits;
+    draw->box = *box;
+
+    struct gateway_draw* last = index < damage->last_draw_count ? &damage->last_draws[index] : NULL;
+    if(last == NULL || last->surface_id != draw->surface_id ||
+        memcmp(&last->box, &draw->box, sizeof(struct wlr_box)) != 0)
+    {
+        if(last != NULL) { damage_box(damage, &last->box); }
+        damage_box(damage, box);
+        return;
+    }
+    if(last->commits == draw->commits) { return; }
+    /* Only the damage of the latest commit is known, and it is in surface
+     * coordinates, so stretched surfaces and missed commits damage it all. */
+    if(draw->commits - last->commits > 1 ||
+        box->width != (int)(surface->current.width * scale) ||
+        box->height != (int)(surface->current.height * scale))
+    {
+        damage_box(damage, box);
+        return;
+    }
+    pixman_region32_t surface_damage;
+    pixman_region32_init(&surface_damage);
+    wlr_region_scale(&surface_damage, &gsurface->damage, scale);
+    pixman_region32_translate(&surface_damage, box->x, box->y);
+    pixman_region32_intersect_rect(&surface_damage, &surface_damage,
+        box->x, box->y, box->width, box->height);
+    pixman_region32_union(&damage->region, &damage->region, &surface_damage);
+    pixman_region32_fini(&surface_damage);
+}
+
+/* Damages what was drawn last frame but not in this one and swaps the draw
+ * lists for the next frame. */
+static void damage_frame_finish(struct gateway_damage* damage)
+{
+    for(int32_t i = damage->draw_count; i < damage->last_draw_count; i++)
+    {
+        damage_box(damage, &damage->last_draws[i].box);
+    }
+    struct gateway_draw* draws = damage->last_draws;
+    int32_t capacity = damage->last_draw_capacity;
+    damage->last_draws = damage->draws;
+    damage->last_draw_count = damage->draw_count;
+    damage->last_draw_capacity = damage->draw_capacity;
+    damage->draws = draws;
+    damage->draw_capacity = capacity;
+    damage->draw_count = 0;
+}
+
+/* Hands the damage of this frame to the output, it goes out with the commit. */
+static void output_submit_damage(struct tinywl_output* output)
+{
+    struct gateway_damage* damage = &output->damage;
+    struct wlr_output* wlr_output = output->wlr_output;
+    /* Software cursors are drawn into the frame, moving them changes it too. */
+    struct wlr_cursor* cursor = output->server->cursor;
+    if(wlr_output->hardware_cursor == NULL &&
+        (cursor->x != damage->cursor_x || cursor->y != damage->cursor_y))
+    {
+        damage->whole = true;
+    }
+    damage->cursor_x = cursor->x;
+    damage->cursor_y = cursor->y;
+    int32_t buffer_width, buffer_height;
+    wlr_output_transformed_resolution(wlr_output, &buffer_width, &buffer_height);
+    if(damage->whole)
+    {
+        pixman_region32_union_rect(&damage->region, &damage->region, 0, 0,
+            buffer_width, buffer_height);
+        damage->whole = false;
+    }
+
+    pixman_region32_t frame_damage;
+    pixman_region32_init(&frame_damage);
+    wlr_region_transform(&frame_damage, &damage->region,
+        wlr_output_transform_invert(wlr_output->transform), buffer_width, buffer_height);
+    wlr_output_set_damage(wlr_output, &frame_damage);
+    pixman_region32_fini(&frame_damage);
+}
+
+static void server_damage_whole(struct tinywl_server* server)
+{
+    struct tinywl_output* output;
+    wl_list_for_each(output, &server->outputs, link) {
+        output->damage.whole = true;
+    }
+}
+
+/* (Re)allocates the fbo to width x height, the GL context must be current. */
+static bool gateway_fbo_ensure(struct gateway_fbo* fbo, int32_t width, int32_t height)
+{
+    if(fbo->fbo != 0 && fbo->width == width && fbo->height == height) { return true; }
+    if(fbo->fbo == 0)
+    {
+        glGenFramebuffers(1, &fbo->fbo);
+        glGenTextures(1, &fbo->texture);
+    }
+    GLint previous;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+    glBindTexture(GL_TEXTURE_2D, fbo->texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo->fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, fbo->texture, 0);
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, previous);
+    fbo->width = width;
+    fbo->height = height;
+    if(!complete) { wlr_log(WLR_ERROR, "Offscreen framebuffer %dx%d is incomplete", width, height); }
+    return complete;
+}
+
+static void gateway_fbo_finish(struct gateway_fbo* fbo)
+{
+    if(fbo->fbo == 0) { return; }
+    glDeleteFramebuffers(1, &fbo->fbo);
+    glDeleteTextures(1, &fbo->texture);
+    *fbo = (struct gateway_fbo){0};
+}
+
+static GLuint screencopy_get_pbo(struct gateway_screencopy* screencopy, size_t size, size_t* pbo_size)
+{
+    for(int32_t i = 0; i < screencopy->free_pbo_count; i++)
+    {
+        if(screencopy->free_pbo_sizes[i] < size) { continue; }
+        GLuint pbo = screencopy->free_pbos[i];
+        *pbo_size = screencopy->free_pbo_sizes[i];
+        screencopy->free_pbo_count--;
+        screencopy->free_pbos[i] = screencopy->free_pbos[screencopy->free_pbo_count];
+        screencopy->free_pbo_sizes[i] = screencopy->free_pbo_sizes[screencopy->free_pbo_count];
+        return pbo;
+    }
+    GLuint pbo;
+    glGenBuffers(1, &pbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+    glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    *pbo_size = size;
+    return pbo;
+}
+
+static void screencopy_put_pbo(struct gateway_screencopy* screencopy, GLuint pbo, size_t size)
+{
+    if(screencopy->free_pbo_count == GATEWAY_SCREENCOPY_PBOS)
+    {
+        glDeleteBuffers(1, &pbo);
+        return;
+    }
+    screencopy->free_pbos[screencopy->free_pbo_count] = pbo;
+    screencopy->free_pbo_sizes[screencopy->free_pbo_count] = size;
+    screencopy->free_pbo_count++;
+}
+
+static void screencopy_frame_unlock_cursor(struct gateway_screencopy_frame* frame)
+{
+    if(!frame->cursor_locked) { return; }
+    wlr_output_lock_software_cursors(frame->output->wlr_output, false);
+    frame->cursor_locked = false;
+}
+
+/* GL objects are only freed here, with the context current. */
+static void screencopy_frame_destroy(struct gateway_screencopy_frame* frame)
+{
+    wl_list_remove(&frame->link);
+    screencopy_frame_unlock_cursor(frame);
+    if(frame->output == NULL && frame->bench_data == NULL) { frame->screencopy->window_frames--; }
+    if(frame->buffer != NULL) { wl_list_remove(&frame->buffer_destroy.link); }
+    if(frame->resource != NULL) { wl_resource_set_user_data(frame->resource, NULL); }
+    if(frame->fence != NULL) { glDeleteSync(frame->fence); }
+    if(frame->pbo != 0) { screencopy_put_pbo(frame->screencopy, frame->pbo, frame->pbo_size); }
+    free(frame);
+}
+
+static void screencopy_frame_handle_buffer_destroy(struct wl_listener* listener, void* data)
+{
+    struct gateway_screencopy_frame* frame = wl_container_of(listener, frame, buffer_destroy);
+    wl_list_remove(&frame->buffer_destroy.link);
+    frame->buffer = NULL;
+}
+
+static void screencopy_frame_handle_resource_destroy(struct wl_resource* resource)
+{
+    struct gateway_screencopy_frame* frame = wl_resource_get_user_data(resource);
+    if(frame == NULL) { return; }
+    frame->resource = NULL;
+    // The readback is cleaned up when it completes
+    if(frame->state != GATEWAY_SCREENCOPY_IN_FLIGHT) { screencopy_frame_destroy(frame); }
+}
+
+static struct gateway_screencopy_damage* screencopy_get_damage(struct gateway_screencopy* screencopy,
+    struct wl_client* client, struct tinywl_output* output);
+static void screencopy_schedule_windows(struct gateway_screencopy* screencopy);
+static int handle_readback_timer(void* data);
+static void window_capture_bind(struct wl_client* client, void* data, uint32_t version, uint32_t id);
+
+static void screencopy_frame_copy(struct wl_client* client, struct wl_resource* resource,
+    struct wl_resource* buffer, bool with_damage)
+{
+    struct gateway_screencopy_frame* frame = wl_resource_get_user_data(resource);
+    if(frame == NULL) { return; }
+    if(frame->state != GATEWAY_SCREENCOPY_WAITING_COPY)
+    {
+        wl_resource_post_error(resource, ZWLR_SCREENCOPY_FRAME_V1_ERROR_ALREADY_USED,
+            "frame already used");
+        return;
+    }
+    struct wl_shm_buffer* shm = wl_shm_buffer_get(buffer);
+    if(shm == NULL || wl_shm_buffer_get_format(shm) != frame->screencopy->shm_format ||
+        wl_shm_buffer_get_width(shm) != frame->width ||
+        wl_shm_buffer_get_height(shm) != frame->height ||
+        wl_shm_buffer_get_stride(shm) != frame->width * 4)
+    {
+        wl_resource_post_error(resource, ZWLR_SCREENCOPY_FRAME_V1_ERROR_INVALID_BUFFER,
+            "invalid buffer");
+        return;
+    }
+    frame->buffer = buffer;
+    frame->buffer_destroy.notify = screencopy_frame_handle_buffer_destroy;
+    wl_resource_add_destroy_listener(buffer, &frame->buffer_destroy);
+    frame->with_damage = with_damage;
+    frame->state = GATEWAY_SCREENCOPY_WAITING_FRAME;
+    frame->copy_ns = get_time_ns();
+    if(frame->output == NULL)
+    {
+        // Windows are captured as they are, or after their next commit
+        frame->view_dirty = !with_damage;
+        if(frame->view_dirty) { screencopy_schedule_windows(frame->screencopy); }
+        return;
+    }
+    if(with_damage) { screencopy_get_damage(frame->screencopy, client, frame->output); }
+    /* A hardware cursor is on its own plane and never part of the frame,
+     * the output draws it in software until this frame is read. */
+    if(frame->overlay_cursor)
+    {
+        wlr_output_lock_software_cursors(frame->output->wlr_output, true);
+        frame->cursor_locked = true;
+    }
+    wlr_output_schedule_frame(frame->output->wlr_output);
+}
+
+static void screencopy_frame_handle_copy(struct wl_client* client, struct wl_resource* resource,
+    struct wl_resource* buffer)
+{
+    screencopy_frame_copy(client, resource, buffer, false);
+}
+
+static void screencopy_frame_handle_copy_with_damage(struct wl_client* client,
+    struct wl_resource* resource, struct wl_resource* buffer)
+{
+    screencopy_frame_copy(client, resource, buffer, true);
+}
+
+static void screencopy_handle_resource_destroy_request(struct wl_client* client,
+    struct wl_resource* resource)
+{
+    wl_resource_destroy(resource);
+}
+
+static const struct zwlr_screencopy_frame_v1_interface screencopy_frame_impl = {
+    .copy = screencopy_frame_handle_copy,
+    .destroy = screencopy_handle_resource_destroy_request,
+    .copy_with_damage = screencopy_frame_handle_copy_with_damage,
+};
+
+static void screencopy_damage_handle_client_destroy(struct wl_listener* listener, void* data)
+{
+    struct gateway_screencopy_damage* damage = wl_container_of(listener, damage, client_destroy);
+    wl_list_remove(&damage->link);
+    wl_list_remove(&damage->client_destroy.link);
+    pixman_region32_fini(&damage->region);
+    free(damage);
+}
+
+static struct gateway_screencopy_damage* screencopy_get_damage(struct gateway_screencopy* screencopy,
+    struct wl_client* client, struct tinywl_output* output)
+{
+    struct gateway_screencopy_damage* damage;
+    wl_list_for_each(damage, &screencopy->damages, link)
+    {
+        if(damage->client == client && damage->output == output) { return damage; }
+    }
+    damage = calloc(1, sizeof(struct gateway_screencopy_damage));
+    damage->client = client;
+    damage->output = output;
+    // Nothing was copied yet, so everything changed
+    pixman_region32_init_rect(&damage->region, 0, 0,
+        output->wlr_output->width, output->wlr_output->height);
+    damage->client_destroy.notify = screencopy_damage_handle_client_destroy;
+    wl_client_add_destroy_listener(client, &damage->client_destroy);
+    wl_list_insert(&screencopy->damages, &damage->link);
+    return damage;
+}
+
+/* Frames of an output with a capture scale below 1 are scaled down on the
+ * GPU before they are read, that needs GLES 3 as well. */
+static void screencopy_frame_scale(struct gateway_screencopy_frame* frame)
+{
+    double scale = frame->screencopy->async ? frame->output->capture_scale : 1.0;
+    frame->width = frame->box.width * scale + 0.5;
+    frame->height = frame->box.height * scale + 0.5;
+    if(frame->width < 1) { frame->width = 1; }
+    if(frame->height < 1) { frame->height = 1; }
+}
+
+/* region is in layout coordinates, NULL captures the whole output. */
+static void screencopy_capture(struct wl_client* client, struct wl_resource* manager_resource,
+    uint32_t id, bool overlay_cursor, struct wl_resource* output_resource, struct wlr_box* region)
+{
+    struct gateway_screencopy* screencopy = wl_resource_get_user_data(manager_resource);
+    struct wl_resource* resource = wl_resource_create(client, &zwlr_screencopy_frame_v1_interface,
+        wl_resource_get_version(manager_resource), id);
+    if(resource == NULL)
+    {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(resource, &screencopy_frame_impl, NULL,
+        screencopy_frame_handle_resource_destroy);
+
+    struct wlr_output* wlr_output = wlr_output_from_resource(output_resource);
+    struct tinywl_output* output = NULL, *o;
+    wl_list_for_each(o, &screencopy->server->outputs, link)
+    {
+        if(o->wlr_output == wlr_output) { output = o; }
+    }
+    if(output == NULL || !wlr_output->enabled)
+    {
+        zwlr_screencopy_frame_v1_send_failed(resource);
+        return;
+    }
+
+    struct wlr_box box = { .width = wlr_output->width, .height = wlr_output->height };
+    if(region != NULL)
+    {
+        struct wlr_output_layout_output* layout = wlr_output_layout_get(
+            screencopy->server->output_layout, wlr_output);
+        int32_t x1 = (region->x - (layout != NULL ? layout->x : 0)) * wlr_output->scale;
+        int32_t y1 = (region->y - (layout != NULL ? layout->y : 0)) * wlr_output->scale;
+        int32_t x2 = x1 + region->width * wlr_output->scale;
+        int32_t y2 = y1 + region->height * wlr_output->scale;
+        if(x1 < 0) { x1 = 0; }
+        if(y1 < 0) { y1 = 0; }
+        if(x2 > box.width) { x2 = box.width; }
+        if(y2 > box.height) { y2 = box.height; }
+        box = (struct wlr_box){ .x = x1, .y = y1, .width = x2 - x1, .height = y2 - y1 };
+    }
+    if(box.width <= 0 || box.height <= 0)
+    {
+        zwlr_screencopy_frame_v1_send_failed(resource);
+        return;
+    }
+
+    struct gateway_screencopy_frame* frame = calloc(1, sizeof(struct gateway_screencopy_frame));
+    frame->screencopy = screencopy;
+    frame->resource = resource;
+    frame->output = output;
+    frame->box = box;
+    frame->overlay_cursor = overlay_cursor;
+    screencopy_frame_scale(frame);
+    wl_list_insert(&screencopy->frames, &frame->link);
+    wl_resource_set_user_data(resource, frame);
+
+    zwlr_screencopy_frame_v1_send_buffer(resource, screencopy->shm_format,
+        frame->width, frame->height, frame->width * 4);
+    if(wl_resource_get_version(resource) >= ZWLR_SCREENCOPY_FRAME_V1_BUFFER_DONE_SINCE_VERSION)
+    {
+        zwlr_screencopy_frame_v1_send_buffer_done(resource);
+    }
+}
+
+static void screencopy_handle_capture_output(struct wl_client* client, struct wl_resource* resource,
+    uint32_t id, int32_t overlay_cursor, struct wl_resource* output)
+{
+    screencopy_capture(client, resource, id, overlay_cursor != 0, output, NULL);
+}
+
+static void screencopy_handle_capture_output_region(struct wl_client* client,
+    struct wl_resource* resource, uint32_t id, int32_t overlay_cursor, struct wl_resource* output,
+    int32_t x, int32_t y, int32_t width, int32_t height)
+{
+    struct wlr_box region = { .x = x, .y = y, .width = width, .height = height };
+    screencopy_capture(client, resource, id, overlay_cursor != 0, output, &region);
+}
+
+static const struct zwlr_screencopy_manager_v1_interface screencopy_impl = {
+    .capture_output = screencopy_handle_capture_output,
+    .capture_output_region = screencopy_handle_capture_output_region,
+    .destroy = screencopy_handle_resource_destroy_request,
+};
+
+static void screencopy_bind(struct wl_client* client, void* data, uint32_t version, uint32_t id)
+{
+    struct wl_resource* resource = wl_resource_create(client, &zwlr_screencopy_manager_v1_interface,
+        version, id);
+    if(resource == NULL)
+    {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(resource, &screencopy_impl, data, NULL);
+}
+
+/* Checked once at startup. The background cache, the overview, mirroring and
+ * asynchronous screencopy all need GLES 3, GL_VERSION is "OpenGL ES N.M ...". */
+static bool renderer_is_gles3(struct wlr_renderer* renderer)
+{
+    if(!wlr_renderer_is_gles2(renderer)) { return false; }
+    wlr_egl_make_current(wlr_gles2_renderer_get_egl(renderer));
+    const char* version = (const char*)glGetString(GL_VERSION);
+    int major = 0;
+    if(version != NULL) { sscanf(version, "OpenGL ES %d", &major); }
+    return major >= 3;
+}
+
+/* Screencopy needs the GLES2 renderer, anything else gets the wlroots
+ * implementation. */
+static void screencopy_create(struct tinywl_server* server)
+{
+    if(!wlr_renderer_is_gles2(server->renderer))
+    {
+        wlr_screencopy_manager_v1_create(server->wl_display);
+        return;
+    }
+    struct wlr_egl* egl = wlr_gles2_renderer_get_egl(server->renderer);
+    wlr_egl_make_current(egl);
+    const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+
+    struct gateway_screencopy* screencopy = calloc(1, sizeof(struct gateway_screencopy));
+    screencopy->server = server;
+    wl_list_init(&screencopy->frames);
+    wl_list_init(&screencopy->damages);
+    // Pixel buffer objects and fences came with GLES 3
+    screencopy->async = server->gles3;
+    if(extensions != NULL && strstr(extensions, "GL_EXT_read_format_bgra") != NULL)
+    {
+        screencopy->gl_format = GL_BGRA_EXT;
+        screencopy->shm_format = WL_SHM_FORMAT_XRGB8888;
+    } else {
+        screencopy->gl_format = GL_RGBA;
+        screencopy->shm_format = WL_SHM_FORMAT_XBGR8888;
+    }
+    if(server->bench.kind == GATEWAY_BENCH_READBACK_SYNC) { screencopy->async = false; }
+    screencopy->global = wl_global_create(server->wl_display,
+        &zwlr_screencopy_manager_v1_interface, 3, screencopy, screencopy_bind);
+    screencopy->window_global = wl_global_create(server->wl_display,
+        &gateway_window_capture_manager_v1_interface, 1, screencopy, window_capture_bind);
+    screencopy->readback_timer = wl_event_loop_add_timer(wl_display_get_event_loop(server->wl_display),
+        handle_readback_timer, screencopy);
+    server->screencopy = screencopy;
+    wlr_log(WLR_INFO, "Screencopy readback is %s", screencopy->async ? "asynchronous" : "synchronous");
+}
+
+/* Hands the pixels to the client, or tells it the copy failed. */
+static void screencopy_frame_ready(struct gateway_screencopy_frame* frame, const uint8_t* pixels)
+{
+    struct gateway_screencopy* screencopy = frame->screencopy;
+    size_t size = (size_t)frame->width * frame->height * 4;
+    if(frame->bench_data != NULL)
+    {
+        if(pixels != NULL) { memcpy(frame->bench_data, pixels, size); }
+        screencopy->server->bench.readback_bytes += size;
+    } else if(frame->resource != NULL) {
+        if(pixels == NULL || frame->buffer == NULL)
+        {
+            zwlr_screencopy_frame_v1_send_failed(frame->resource);
+            screencopy_frame_destroy(frame);
+            return;
+        }
+        struct wl_shm_buffer* shm = wl_shm_buffer_get(frame->buffer);
+        wl_shm_buffer_begin_access(shm);
+        memcpy(wl_shm_buffer_get_data(shm), pixels, size);
+        wl_shm_buffer_end_access(shm);
+
+        zwlr_screencopy_frame_v1_send_flags(frame->resource,
+            screencopy->y_invert ? ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT : 0);
+        if(frame->with_damage)
+        {
+            zwlr_screencopy_frame_v1_send_damage(frame->resource, frame->damage.x, frame->damage.y,
+                frame->damage.width, frame->damage.height);
+        }
+        uint64_t sec = frame->rendered.tv_sec;
+        zwlr_screencopy_frame_v1_send_ready(frame->resource, sec >> 32, sec & 0xFFFFFFFF,
+            frame->rendered.tv_nsec);
+    }
+    screencopy->frames_copied++;
+    histogram_add(&screencopy->latency, (get_time_ns() - frame->copy_ns) / 1000);
+    screencopy_frame_destroy(frame);
+}
+
+/* Called after attach_render, hands out readbacks the GPU has finished. Only
+ * waits on a fence that is several frames old. */
+static void screencopy_finish_readbacks(struct gateway_screencopy* screencopy,
+    struct tinywl_output* output)
+{
+    if(screencopy == NULL) { return; }
+    struct gateway_screencopy_frame* frame, *tmp;
+    wl_list_for_each_safe(frame, tmp, &screencopy->frames, link)
+    {
+        if((output != NULL && frame->output != output && frame->output != NULL) ||
+            frame->state != GATEWAY_SCREENCOPY_IN_FLIGHT) { continue; }
+        // Never waits, the flush makes sure the fence gets to the GPU at all
+        GLenum status = glClientWaitSync(frame->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        if(status == GL_TIMEOUT_EXPIRED) { continue; }
+
+        const uint8_t* pixels = NULL;
+        size_t size = (size_t)frame->width * frame->height * 4;
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, frame->pbo);
+        if(status != GL_WAIT_FAILED)
+        {
+            pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+        }
+        screencopy_frame_ready(frame, pixels);
+        if(pixels != NULL) { glUnmapBuffer(GL_PIXEL_PACK_BUFFER); }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+}
+
+/* Which way up the rows of a framebuffer come out depends on how the wlroots
+ * renderer sets up its projection. Instead of assuming, its own read_pixels
+ * is asked once, inside a render pass, and frames carry the same Y_INVERT
+ * flag the wlroots screencopy would send. */
+static void screencopy_probe_orientation(struct gateway_screencopy* screencopy)
+{
+    if(screencopy->orientation_known) { return; }
+    uint32_t flags = 0;
+    uint8_t pixel[4];
+    if(!wlr_renderer_read_pixels(screencopy->server->renderer, DRM_FORMAT_ARGB8888, &flags, 4,
+        1, 1, 0, 0, 0, 0, pixel)) { return; }
+    screencopy->orientation_known = true;
+    screencopy->y_invert = (flags & WLR_RENDERER_READ_PIXELS_Y_INVERT) != 0;
+    wlr_log(WLR_INFO, "Screencopy frames are %s", screencopy->y_invert ? "y-inverted" : "upright");
+}
+
+/* Reads box of the bound framebuffer into the frame, asynchronously when
+ * possible. box has the size of the frame and is in GL coordinates. */
+static void screencopy_read(struct gateway_screencopy* screencopy,
+    struct gateway_screencopy_frame* frame, struct wlr_box* box)
+{
+    size_t size = (size_t)frame->width * frame->height * 4;
+    if(!screencopy->async)
+    {
+        uint8_t* pixels = malloc(size);
+        glReadPixels(box->x, box->y, box->width, box->height,
+            screencopy->gl_format, GL_UNSIGNED_BYTE, pixels);
+        screencopy_frame_ready(frame, pixels);
+        free(pixels);
+        return;
+    }
+    frame->pbo = screencopy_get_pbo(screencopy, size, &frame->pbo_size);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, frame->pbo);
+    glReadPixels(box->x, box->y, box->width, box->height,
+        screencopy->gl_format, GL_UNSIGNED_BYTE, NULL);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    frame->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    frame->state = GATEWAY_SCREENCOPY_IN_FLIGHT;
+    wl_event_source_timer_update(screencopy->readback_timer, GATEWAY_SCREENCOPY_POLL_MS);
+}
+
+/* Draws the part of the buffer picked by the surface's viewport, the whole
+ * buffer if it has none. The destination size is already in current.width
+ * and current.height. */
+static void render_surface_texture(struct wlr_renderer* renderer, struct wlr_surface* surface,
+    struct wlr_texture* texture, const float matrix[static 9])
+{
+    struct wlr_fbox src;
+    wlr_surface_get_buffer_source_box(surface, &src);
+    wlr_render_subtexture_with_matrix(renderer, texture, &src, matrix, 1);
+}
+
+/* Window capture, gateway_window_capture_manager_v1. The frames are screencopy
+ * frames whose contents come from drawing a view's surface tree into an
+ * offscreen buffer, whenever the view commits. */
+struct window_capture_render {
+    struct wlr_renderer* renderer;
+    float projection[9];
+    int32_t x, y; // window geometry offset
+    struct timespec* when; // frame callbacks are sent if set
+};
+
+static void window_capture_render_surface(struct wlr_surface* surface, int sx, int sy, void* data)
+{
+    struct window_capture_render* render = data;
+    struct wlr_texture* texture = wlr_surface_get_texture(surface);
+    if(texture == NULL) { return; }
+    struct wlr_box box = {
+        .x = sx - render->x, .y = sy - render->y,
+        .width = surface->current.width, .height = surface->current.height,
+    };
+    float matrix[9];
+    wlr_matrix_project_box(matrix, &box, wlr_output_transform_invert(surface->current.transform),
+        0, render->projection);
+    render_surface_texture(render->renderer, surface, texture, matrix);
+    if(render->when != NULL) { gateway_surface_frame_done(surface, render->when); }
+}
+
+/* The native size of the view, x and y are the offset of the window geometry
+ * in the surface. */
+static void view_get_capture_box(struct tinywl_view* view, struct wlr_box* box)
+{
+    if(view->xdg_surface != NULL)
+    {
+        wlr_xdg_surface_get_geometry(view->xdg_surface, box);
+        return;
+    }
+    *box = (struct wlr_box){
+        .width = view->xwayland_surface->surface != NULL ? view->xwayland_surface->surface->current.width : 0,
+        .height = view->xwayland_surface->surface != NULL ? view->xwayland_surface->surface->current.height : 0,
+    };
+}
 
-	struct wlr_box geo_box;
-	wlr_xdg_surface_get_geometry(view->xdg_surface, &geo_box);
-	view->x = new_left - geo_box.x;
-	view->y = new_top - geo_box.y;
+static void screencopy_render_windows(void* data)
+{
+    struct gateway_screencopy* screencopy = data;
+    struct wlr_renderer* renderer = screencopy->server->renderer;
+    screencopy->window_idle = NULL;
+    wlr_egl_make_current(wlr_gles2_renderer_get_egl(renderer));
 
-	int new_width = new_right - new_left;
-	int new_height = new_bottom - new_top;
-	wlr_xdg_toplevel_set_size(view->xdg_surface, new_width, new_height);
+    struct gateway_screencopy_frame* frame, *tmp;
+    wl_list_for_each_safe(frame, tmp, &screencopy->frames, link)
+    {
+        if(frame->view == NULL || frame->state != GATEWAY_SCREENCOPY_WAITING_FRAME ||
+            !frame->view_dirty || frame->resource == NULL) { continue; }
+        if(!gateway_fbo_ensure(&screencopy->window, frame->width, frame->height))
+        {
+            screencopy_frame_ready(frame, NULL);
+            continue;
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, screencopy->window.fbo);
+        wlr_renderer_begin(renderer, frame->width, frame->height);
+        screencopy_probe_orientation(screencopy);
+        float clear[4] = {0.0, 0.0, 0.0, 0.0};
+        wlr_renderer_clear(renderer, clear);
+        struct window_capture_render render = {
+            .renderer = renderer, .x = frame->box.x, .y = frame->box.y,
+        };
+        wlr_matrix_projection(render.projection, frame->width, frame->height,
+            WL_OUTPUT_TRANSFORM_NORMAL);
+        if(frame->view->xdg_surface != NULL)
+        {
+            wlr_xdg_surface_for_each_surface(frame->view->xdg_surface,
+                window_capture_render_surface, &render);
+        } else if(frame->view->xwayland_surface->surface != NULL) {
+            window_capture_render_surface(frame->view->xwayland_surface->surface, 0, 0, &render);
+        }
+
+        frame->damage = (struct wlr_box){ .width = frame->width, .height = frame->height };
+        clock_gettime(CLOCK_MONOTONIC, &frame->rendered);
+        screencopy_read(screencopy, frame,
+            &(struct wlr_box){ .width = frame->width, .height = frame->height });
+        wlr_renderer_end(renderer);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
 }
 
-static void process_cursor_motion(struct tinywl_server *server, uint32_t time) {
-	/* If the mode is non-passthrough, delegate to those functions. */
-//	if (server->cursor_mode == TINYWL_CURSOR_MOVE) {
-//		process_cursor_move(server, time);
-//		return;
-//	} else if (server->cursor_mode == TINYWL_CURSOR_RESIZE) {
-//		process_cursor_resize(server, time);
-//		return;
-//	}
+/* Finishes readbacks that are done without waiting for an output to draw,
+ * window frames have none and outputs may all be off. Polls again while any
+ * are still in flight. */
+static int handle_readback_timer(void* data)
+{
+    struct gateway_screencopy* screencopy = data;
+    wlr_egl_make_current(wlr_gles2_renderer_get_egl(screencopy->server->renderer));
+    screencopy_finish_readbacks(screencopy, NULL);
+    struct gateway_screencopy_frame* frame;
+    wl_list_for_each(frame, &screencopy->frames, link)
+    {
+        if(frame->state == GATEWAY_SCREENCOPY_IN_FLIGHT)
+        {
+            wl_event_source_timer_update(screencopy->readback_timer, GATEWAY_SCREENCOPY_POLL_MS);
+            break;
+        }
+    }
+    return 0;
+}
 
-	/* Otherwise, find the view under the pointer and send the event along. */
-	double sx, sy;
-	struct wlr_seat *seat = server->seat;
-	struct wlr_surface *surface = NULL;
-	struct tinywl_view *view = desktop_view_at(server,
-			server->cursor->x, server->cursor->y, &surface, &sx, &sy);
-	if (!view) {
-		/* If there's no view under the cursor, set the cursor image to a
-		 * default. This is what makes the cursor image appear when you move it
-		 * around the screen, not over any views. */
-		wlr_xcursor_manager_set_cursor_image(
-				server->cursor_mgr, "left_ptr", server->cursor);
-	} else
+static void screencopy_schedule_windows(struct gateway_screencopy* screencopy)
+{
+    if(screencopy->window_idle != NULL) { return; }
+    screencopy->window_idle = wl_event_loop_add_idle(
+        wl_display_get_event_loop(screencopy->server->wl_display),
+        screencopy_render_windows, screencopy);
+}
+
+static struct tinywl_view* view_from_surface(struct tinywl_server* server, struct wlr_surface* surface)
+{
+    struct wlr_surface* root = wlr_surface_get_root_surface(surface);
+    // Popups are roots of their own, follow them up to the toplevel
+    while(wlr_surface_is_xdg_surface(root))
     {
-        focus_view(view, view->server->focused_panel, true);
+        struct wlr_xdg_surface* xdg_surface = wlr_xdg_surface_from_wlr_surface(root);
+        if(xdg_surface == NULL || xdg_surface->role != WLR_XDG_SURFACE_ROLE_POPUP ||
+            xdg_surface->popup->parent == NULL) { break; }
+        root = wlr_surface_get_root_surface(xdg_surface->popup->parent);
     }
-	if (surface) {
-		bool focus_changed = seat->pointer_state.focused_surface != surface;
-		/*
-		 * "Enter" the surface if necessary. This lets the client know that the
-		 * cursor has entered one of its surfaces.
-		 *
-		 * Note that this gives the surface "pointer focus", which is distinct
-		 * from keyboard focus. You get pointer focus by moving the pointer over
-		 * a window.
-		 */
-		wlr_seat_pointer_notify_enter(seat, surface, sx, sy);
-		if (!focus_changed) {
-			/* The enter event contains coordinates, so we only need to notify
-			 * on motion if the focus did not change. */
-			wlr_seat_pointer_notify_motion(seat, time, sx, sy);
-		}
-	} else {
-		/* Clear pointer focus so future button events and such are not sent to
-		 * the last client to have the cursor over it. */
-		wlr_seat_pointer_clear_focus(seat);
-	}
+    struct tinywl_view* view;
+    wl_list_for_each(view, &server->focused_panel->views, link)
+    {
+        if((view->xdg_surface != NULL && view->xdg_surface->surface == root) ||
+            (view->xwayland_surface != NULL && view->xwayland_surface->surface == root))
+        {
+            return view;
+        }
+    }
+    return NULL;
 }
 
-static void server_cursor_motion(struct wl_listener *listener, void *data) {
-    /* This event is forwarded by the cursor when a pointer emits a _relative_
-     * pointer motion event (i.e. a delta) */
-    struct tinywl_server *server =
-        wl_container_of(listener, server, cursor_motion);
-    struct wlr_event_pointer_motion *event = data;
-    /* The cursor doesn't move unless we tell it to. The cursor automatically
-     * handles constraining the motion to the output layout, as well as any
-     * special configuration applied for the specific input device which
-     * generated the event. You can pass NULL for the device if you want to move
-     * the cursor around without any input. */
-    wlr_relative_pointer_manager_v1_send_relative_motion(
-        server->relative_pointer,
-        server->seat,
-        ((uint64_t)event->time_msec) * 1000,
-        event->delta_x * server->config->mouse_sens, event->delta_y * server->config->mouse_sens,
-        event->unaccel_dx, event->unaccel_dy);
-    wlr_cursor_move(server->cursor, event->device,
-            event->delta_x * server->config->mouse_sens, event->delta_y * server->config->mouse_sens);
-    struct wlr_surface* surface;
-    if(server->focused_panel->focused_view != NULL) {
-    if(server->focused_panel->focused_view->xwayland_surface != NULL)
+/* Window frames waiting for damage are captured after their view commits. */
+static void screencopy_surface_commit(struct gateway_screencopy* screencopy, struct wlr_surface* surface)
+{
+    if(screencopy == NULL || screencopy->window_frames == 0) { return; }
+    struct tinywl_view* view = view_from_surface(screencopy->server, surface);
+    if(view == NULL) { return; }
+    struct gateway_screencopy_frame* frame;
+    wl_list_for_each(frame, &screencopy->frames, link)
     {
-        surface = server->focused_panel->focused_view->xwayland_surface->surface;
-    } else
+        if(frame->view != view || frame->state != GATEWAY_SCREENCOPY_WAITING_FRAME) { continue; }
+        frame->view_dirty = true;
+        screencopy_schedule_windows(screencopy);
+    }
+}
+
+/* Frames of a view that is going away fail, unless already read. */
+static void screencopy_view_destroyed(struct gateway_screencopy* screencopy, struct tinywl_view* view)
+{
+    if(screencopy == NULL) { return; }
+    struct gateway_screencopy_frame* frame, *tmp;
+    wl_list_for_each_safe(frame, tmp, &screencopy->frames, link)
     {
-        surface = server->focused_panel->focused_view->xdg_surface->surface;
+        if(frame->view != view) { continue; }
+        if(frame->state == GATEWAY_SCREENCOPY_IN_FLIGHT) { frame->view = NULL; continue; }
+        if(frame->resource != NULL) { zwlr_screencopy_frame_v1_send_failed(frame->resource); }
+        screencopy_frame_destroy(frame);
     }
-    struct wlr_pointer_constraint_v1* constraint =
-        wlr_pointer_constraints_v1_constraint_for_surface(
-            server->pointer_constraints,
-            surface,
-            server->seat
-        );
-    if(constraint != NULL) {
-    if(constraint->type == WLR_POINTER_CONSTRAINT_V1_LOCKED) {
-        server->cursor->x = (double)server->focused_panel->focused_view->x + ((double)(server->focused_panel->focused_view->width) / 2.0);
-        server->cursor->y = (double)server->focused_panel->focused_view->y + ((double)(server->focused_panel->focused_view->height) / 2.0);
-    } else {
-        if(server->cursor->x < server->focused_panel->focused_view->x) { server->cursor->x = server->focused_panel->focused_view->x; }
-        else if(server->cursor->x > server->focused_panel->focused_view->x + server->focused_panel->focused_view->width)
-        { server->cursor->x = server->focused_panel->focused_view->x + server->focused_panel->focused_view->width; }
+}
 
-        if(server->cursor->y < server->focused_panel->focused_view->y) { server->cursor->y = server->focused_panel->focused_view->y; }
-        else if(server->cursor->y > server->focused_panel->focused_view->y + server->focused_panel->focused_view->height)
-        { server->cursor->y = server->focused_panel->focused_view->y + server->focused_panel->focused_view->height; }
+/* The place of the index-th of count views on the output in output pixels,
+ * a grid cell shrunk to the aspect of a width x height view. */
+static struct wlr_box overview_cell(struct tinywl_output* output, int32_t index, int32_t count,
+    int32_t width, int32_t height)
+{
+    int32_t columns = ceil(sqrt(count));
+    int32_t rows = (count + columns - 1) / columns;
+    int32_t output_width = output->wlr_output->width, output_height = output->wlr_output->height;
+    int32_t gap = output->server->config->window_gaps * output->wlr_output->scale + 4;
+    int32_t cell_width = (output_width - gap * (columns + 1)) / columns;
+    int32_t cell_height = (output_height - gap * (rows + 1)) / rows;
+    struct wlr_box cell = {
+        .x = gap + (index % columns) * (cell_width + gap),
+        .y = gap + (index / columns) * (cell_height + gap),
+        .width = cell_width, .height = cell_height,
+    };
+    if(width <= 0 || height <= 0 || cell_width <= 0 || cell_height <= 0) { return cell; }
+    double fit = fmin((double)cell_width / width, (double)cell_height / height);
+    int32_t fitted_width = width * fit, fitted_height = height * fit;
+    cell.x += (cell_width - fitted_width) / 2;
+    cell.y += (cell_height - fitted_height) / 2;
+    cell.width = fitted_width;
+    cell.height = fitted_height;
+    return cell;
+}
+
+/* Redraws the thumbnails of views that committed damage, sized for the
+ * panel's main output. Has to run before the output's renderer begin. */
+static void overview_update_thumbnails(struct tinywl_server* server, struct wlr_renderer* renderer,
+    struct timespec* when)
+{
+    struct gateway_panel* panel = server->focused_panel;
+    if(panel->main_output == NULL) { return; }
+    int32_t count = wl_list_length(&panel->views);
+    int32_t index = 0;
+    GLint target;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &target);
+    struct tinywl_view* view;
+    wl_list_for_each(view, &panel->views, link) {
+        struct wlr_box box;
+        view_get_capture_box(view, &box);
+        struct wlr_box cell = overview_cell(panel->main_output, index++, count, box.width, box.height);
+        if(box.width <= 0 || box.height <= 0 || cell.width <= 0 || cell.height <= 0) { continue; }
+        if(!view->thumbnail_dirty && view->thumbnail.width == cell.width &&
+            view->thumbnail.height == cell.height) { continue; }
+        if(!gateway_fbo_ensure(&view->thumbnail, cell.width, cell.height))
+        {
+            gateway_fbo_finish(&view->thumbnail);
+            continue;
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, view->thumbnail.fbo);
+        wlr_renderer_begin(renderer, cell.width, cell.height);
+        float clear[4] = {0.0, 0.0, 0.0, 0.0};
+        wlr_renderer_clear(renderer, clear);
+        struct window_capture_render render = {
+            .renderer = renderer, .x = box.x, .y = box.y, .when = when,
+        };
+        // Projecting the view's own size onto the small viewport scales it down
+        wlr_matrix_projection(render.projection, box.width, box.height, WL_OUTPUT_TRANSFORM_NORMAL);
+        if(view->xdg_surface != NULL)
+        {
+            wlr_xdg_surface_for_each_surface(view->xdg_surface, window_capture_render_surface, &render);
+        } else if(view->xwayland_surface->surface != NULL) {
+            window_capture_render_surface(view->xwayland_surface->surface, 0, 0, &render);
+        }
+        wlr_renderer_end(renderer);
+        view->thumbnail_dirty = false;
+        server->overview.thumbnail_renders++;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, target);
+}
+
+/* Takes the place of output_render_views while the overview is up. */
+static void overview_render(struct tinywl_output* output, struct wlr_renderer* renderer)
+{
+    struct tinywl_server* server = output->server;
+    int32_t count = wl_list_length(&server->focused_panel->views);
+    int32_t index = 0;
+    GLint target;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &target);
+    wlr_renderer_scissor(renderer, NULL);
+    float selected_colour[4] = {0.9, 0.9, 0.9, 1.0};
+    struct tinywl_view* view;
+    wl_list_for_each(view, &server->focused_panel->views, link) {
+        struct wlr_box box;
+        view_get_capture_box(view, &box);
+        struct wlr_box cell = overview_cell(output, index, count, box.width, box.height);
+        if(index++ == server->overview.selected)
+        {
+            struct wlr_box border = {
+                .x = cell.x - 4, .y = cell.y - 4, .width = cell.width + 8, .height = cell.height + 8,
+            };
+            wlr_render_rect(renderer, &border, selected_colour, output->wlr_output->transform_matrix);
+        }
+        if(view->thumbnail.fbo == 0 || cell.width <= 0 || cell.height <= 0) { continue; }
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, view->thumbnail.fbo);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target);
+        glBlitFramebuffer(0, 0, view->thumbnail.width, view->thumbnail.height,
+            cell.x, cell.y, cell.x + cell.width, cell.y + cell.height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        glBindFramebuffer(GL_FRAMEBUFFER, target);
+        output->frame_views++;
     }
+    // The blits bypass the draw list
+    output->damage.whole = true;
+}
+
+static void overview_surface_commit(struct tinywl_server* server, struct gateway_surface* gsurface)
+{
+    if(!server->overview.active || !pixman_region32_not_empty(&gsurface->damage)) { return; }
+    struct tinywl_view* view = view_from_surface(server, gsurface->surface);
+    if(view != NULL) { view->thumbnail_dirty = true; }
+}
+
+static void overview_view_destroyed(struct tinywl_server* server, struct tinywl_view* view)
+{
+    if(view->thumbnail.fbo == 0) { return; }
+    wlr_egl_make_current(wlr_gles2_renderer_get_egl(server->renderer));
+    gateway_fbo_finish(&view->thumbnail);
+}
+
+static void server_set_overview(struct tinywl_server* server, bool active)
+{
+    if(active == server->overview.active) { return; }
+    struct gateway_panel* panel = server->focused_panel;
+    if(active && !server->gles3)
+    {
+        wlr_log(WLR_INFO, "The overview needs GLES 3");
+        return;
     }
+    if(active && wl_list_empty(&panel->views)) { return; }
+    server->overview.active = active;
+    /* The client loses keyboard focus while the overview is up, so keys held
+     * when it opens are released with the leave instead of getting stuck. The
+     * enter on close sends whatever is held then. */
+    struct wlr_seat* seat = server->seat;
+    struct wlr_keyboard* keyboard = wlr_seat_get_keyboard(seat);
+    if(active)
+    {
+        wlr_seat_keyboard_notify_clear_focus(seat);
+    } else if(panel->focused_view != NULL && keyboard != NULL)
+    {
+        struct wlr_surface* surface = panel->focused_view->xdg_surface != NULL ?
+            panel->focused_view->xdg_surface->surface : panel->focused_view->xwayland_surface->surface;
+        wlr_seat_keyboard_notify_enter(seat, surface,
+            keyboard->keycodes, keyboard->num_keycodes, &keyboard->modifiers);
     }
-    process_cursor_motion(server, event->time_msec);
+    struct tinywl_view* view;
+    if(active)
+    {
+        int32_t index = 0;
+        server->overview.selected = 0;
+        wl_list_for_each(view, &panel->views, link) {
+            if(view == panel->focused_view) { server->overview.selected = index; }
+            view->thumbnail_dirty = true;
+            index++;
+        }
+    } else
+    {
+        // Not worth keeping, nothing tracks the views' damage until next time
+        wl_list_for_each(view, &panel->views, link) {
+            overview_view_destroyed(server, view);
+        }
+    }
+    server_damage_whole(server);
 }
 
-static void server_cursor_motion_absolute(
-		struct wl_listener *listener, void *data) {
-	/* This event is forwarded by the cursor when a pointer emits an _absolute_
-	 * motion event, from 0..1 on each axis. This happens, for example, when
-	 * wlroots is running under a Wayland window rather than KMS+DRM, and you
-	 * move the mouse over the window. You could enter the window from any edge,
-	 * so we have to warp the mouse there. There is also some hardware which
-	 * emits these events. */
-	struct tinywl_server *server =
-		wl_container_of(listener, server, cursor_motion_absolute);
-	struct wlr_event_pointer_motion_absolute *event = data;
-	wlr_cursor_warp_absolute(server->cursor, event->device, event->x, event->y);
-	process_cursor_motion(server, event->time_msec);
+static void overview_handle_key(struct tinywl_server* server, uint32_t keycode)
+{
+    struct gateway_panel* panel = server->focused_panel;
+    int32_t count = wl_list_length(&panel->views);
+    int32_t columns = count > 0 ? ceil(sqrt(count)) : 1;
+    int32_t selected = server->overview.selected;
+    switch(keycode)
+    {
+    case 105: case 35: selected--; break;          // left, h
+    case 106: case 38: selected++; break;          // right, l
+    case 103: case 37: selected -= columns; break; // up, k
+    case 108: case 36: selected += columns; break; // down, j
+    case 28: case 57: {                            // enter, space
+        struct tinywl_view* view;
+        int32_t index = 0;
+        wl_list_for_each(view, &panel->views, link) {
+            if(index++ != selected) { continue; }
+            focus_view(view, panel, false);
+            center_mouse(server);
+            break;
+        }
+        server_set_overview(server, false);
+        return;
+    }
+    case 1:                                        // escape
+        server_set_overview(server, false);
+        return;
+    }
+    if(selected >= 0 && selected < count) { server->overview.selected = selected; }
 }
 
-static void server_cursor_button(struct wl_listener *listener, void *data) {
-	/* This event is forwarded by the cursor when a pointer emits a button
-	 * event. */
-	struct tinywl_server *server =
-		wl_container_of(listener, server, cursor_button);
-	struct wlr_event_pointer_button *event = data;
-	/* Notify the client with pointer focus that a button press has occurred */
-	wlr_seat_pointer_notify_button(server->seat,
-			event->time_msec, event->button, event->state);
-	double sx, sy;
-	struct wlr_surface *surface;
-	struct tinywl_view *view = desktop_view_at(server,
-			server->cursor->x, server->cursor->y, &surface, &sx, &sy);
-	if (event->state == WLR_BUTTON_RELEASED) {
-		/* If you released any buttons, we exit interactive move/resize mode. */
-		server->cursor_mode = TINYWL_CURSOR_PASSTHROUGH;
-	}
+static void window_capture_handle_capture_view(struct wl_client* client,
+    struct wl_resource* manager_resource, uint32_t id, uint32_t view_id)
+{
+    struct gateway_screencopy* screencopy = wl_resource_get_user_data(manager_resource);
+    struct wl_resource* resource = wl_resource_create(client, &zwlr_screencopy_frame_v1_interface,
+        3, id);
+    if(resource == NULL)
+    {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(resource, &screencopy_frame_impl, NULL,
+        screencopy_frame_handle_resource_destroy);
+
+    struct tinywl_view* view = NULL, *v;
+    wl_list_for_each(v, &screencopy->server->focused_panel->views, link)
+    {
+        if(v->id == view_id) { view = v; }
+    }
+    struct wlr_box box = {0};
+    if(view != NULL) { view_get_capture_box(view, &box); }
+    if(box.width <= 0 || box.height <= 0)
+    {
+        zwlr_screencopy_frame_v1_send_failed(resource);
+        return;
+    }
+
+    struct gateway_screencopy_frame* frame = calloc(1, sizeof(struct gateway_screencopy_frame));
+    frame->screencopy = screencopy;
+    frame->resource = resource;
+    frame->view = view;
+    frame->box = box;
+    frame->width = box.width;
+    frame->height = box.height;
+    wl_list_insert(&screencopy->frames, &frame->link);
+    screencopy->window_frames++;
+    wl_resource_set_user_data(resource, frame);
+
+    zwlr_screencopy_frame_v1_send_buffer(resource, screencopy->shm_format,
+        frame->width, frame->height, frame->width * 4);
+    zwlr_screencopy_frame_v1_send_buffer_done(resource);
 }
 
-static void server_cursor_axis(struct wl_listener *listener, void *data) {
-	/* This event is forwarded by the cursor when a pointer emits an axis event,
-	 * for example when you move the scroll wheel. */
-	struct tinywl_server *server =
-		wl_container_of(listener, server, cursor_axis);
-	struct wlr_event_pointer_axis *event = data;
-	/* Notify the client with pointer focus of the axis event. */
-	wlr_seat_pointer_notify_axis(server->seat,
-			event->time_msec, event->orientation, event->delta,
-			event->delta_discrete, event->source);
+static const struct gateway_window_capture_manager_v1_interface window_capture_impl = {
+    .capture_view = window_capture_handle_capture_view,
+    .destroy = screencopy_handle_resource_destroy_request,
+};
+
+static void window_capture_bind(struct wl_client* client, void* data, uint32_t version, uint32_t id)
+{
+    struct wl_resource* resource = wl_resource_create(client,
+        &gateway_window_capture_manager_v1_interface, version, id);
+    if(resource == NULL)
+    {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(resource, &window_capture_impl, data, NULL);
 }
 
-static void server_cursor_frame(struct wl_listener *listener, void *data) {
-	/* This event is forwarded by the cursor when a pointer emits an frame
-	 * event. Frame events are sent after regular pointer events to group
-	 * multiple events together. For instance, two axis events may happen at the
-	 * same time, in which case a frame event won't be sent in between. */
-	struct tinywl_server *server =
-		wl_container_of(listener, server, cursor_frame);
-	/* Notify the client with pointer focus of the frame event. */
-	wlr_seat_pointer_notify_frame(server->seat);
+/* Called with the finished frame still bound, after its damage is known.
+ * Starts the readback of every frame waiting for this output. Runs twice per
+ * output frame, before the software cursors are drawn for frames without the
+ * cursor and after for those with it. */
+static void screencopy_output_frame(struct gateway_screencopy* screencopy,
+    struct tinywl_output* output, struct timespec* when, bool cursor_drawn)
+{
+    if(!cursor_drawn) { output->recording = false; }
+    if(screencopy == NULL) { return; }
+    struct gateway_screencopy_damage* damage;
+    if(!cursor_drawn)
+    {
+        screencopy->frame_readback_ns = 0;
+        wl_list_for_each(damage, &screencopy->damages, link)
+        {
+            if(damage->output != output) { continue; }
+            pixman_region32_union(&damage->region, &damage->region, &output->damage.region);
+        }
+    }
+
+    uint64_t start_ns = get_time_ns();
+    struct gateway_screencopy_frame* frame, *tmp;
+    wl_list_for_each_safe(frame, tmp, &screencopy->frames, link)
+    {
+        if(frame->output != output || frame->state != GATEWAY_SCREENCOPY_WAITING_FRAME ||
+            frame->overlay_cursor != cursor_drawn) { continue; }
+        screencopy_probe_orientation(screencopy);
+        if(frame->resource == NULL && frame->bench_data == NULL) { continue; }
+        if(frame->with_damage)
+        {
+            damage = screencopy_get_damage(screencopy, wl_resource_get_client(frame->resource), output);
+            pixman_region32_t region;
+            pixman_region32_init(&region);
+            pixman_region32_intersect_rect(&region, &damage->region,
+                frame->box.x, frame->box.y, frame->box.width, frame->box.height);
+            bool empty = !pixman_region32_not_empty(&region);
+            pixman_box32_t* extents = pixman_region32_extents(&region);
+            double sx = (double)frame->width / frame->box.width;
+            double sy = (double)frame->height / frame->box.height;
+            int32_t x1 = (extents->x1 - frame->box.x) * sx, y1 = (extents->y1 - frame->box.y) * sy;
+            int32_t x2 = ceil((extents->x2 - frame->box.x) * sx), y2 = ceil((extents->y2 - frame->box.y) * sy);
+            frame->damage = (struct wlr_box){ .x = x1, .y = y1, .width = x2 - x1, .height = y2 - y1 };
+            pixman_region32_fini(&region);
+            if(empty) { continue; }
+            pixman_region32_clear(&damage->region);
+        }
+        output->recording = true;
+        frame->rendered = *when;
+        screencopy_frame_unlock_cursor(frame);
+
+        /* box is top down, with an inverted renderer the top of the output
+         * is the last row of the framebuffer. */
+        struct wlr_box box = frame->box;
+        if(screencopy->y_invert) { box.y = output->wlr_output->height - box.y - box.height; }
+        bool scaled = frame->width != frame->box.width || frame->height != frame->box.height;
+        if(!scaled)
+        {
+            screencopy_read(screencopy, frame, &box);
+            continue;
+        }
+        /* Only the reduced pixel count crosses over to the CPU. The same fbo
+         * serves every scaled frame, the readback is ordered before the next
+         * blit into it. */
+        if(!gateway_fbo_ensure(&screencopy->scaled, frame->width, frame->height)) { continue; }
+        GLint output_fbo;
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &output_fbo);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, screencopy->scaled.fbo);
+        glBlitFramebuffer(box.x, box.y, box.x + box.width, box.y + box.height,
+            0, 0, frame->width, frame->height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, screencopy->scaled.fbo);
+        screencopy_read(screencopy, frame,
+            &(struct wlr_box){ .width = frame->width, .height = frame->height });
+        glBindFramebuffer(GL_FRAMEBUFFER, output_fbo);
+    }
+    screencopy->frame_readback_ns += get_time_ns() - start_ns;
+    if(cursor_drawn && output->recording)
+    { histogram_add(&screencopy->readback, screencopy->frame_readback_ns / 1000); }
+}
+
+/* With a fractional scale the box comes out a pixel off the buffer, which
+ * would resample the whole surface. Buffers that already have the size of the
+ * box are drawn 1:1. */
+static void render_snap_box(struct wlr_surface* surface, struct wlr_box* box)
+{
+    if(surface->current.viewport.has_src) { return; }
+    int32_t width = surface->current.buffer_width, height = surface->current.buffer_height;
+    if(surface->current.transform & WL_OUTPUT_TRANSFORM_90)
+    {
+        int32_t tmp = width;
+        width = height;
+        height = tmp;
+    }
+    if(abs(width - box->width) <= 1 && abs(height - box->height) <= 1)
+    {
+        box->width = width;
+        box->height = height;
+    }
 }
 
-/* Used to move all of the data necessary to render a surface from the top-level
- * frame handler to the per-surface render function. */
 struct render_data {
 	struct wlr_output *output;
-	struct wlr_renderer *renderer;
     struct tinywl_view *view;
-    struct gateway_layer_surface* ls;
-	struct timespec *when;
+    struct gateway_draw_list* draws;
+    struct gateway_damage* damage;
+    double ox, oy; // the output's position in the layout
 };
 
+static void draw_list_add(struct gateway_draw_list* draws, struct wlr_surface* surface,
+    struct wlr_texture* texture, struct wlr_box* box, struct gateway_damage* damage)
+{
+    if(draws->count == draws->capacity)
+    {
+        draws->capacity = draws->capacity == 0 ? 32 : draws->capacity * 2;
+        draws->items = realloc(draws->items, draws->capacity * sizeof(struct gateway_draw_item));
+    }
+    struct gateway_draw_item* item = &draws->items[draws->count++];
+    item->surface = surface;
+    item->texture = texture;
+    item->box = *box;
+    item->damage = damage;
+    /* Stretching keeps a fully opaque surface opaque, a partly opaque one is
+     * treated as translucent. */
+    pixman_box32_t extents = { 0, 0, surface->current.width, surface->current.height };
+    item->opaque = wlr_texture_is_opaque(texture) ||
+        pixman_region32_contains_rectangle(&surface->opaque_region, &extents) == PIXMAN_REGION_IN;
+}
+
+/* Draws everything added since the last submit. Going top to bottom first,
+ * surfaces entirely under opaque ones or outside the output are dropped, a
+ * stack of maximized windows costs one draw instead of one per window. The
+ * rest is drawn bottom to top like before. Culled surfaces still count as
+ * shown for damage and frame callbacks, being hidden is the window manager's
+ * business and clients throttled by it tend to stall. */
+static void draw_list_submit(struct gateway_draw_list* draws, struct tinywl_output* output,
+    struct wlr_renderer* renderer, int width, int height, struct timespec* when)
+{
+    struct wlr_output* wlr_output = output->wlr_output;
+    struct gateway_stats* stats = &output->server->stats;
+    pixman_region32_clear(&draws->covered);
+    for(int32_t i = draws->count - 1; i >= 0; i--)
+    {
+        struct gateway_draw_item* item = &draws->items[i];
+        struct wlr_box* box = &item->box;
+        pixman_box32_t rect = { box->x, box->y, box->x + box->width, box->y + box->height };
+        if(rect.x2 <= 0 || rect.y2 <= 0 || rect.x1 >= width || rect.y1 >= height ||
+            pixman_region32_contains_rectangle(&draws->covered, &rect) == PIXMAN_REGION_IN)
+        {
+            item->texture = NULL;
+            continue;
+        }
+        if(item->opaque)
+        {
+            pixman_region32_union_rect(&draws->covered, &draws->covered,
+                box->x, box->y, box->width, box->height);
+        }
+    }
+
+    for(int32_t i = 0; i < draws->count; i++)
+    {
+        struct gateway_draw_item* item = &draws->items[i];
+        struct wlr_surface* surface = item->surface;
+        if(item->texture != NULL)
+        {
+            /*
+             * Those familiar with OpenGL are also familiar with the role of matricies
+             * in graphics programming. We need to prepare a matrix to render the view
+             * with. wlr_matrix_project_box is a helper which takes a box with a desired
+             * x, y coordinates, width and height, and an output geometry, then
+             * prepares an orthographic projection and multiplies the necessary
+             * transforms to produce a model-view-projection matrix.
+             */
+            float matrix[9];
+            enum wl_output_transform transform =
+                wlr_output_transform_invert(surface->current.transform);
+            wlr_matrix_project_box(matrix, &item->box, transform, 0,
+                wlr_output->transform_matrix);
+            render_surface_texture(renderer, surface, item->texture, matrix);
+            output->frame_surfaces++;
+            stats->draws_submitted++;
+        } else
+        {
+            output->frame_culled++;
+            stats->draws_culled++;
+        }
+        damage_surface_drawn(item->damage, surface, &item->box, wlr_output->scale);
+        latency_surface_rendered(&stats->latency, surface, output);
+
+        /* This lets the client know that we've displayed that frame and it can
+         * prepare another one now if it likes. */
+        gateway_surface_frame_done(surface, when);
+    }
+    draws->count = 0;
+}
+
 static void render_surface(struct wlr_surface *surface,
 		int sx, int sy, void *data) {
 	/* This function is called for every surface that needs to be rendered. */
@@ -947,17 +4516,9 @@ static void render_surface(struct wlr_surface *surface,
 		return;
 	}
 
-	/* The view has a position in layout coordinates. If you have two displays,
-	 * one next to the other, both 1080p, a view on the rightmost display might
-	 * have layout coordinates of 2000,100. We need to translate that to
-	 * output-local coordinates, or (2000 - 1920). */
-	double ox = 0, oy = 0;
-	wlr_output_layout_output_coords(
-			view->server->output_layout, output, &ox, &oy);
-	ox += view->x + sx, oy += view->y + sy;
+	double ox = rdata->ox + view->x + sx, oy = rdata->oy + view->y + sy;
 
-	/* We also have to apply the scale factor for HiDPI outputs. This is only
-	 * part of the puzzle, TinyWL does not fully support HiDPI. */
+	/* We also have to apply the scale factor for HiDPI outputs. */
     struct wlr_box box = {
         .x = ox * output->scale,
         .y = oy * output->scale,
@@ -970,38 +4531,14 @@ static void render_surface(struct wlr_surface *surface,
         box.width = view->width * output->scale;
         box.height = view->height * output->scale;
     }
-
-	/*
-	 * Those familiar with OpenGL are also familiar with the role of matricies
-	 * in graphics programming. We need to prepare a matrix to render the view
-	 * with. wlr_matrix_project_box is a helper which takes a box with a desired
-	 * x, y coordinates, width and height, and an output geometry, then
-	 * prepares an orthographic projection and multiplies the necessary
-	 * transforms to produce a model-view-projection matrix.
-	 *
-	 * Naturally you can do this any way you like, for example to make a 3D
-	 * compositor.
-	 */
-	float matrix[9];
-	enum wl_output_transform transform =
-		wlr_output_transform_invert(surface->current.transform);
-	wlr_matrix_project_box(matrix, &box, transform, 0,
-		output->transform_matrix);
-
-	/* This takes our matrix, the texture, and an alpha, and performs the actual
-	 * rendering on the GPU. */
-	wlr_render_texture_with_matrix(rdata->renderer, texture, matrix, 1);
-
-	/* This lets the client know that we've displayed that frame and it can
-	 * prepare another one now if it likes. */
-	wlr_surface_send_frame_done(surface, rdata->when);
+    render_snap_box(surface, &box);
+    draw_list_add(rdata->draws, surface, texture, &box, rdata->damage);
 }
 
 static void render_layer_surface(struct wlr_surface *surface,
         int sx, int sy, void *data) {
     /* This function is called for every surface that needs to be rendered. */
     struct render_data *rdata = data;
-    struct gateway_layer_surface* view = rdata->ls;
     struct wlr_output *output = rdata->output;
  
     /* We first obtain a wlr_texture, which is a GPU resource. wlroots
@@ -1022,208 +4559,1052 @@ static void render_layer_surface(struct wlr_surface *surface,
         .width = surface->current.width * output->scale,
         .height = surface->current.height * output->scale,
     };
- 
-    float matrix[9];
-    enum wl_output_transform transform =
-        wlr_output_transform_invert(surface->current.transform);
-    wlr_matrix_project_box(matrix, &box, transform, 0,
-        output->transform_matrix);
- 
-    /* This takes our matrix, the texture, and an alpha, and performs the actual
-     * rendering on the GPU. */
-    wlr_render_texture_with_matrix(rdata->renderer, texture, matrix, 1);
+    render_snap_box(surface, &box);
+    draw_list_add(rdata->draws, surface, texture, &box, rdata->damage);
+}
+
+static bool output_contains_stack(struct tinywl_output* output, int32_t s)
+{
+    for(int i = 0; i < output->stack_count; i++)
+    {
+        if(output->stacks[i] == s)
+        { return true; }
+    }
+    return false;
+}
+
+struct view_output_data {
+    struct tinywl_output* output;
+    bool enter;
+};
+
+static void view_send_output(struct wlr_surface* surface, int sx, int sy, void* data)
+{
+    struct view_output_data* output_data = data;
+    uint32_t bit = 1u << output_data->output->index;
+    struct gateway_surface* gsurface = gateway_surface_from_wlr(surface);
+    if(gsurface != NULL)
+    {
+        // Surfaces that got their outputs on their first commit already know
+        if(((gsurface->outputs & bit) != 0) == output_data->enter) { return; }
+        gsurface->outputs ^= bit;
+    }
+    if(output_data->enter) { wlr_surface_send_enter(surface, output_data->output->wlr_output); }
+    else { wlr_surface_send_leave(surface, output_data->output->wlr_output); }
+}
+
+/* Popups and subsurfaces created after their view was placed missed the
+ * enter events of view_update_outputs, they get them on their first buffer. */
+static void surface_enter_view_outputs(struct gateway_surface* gsurface)
+{
+    struct tinywl_view* view = view_from_surface(gsurface->server, gsurface->surface);
+    if(view == NULL) { return; }
+    struct tinywl_output* output;
+    wl_list_for_each(output, &gsurface->server->outputs, link) {
+        if(output->index >= 32 || (view->outputs & (1u << output->index)) == 0) { continue; }
+        struct view_output_data output_data = { .output = output, .enter = true };
+        view_send_output(gsurface->surface, 0, 0, &output_data);
+    }
+}
+
+/* Tells the view's surfaces which outputs they are on, clients pick their
+ * buffer scale from the outputs a surface has entered. */
+static void view_update_outputs(struct tinywl_view* view)
+{
+    struct tinywl_server* server = view->server;
+    struct wlr_box view_box = { .x = view->x, .y = view->y, .width = view->width, .height = view->height };
+    struct wlr_box intersection;
+    uint32_t outputs = 0;
+    struct tinywl_output* output;
+    wl_list_for_each(output, &server->outputs, link) {
+        if(output->index >= 32) { continue; }
+        struct wlr_box* box = wlr_output_layout_get_box(server->output_layout, output->wlr_output);
+        if(box != NULL && wlr_box_intersection(&intersection, &view_box, box))
+        { outputs |= 1u << output->index; }
+    }
+    if(outputs == view->outputs) { return; }
+
+    wl_list_for_each(output, &server->outputs, link) {
+        if(output->index >= 32 || ((outputs ^ view->outputs) & (1u << output->index)) == 0) { continue; }
+        struct view_output_data output_data = {
+            .output = output,
+            .enter = (outputs & (1u << output->index)) != 0,
+        };
+        if(view->xdg_surface != NULL)
+        {
+            wlr_xdg_surface_for_each_surface(view->xdg_surface, view_send_output, &output_data);
+        } else if(view->xwayland_surface != NULL && view->xwayland_surface->surface != NULL)
+        {
+            wlr_surface_for_each_surface(view->xwayland_surface->surface, view_send_output, &output_data);
+        }
+    }
+    view->outputs = outputs;
+}
+
+static void panel_update(struct gateway_panel* panel, struct tinywl_output* output)
+{
+    struct tinywl_view *view;
+    struct tinywl_view *_view_tmp;
+    wl_list_for_each_safe(view, _view_tmp, &panel->views, link)
+    {
+        view->stack_index = -1;
+        if(view->xwayland_surface != NULL)
+        {
+            if(view->xwayland_surface->override_redirect)
+            {
+                view->x=view->xwayland_surface->x;
+                view->y=view->xwayland_surface->y;
+                view->width=view->xwayland_surface->width;
+                view->height=view->xwayland_surface->height;
+                wl_list_remove(&view->link);    
+                wl_list_insert(&panel->redirect_views, &view->link);
+                continue;
+            }
+        }
+    }
+    struct wlr_output_layout_output* output_layout = wlr_output_layout_get(
+        output->server->output_layout, output->wlr_output
+    );
+    // Logical size, the output's resolution divided by its scale
+    struct wlr_box* output_box = wlr_output_layout_get_box(
+        output->server->output_layout, output->wlr_output);
+    int32_t view_count = wl_list_length(&panel->views);
+    if(view_count > panel->layout_view_capacity)
+    {
+        int32_t capacity = panel->layout_view_capacity ? panel->layout_view_capacity : 16;
+        while(capacity < view_count) { capacity *= 2; }
+        struct gateway_layout_view* views = realloc(panel->layout_views,
+            capacity * sizeof(struct gateway_layout_view));
+        if(views == NULL)
+        {
+            wlr_log(WLR_ERROR, "Could not grow the layout for %d views", view_count);
+            return;
+        }
+        panel->layout_views = views;
+        panel->layout_view_capacity = capacity;
+    }
+
+    int32_t i = 0;
+    wl_list_for_each(view, &panel->views, link)
+    {
+        struct gateway_layout_view* lview = &panel->layout_views[i++];
+        *lview = (struct gateway_layout_view){ .fullscreen = view->is_fullscreen };
+        if(view->xwayland_surface != NULL)
+        {
+            if(view->xwayland_surface->size_hints != NULL)
+            {
+                lview->min_width = view->xwayland_surface->size_hints->min_width;
+                lview->min_height = view->xwayland_surface->size_hints->min_height;
+                lview->max_width = view->xwayland_surface->size_hints->max_width;
+                lview->max_height = view->xwayland_surface->size_hints->max_height;
+            }
+        } else if(view->xdg_surface != NULL)
+        {
+            lview->min_width = view->xdg_surface->toplevel->current.min_width;
+            lview->min_height = view->xdg_surface->toplevel->current.min_height;
+            lview->max_width = view->xdg_surface->toplevel->current.max_width;
+            lview->max_height = view->xdg_surface->toplevel->current.max_height;
+        }
+    }
+
+    struct gateway_layout_output layout_output = {
+        .box = { output_layout->x, output_layout->y, output_box->width, output_box->height },
+        .stacks = output->stacks,
+        .stack_count = output->stack_count,
+    };
+    gateway_layout_arrange(panel->stacks, panel->stack_count, &layout_output,
+        output->server->config->window_gaps, panel->layout_views, view_count);
+
+    i = 0;
+    wl_list_for_each(view, &panel->views, link)
+    {
+        struct gateway_layout_view* lview = &panel->layout_views[i++];
+        view->stack_index = lview->stack_index;
+        if(!lview->placed) { continue; }
+        view->x = lview->box.x;
+        view->y = lview->box.y;
+        view->width = lview->box.width;
+        view->height = lview->box.height;
+        view_update_outputs(view);
+
+        if(view->xwayland_surface != NULL)
+        {
+            wlr_xwayland_surface_configure(view->xwayland_surface, 0, 0,
+                lview->width, lview->height);
+        } else if(view->xdg_surface != NULL)
+        {
+            wlr_xdg_toplevel_set_size(view->xdg_surface, lview->width, lview->height);
+        }
+    }
+}
+static void panel_post_update(struct gateway_panel* panel)
+{
+    struct tinywl_view *view;
+    struct tinywl_view *_view_tmp;
+    wl_list_for_each_safe(view, _view_tmp, &panel->redirect_views, link)
+    {
+        wl_list_remove(&view->link);
+        wl_list_insert(&panel->views, &view->link);
+    }
+}
+/* Brightness and colour temperature are applied through the gamma LUT of
+ * each output, so they cost nothing per frame. Outputs without gamma support,
+ * or with a client holding a gamma control for them, fall back to blending a
+ * black quad over the frame, which can only do brightness. */
+
+/* Approximates the white point of a black body at t hundred kelvin, in 0-255
+ * per channel. */
+static void black_body_rgb(double t, double rgb[3])
+{
+    if(t <= 66) {
+        rgb[0] = 255;
+        rgb[1] = 99.4708025861 * log(t) - 161.1195681661;
+        rgb[2] = t <= 19 ? 0 : 138.5177312231 * log(t - 10) - 305.0447927307;
+    } else {
+        rgb[0] = 329.698727446 * pow(t - 60, -0.1332047592);
+        rgb[1] = 288.1221695283 * pow(t - 60, -0.0755148492);
+        rgb[2] = 255;
+    }
+}
+
+/* The white point of kelvin, scaled so that 6500K is neutral. */
+static void temperature_to_rgb(uint32_t kelvin, float rgb[3])
+{
+    if(kelvin < 1000) { kelvin = 1000; }
+    if(kelvin > 10000) { kelvin = 10000; }
+    double channels[3], neutral[3];
+    black_body_rgb(kelvin / 100.0, channels);
+    // The same formula at 6500K, so the default leaves the colours alone
+    black_body_rgb(65.0, neutral);
+    for(int i = 0; i < 3; i++) {
+        double c = channels[i] / neutral[i];
+        rgb[i] = c < 0 ? 0 : c > 1 ? 1 : c;
+    }
+}
+
+static bool output_has_gamma_client(struct tinywl_output* output)
+{
+    struct wlr_gamma_control_v1* control;
+    wl_list_for_each(control, &output->server->gamma_control_manager->controls, link) {
+        if(control->output == output->wlr_output) { return true; }
+    }
+    return false;
+}
+
+/* Sets the pending gamma of the output, it goes out with the next commit. */
+static void output_apply_gamma(struct tinywl_output* output)
+{
+    struct tinywl_server* server = output->server;
+    output->gamma_dirty = false;
+    output->gamma_active = false;
+    output->gamma_pending = false;
+    if(output->gamma_client) { return; }
+    size_t size = wlr_output_get_gamma_size(output->wlr_output);
+    if(size < 2) { return; }
+
+    if(server->brightness >= 1.0 && server->color_temperature == 6500) {
+        // Identity, also hands the output back to its default ramp
+        wlr_output_set_gamma(output->wlr_output, 0, NULL, NULL, NULL);
+        output->gamma_pending = true;
+        return;
+    }
+
+    float rgb[3];
+    temperature_to_rgb(server->color_temperature, rgb);
+    uint16_t* table = calloc(3 * size, sizeof(uint16_t));
+    for(size_t i = 0; i < size; i++) {
+        double value = (double)i / (size - 1) * server->brightness;
+        for(int c = 0; c < 3; c++) {
+            table[c * size + i] = (uint16_t)(value * rgb[c] * UINT16_MAX + 0.5);
+        }
+    }
+    wlr_output_set_gamma(output->wlr_output, size, table, table + size, table + 2 * size);
+    free(table);
+    output->gamma_pending = true;
+}
+
+/* The ramp only counts once a commit carried it. wlroots drops it with a
+ * failed commit, so it is set again for the next frame. */
+static void output_gamma_committed(struct tinywl_output* output, bool committed)
+{
+    if(!output->gamma_pending) { return; }
+    output->gamma_pending = false;
+    if(committed) { output->gamma_active = true; }
+    else { output->gamma_dirty = true; }
+}
+
+static void server_set_brightness(struct tinywl_server* server, float brightness,
+    uint32_t temperature)
+{
+    if(brightness > 1.0) { brightness = 1.0; }
+    else if(brightness < 0.0) { brightness = 0.0; }
+    if(brightness == server->brightness && temperature == server->color_temperature) { return; }
+    server->brightness = brightness;
+    server->color_temperature = temperature;
+    server_damage_whole(server);
+    struct tinywl_output* output;
+    wl_list_for_each(output, &server->outputs, link) {
+        output->gamma_dirty = true;
+        wlr_output_schedule_frame(output->wlr_output);
+    }
+}
+
+/* The mode the output should be in: the one picked when it appeared, or on
+ * battery the fastest mode of the same size that stays within
+ * battery_refresh, the slowest one if none does. */
+static struct wlr_output_mode* output_profile_mode(struct tinywl_output* output)
+{
+    struct wlr_output_mode* mode = output->performance_mode;
+    if(mode == NULL || !output->server->battery_profile) { return mode; }
+    int32_t limit = output->server->config->battery_refresh * 1000;
+    struct wlr_output_mode* best = NULL;
+    struct wlr_output_mode* m;
+    wl_list_for_each(m, &output->wlr_output->modes, link) {
+        if(m->width != mode->width || m->height != mode->height) { continue; }
+        if(best == NULL) { best = m; continue; }
+        bool fits = m->refresh <= limit, best_fits = best->refresh <= limit;
+        if((fits && (!best_fits || m->refresh > best->refresh)) ||
+            (!fits && !best_fits && m->refresh < best->refresh)) { best = m; }
+    }
+    return best;
+}
+
+/* Switches the mode in place, windows and the output stay as they are. */
+static void output_apply_profile(struct tinywl_output* output)
+{
+    struct wlr_output* wlr_output = output->wlr_output;
+    struct wlr_output_mode* mode = output_profile_mode(output);
+    // Powered off outputs get their mode when they come back on
+    if(mode == NULL || mode == wlr_output->current_mode || !wlr_output->enabled) { return; }
+    wlr_output_set_mode(wlr_output, mode);
+    if(!wlr_output_commit(wlr_output))
+    {
+        wlr_log(WLR_ERROR, "Failed to switch output %s to %d mHz", wlr_output->name, mode->refresh);
+        wlr_output_rollback(wlr_output);
+        return;
+    }
+    wlr_log(WLR_INFO, "Output %s now at %dx%d@%d mHz", wlr_output->name,
+        mode->width, mode->height, mode->refresh);
+    output->damage.whole = true;
+    output->last_frame_ns = 0;
+    wlr_output_schedule_frame(wlr_output);
+}
+
+static void server_set_power_profile(struct tinywl_server* server, bool battery)
+{
+    if(battery == server->battery_profile) { return; }
+    server->battery_profile = battery;
+    wlr_log(WLR_INFO, "Power profile %s", battery ? "battery" : "performance");
+    struct tinywl_output* output;
+    wl_list_for_each(output, &server->outputs, link) {
+        output_apply_profile(output);
+    }
+}
+
+static void output_set_power(struct tinywl_output* output, bool on)
+{
+    struct wlr_output* wlr_output = output->wlr_output;
+    if(wlr_output->enabled == on) { return; }
+    wlr_output_enable(wlr_output, on);
+    // The power profile may have changed while it was off
+    struct wlr_output_mode* mode = output_profile_mode(output);
+    if(on && mode != NULL && mode != wlr_output->current_mode) { wlr_output_set_mode(wlr_output, mode); }
+    if(!wlr_output_commit(wlr_output))
+    {
+        wlr_log(WLR_ERROR, "Failed to turn output %s %s", wlr_output->name, on ? "on" : "off");
+        return;
+    }
+    wlr_log(WLR_DEBUG, "Output %s turned %s", wlr_output->name, on ? "on" : "off");
+    if(on)
+    {
+        /* Nothing was drawn while it was off and the gamma ramp went with the
+         * CRTC. The gap isn't a dropped frame either. */
+        output->damage.whole = true;
+        output->gamma_dirty = true;
+        output->last_frame_ns = 0;
+        output->mirror_shown = false;
+        wlr_output_schedule_frame(wlr_output);
+    }
+}
+
+static void server_set_output_power(struct wl_listener* listener, void* data)
+{
+    struct tinywl_server* server = wl_container_of(listener, server, output_power_set_mode);
+    struct wlr_output_power_v1_set_mode_event* event = data;
+    struct tinywl_output* output;
+    wl_list_for_each(output, &server->outputs, link) {
+        if(output->wlr_output == event->output)
+        {
+            // The client's choice outlasts the idle blanking
+            output->idle_off = false;
+            output_set_power(output, event->mode == ZWLR_OUTPUT_POWER_V1_MODE_ON);
+            return;
+        }
+    }
+}
+
+/* Input only stamps last_activity_ns. The timer looks at it when it fires and
+ * re-arms itself for the remainder, so pointer motion doesn't reprogram the
+ * timer on every event. */
+static void server_idle_arm(struct tinywl_server* server)
+{
+    int timeout_ms = server->config->idle_timeout * 1000;
+    if(server->idle_inhibitors > 0 || server->idle_blanked) { timeout_ms = 0; }
+    wl_event_source_timer_update(server->idle_timer, timeout_ms);
+}
+
+static int handle_idle_timer(void* data)
+{
+    struct tinywl_server* server = data;
+    if(server->idle_inhibitors > 0 || server->idle_blanked ||
+        server->config->idle_timeout == 0) { return 0; }
+    uint64_t timeout_ns = (uint64_t)server->config->idle_timeout * 1000000000;
+    uint64_t idle_ns = get_time_ns() - server->last_activity_ns;
+    if(idle_ns < timeout_ns)
+    {
+        wl_event_source_timer_update(server->idle_timer, (timeout_ns - idle_ns) / 1000000 + 1);
+        return 0;
+    }
+    wlr_log(WLR_INFO, "No input for %u s, turning outputs off", server->config->idle_timeout);
+    server->idle_blanked = true;
+    struct tinywl_output* output;
+    wl_list_for_each(output, &server->outputs, link) {
+        if(!output->wlr_output->enabled) { continue; }
+        output->idle_off = true;
+        output_set_power(output, false);
+    }
+    return 0;
+}
+
+static void server_notify_activity(struct tinywl_server* server)
+{
+    server->last_activity_ns = get_time_ns();
+    wlr_idle_notify_activity(server->idle, server->seat);
+    if(!server->idle_blanked) { return; }
+    server->idle_blanked = false;
+    struct tinywl_output* output;
+    /* Outputs a client turned off through output power management stay off. */
+    wl_list_for_each(output, &server->outputs, link) {
+        if(!output->idle_off) { continue; }
+        output->idle_off = false;
+        output_set_power(output, true);
+    }
+    server_idle_arm(server);
+}
+
+struct gateway_idle_inhibitor {
+    struct tinywl_server* server;
+    struct wl_listener destroy;
+};
+
+static void idle_inhibitor_destroy(struct wl_listener* listener, void* data)
+{
+    struct gateway_idle_inhibitor* inhibitor = wl_container_of(listener, inhibitor, destroy);
+    struct tinywl_server* server = inhibitor->server;
+    wl_list_remove(&inhibitor->destroy.link);
+    free(inhibitor);
+    if(--server->idle_inhibitors == 0)
+    {
+        wlr_idle_set_enabled(server->idle, server->seat, true);
+        server->last_activity_ns = get_time_ns();
+        server_idle_arm(server);
+    }
+}
+
+/* Video players hold an inhibitor while playing. Any inhibitor keeps the
+ * outputs on, whether or not its surface is visible. */
+static void server_new_idle_inhibitor(struct wl_listener* listener, void* data)
+{
+    struct tinywl_server* server = wl_container_of(listener, server, new_idle_inhibitor);
+    struct wlr_idle_inhibitor_v1* wlr_inhibitor = data;
+    struct gateway_idle_inhibitor* inhibitor = calloc(1, sizeof(struct gateway_idle_inhibitor));
+    inhibitor->server = server;
+    inhibitor->destroy.notify = idle_inhibitor_destroy;
+    wl_signal_add(&wlr_inhibitor->events.destroy, &inhibitor->destroy);
+    if(server->idle_inhibitors++ == 0)
+    {
+        wlr_idle_set_enabled(server->idle, server->seat, false);
+        server_idle_arm(server);
+    }
+}
+
+static const char* bench_names[GATEWAY_BENCH_COUNT] = {
+    "none", "capture", "draws", "readback-sync", "readback-async", "readback-scaled",
+};
+
+static bool bench_read_pixels(struct gateway_bench* bench, struct wlr_renderer* renderer,
+    int32_t x, int32_t y, int32_t width, int32_t height)
+{
+    size_t size = (size_t)width * height * 4;
+    if(size > bench->pixels_size)
+    {
+        bench->pixels = realloc(bench->pixels, size);
+        bench->pixels_size = size;
+    }
+    return wlr_renderer_read_pixels(renderer, DRM_FORMAT_ARGB8888, NULL, width * 4,
+        width, height, x, y, 0, 0, bench->pixels);
+}
+
+/* Called with the finished frame still bound, reads it back the way a
+ * screencopy client would, once in full and once only the damage. */
+static void bench_capture_frame(struct tinywl_output* output, struct wlr_renderer* renderer)
+{
+    struct gateway_bench* bench = &output->server->bench;
+    int32_t width = output->wlr_output->width, height = output->wlr_output->height;
 
-    /* This lets the client know that we've displayed that frame and it can
-     * prepare another one now if it likes. */
-    wlr_surface_send_frame_done(surface, rdata->when);
+    uint64_t start_ns = get_time_ns();
+    if(bench_read_pixels(bench, renderer, 0, 0, width, height))
+    {
+        histogram_add(&bench->full_readback, (get_time_ns() - start_ns) / 1000);
+        bench->full_bytes += (uint64_t)width * height * 4;
+    }
+
+    int32_t rect_count;
+    pixman_box32_t* rects = pixman_region32_rectangles(&output->damage.region, &rect_count);
+    if(rect_count == 0)
+    {
+        bench->undamaged_frames++;
+        return;
+    }
+    start_ns = get_time_ns();
+    for(int32_t i = 0; i < rect_count; i++)
+    {
+        int32_t x = rects[i].x1 < 0 ? 0 : rects[i].x1;
+        int32_t y = rects[i].y1 < 0 ? 0 : rects[i].y1;
+        int32_t w = (rects[i].x2 > width ? width : rects[i].x2) - x;
+        int32_t h = (rects[i].y2 > height ? height : rects[i].y2) - y;
+        if(w <= 0 || h <= 0) { continue; }
+        if(bench_read_pixels(bench, renderer, x, y, w, h))
+        {
+            bench->damage_bytes += (uint64_t)w * h * 4;
+        }
+    }
+    histogram_add(&bench->damage_readback, (get_time_ns() - start_ns) / 1000);
+}
+
+/* Captures the whole output into the benchmark buffer, the way a recorder
+ * copying every frame would. */
+static void bench_queue_readback(struct tinywl_output* output)
+{
+    struct gateway_screencopy* screencopy = output->server->screencopy;
+    struct gateway_bench* bench = &output->server->bench;
+    if(screencopy == NULL) { return; }
+    struct gateway_screencopy_frame* frame = calloc(1, sizeof(struct gateway_screencopy_frame));
+    frame->screencopy = screencopy;
+    frame->output = output;
+    frame->box = (struct wlr_box){
+        .width = output->wlr_output->width, .height = output->wlr_output->height,
+    };
+    screencopy_frame_scale(frame);
+    size_t size = (size_t)frame->width * frame->height * 4;
+    if(size > bench->pixels_size)
+    {
+        bench->pixels = realloc(bench->pixels, size);
+        bench->pixels_size = size;
+    }
+    frame->bench_data = bench->pixels;
+    frame->overlay_cursor = true; // queued after the first pass, read in the second
+    frame->state = GATEWAY_SCREENCOPY_WAITING_FRAME;
+    frame->copy_ns = get_time_ns();
+    wl_list_insert(&screencopy->frames, &frame->link);
 }
 
-static bool output_contains_stack(struct tinywl_output* output, int32_t s)
+static void bench_count_draws(struct tinywl_output* output)
 {
-    for(int i = 0; i < output->stack_count; i++)
-    {
-        if(output->stacks[i] == s)
-        { return true; }
-    }
-    return false;
+    struct gateway_bench* bench = &output->server->bench;
+    bench->draws += output->frame_surfaces;
+    bench->culled += output->frame_culled;
+    if(output->frame_surfaces > bench->max_draws) { bench->max_draws = output->frame_surfaces; }
 }
 
-static void panel_update(struct gateway_panel* panel, struct tinywl_output* output)
+static void bench_log(struct tinywl_server* server)
 {
-    struct tinywl_view *view;
-    struct tinywl_view *_view_tmp;
-    wl_list_for_each_safe(view, _view_tmp, &panel->views, link)
+    struct gateway_bench* bench = &server->bench;
+    double seconds = (get_time_ns() - bench->start_ns) / 1000000000.0;
+    wlr_log(WLR_INFO, "Benchmark %s: %u frames in %.2f s", bench_names[bench->kind],
+        bench->frames, seconds);
+    histogram_log("frame render", &server->stats.frame_render);
+    if(bench->kind == GATEWAY_BENCH_CAPTURE)
     {
-        view->stack_index = -1;
-        if(view->xwayland_surface != NULL)
-        {
-            if(view->xwayland_surface->override_redirect)
-            {
-                view->x=view->xwayland_surface->x;
-                view->y=view->xwayland_surface->y;
-                view->width=view->xwayland_surface->width;
-                view->height=view->xwayland_surface->height;
-                wl_list_remove(&view->link);    
-                wl_list_insert(&panel->redirect_views, &view->link);
-                continue;
-            }
-        }
+        wlr_log(WLR_INFO, "  full readback:   %.1f MB/frame, %.1f MB/s",
+            bench->full_bytes / 1000000.0 / bench->frames, bench->full_bytes / 1000000.0 / seconds);
+        histogram_log("full readback", &bench->full_readback);
+        wlr_log(WLR_INFO, "  damage readback: %.3f MB/frame, %.3f MB/s, %u frames without damage",
+            bench->damage_bytes / 1000000.0 / bench->frames, bench->damage_bytes / 1000000.0 / seconds,
+            bench->undamaged_frames);
+        histogram_log("damage readback", &bench->damage_readback);
     }
-    struct wlr_output_layout_output* output_layout = wlr_output_layout_get(
-        output->server->output_layout, output->wlr_output
-    );
-    int32_t x= output_layout->x;
-    int32_t last_stack = 0;
-
-    for(int i = 0; i < panel->stack_count; i++)
+    if(bench->kind == GATEWAY_BENCH_DRAWS)
     {
-        if(!panel->stacks[i].mapped) { continue; }
-        last_stack = i;
-        panel->stacks[i].item_count = 0;
-        if(!output_contains_stack(output, i)) { continue; }
-        panel->stacks[i].current_y = output_layout->y;
-        panel->stacks[i].current_x = x;
-        panel->stacks[i].height = output->wlr_output->height;
-        panel->stacks[i].width = output->wlr_output->width / output->stack_count;
-        x += panel->stacks[i].width;
+        wlr_log(WLR_INFO, "  draws: %.1f/frame, %d at most, %.1f/frame culled",
+            (double)bench->draws / bench->frames, bench->max_draws,
+            (double)bench->culled / bench->frames);
     }
-
-    wl_list_for_each(view, &panel->views, link)
+    if(server->screencopy != NULL && bench->kind >= GATEWAY_BENCH_READBACK_SYNC)
     {
-        view->stack_index = last_stack;
-        panel->stacks[last_stack].item_count++;
+        wlr_log(WLR_INFO, "  read back %.2f MB/frame, %.1f MB/s, %.1f frames/s",
+            bench->readback_bytes / 1000000.0 / bench->frames,
+            bench->readback_bytes / 1000000.0 / seconds, bench->frames / seconds);
+        histogram_log("frame render recording", &server->stats.frame_render_recording);
+        histogram_log("screencopy readback", &server->screencopy->readback);
+        histogram_log("screencopy latency", &server->screencopy->latency);
     }
+}
+
+/* The headless backend only makes outputs of one size by itself. */
+static void bench_add_output(struct wlr_backend* backend, void* data)
+{
+    struct gateway_bench* bench = data;
+    if(!wlr_backend_is_headless(backend)) { return; }
+    wlr_headless_add_output(backend, bench->output_width, bench->output_height);
+}
+
+/* Counts committed frames, ends the benchmark after target_frames. */
+static void bench_frame_done(struct tinywl_server* server)
+{
+    struct gateway_bench* bench = &server->bench;
+    if(bench->kind == GATEWAY_BENCH_NONE) { return; }
+    if(bench->frames++ == 0) { bench->start_ns = get_time_ns(); }
+    if(bench->frames < bench->target_frames) { return; }
+    bench_log(server);
+    bench->kind = GATEWAY_BENCH_NONE;
+    wl_display_terminate(server->wl_display);
+}
+
+/* Replay, see -p. The log drives the headless backend: outputs are added as
+ * they were recorded and input goes through a headless keyboard and pointer,
+ * so it takes the same path through wlr_cursor and the handlers as the real
+ * thing. Clients aren't part of the log, start the same ones with -s. */
+static const size_t record_sizes[GATEWAY_RECORD_TYPE_COUNT] = {
+    [GATEWAY_RECORD_OUTPUT] = sizeof(struct gateway_record_output),
+    [GATEWAY_RECORD_KEY] = sizeof(struct gateway_record_key),
+    [GATEWAY_RECORD_MOTION] = sizeof(struct gateway_record_motion),
+    [GATEWAY_RECORD_MOTION_ABSOLUTE] = sizeof(struct gateway_record_motion_absolute),
+    [GATEWAY_RECORD_BUTTON] = sizeof(struct gateway_record_button),
+    [GATEWAY_RECORD_AXIS] = sizeof(struct gateway_record_axis),
+    [GATEWAY_RECORD_FRAME] = 0,
+    [GATEWAY_RECORD_SURFACE] = sizeof(struct gateway_record_surface),
+};
+
+static const char* record_surface_event_names[GATEWAY_RECORD_SURFACE_EVENT_COUNT] = {
+    "new", "destroy", "map", "unmap",
+};
 
-wl_list_for_each(view, &panel->views, link)
+static bool replay_load(struct gateway_replay* replay, const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if(file == NULL)
     {
-bool is_done = !(wl_list_length(&panel->views) > 0);
-while(!is_done) {
-    int32_t sid = view->stack_index;
-    for(int i = view->stack_index - 1; i >= 0; i--)
+        printf("Could not open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    replay->data = malloc(size > 0 ? size : 1);
+    replay->size = size > 0 && fread(replay->data, size, 1, file) == 1 ? size : 0;
+    fclose(file);
+    if(replay->size < GATEWAY_RECORD_MAGIC_SIZE ||
+        memcmp(replay->data, GATEWAY_RECORD_MAGIC, GATEWAY_RECORD_MAGIC_SIZE) != 0)
     {
-        if(!panel->stacks[i].mapped) { continue; }
-        if(panel->stacks[i].item_count < panel->stacks[i].max_items &&
-    ((panel->stacks[i].item_count + 2 <= panel->stacks[sid].item_count) || panel->stacks[i].item_count < 1))
-        {
-            sid = i;
-            break;
-        }
+        printf("%s is not a gateway input log\n", path);
+        free(replay->data);
+        replay->data = NULL;
+        return false;
     }
-    if(sid == view->stack_index) { is_done = true; break; }
-
-    panel->stacks[view->stack_index].item_count--;
-    panel->stacks[sid].item_count++;
-    view->stack_index = sid;
+    replay->offset = GATEWAY_RECORD_MAGIC_SIZE;
+    return true;
 }
+
+static void replay_find_headless(struct wlr_backend* backend, void* data)
+{
+    struct gateway_replay* replay = data;
+    if(wlr_backend_is_headless(backend)) { replay->headless = backend; }
 }
-    uint32_t gaps = output->server->config->window_gaps;
-    wl_list_for_each(view, &panel->views, link)
+
+static void replay_finish(struct tinywl_server* server)
+{
+    struct gateway_replay* replay = &server->replay;
+    struct gateway_stats* stats = &server->stats;
+    wlr_log(WLR_INFO, "Replayed %lu events in %.2f s", replay->records,
+        (get_time_ns() - replay->start_ns) / 1000000000.0);
+    wlr_log(WLR_INFO, "  frames %lu, dropped %lu", stats->frames, stats->dropped_frames);
+    histogram_log("frame interval", &stats->frame_interval);
+    histogram_log("frame layout", &stats->frame_layout);
+    histogram_log("frame render", &stats->frame_render);
+    wlr_log(WLR_INFO, "  hit tests %lu, %.0f ns on average", stats->hit_tests,
+        stats->hit_tests > 0 ? (double)stats->hit_test_ns / stats->hit_tests : 0.0);
+    latency_log(&stats->latency);
+    for(int32_t i = 0; i < GATEWAY_RECORD_SURFACE_EVENT_COUNT; i++)
     {
-        if(!output_contains_stack(output, view->stack_index)) { continue; }
-        view->width = panel->stacks[view->stack_index].width - 2*gaps;
-        view->height = panel->stacks[view->stack_index].height / panel->stacks[view->stack_index].item_count;
-        view->x = panel->stacks[view->stack_index].current_x + gaps;
-        view->y = panel->stacks[view->stack_index].current_y + gaps;
-        panel->stacks[view->stack_index].current_y += view->height;
-        view->height -= 2*gaps;
+        wlr_log(WLR_INFO, "  surface %-8s recorded %u, replayed %u", record_surface_event_names[i],
+            replay->surfaces_recorded[i], replay->surfaces_seen[i]);
+    }
+    wl_display_terminate(server->wl_display);
+}
 
-        if(view->is_fullscreen)
+static void replay_dispatch(struct tinywl_server* server, uint8_t type, const uint8_t* payload)
+{
+    struct gateway_replay* replay = &server->replay;
+    uint32_t time_msec = get_time_ns() / 1000000;
+    struct wlr_pointer* pointer = replay->pointer->pointer;
+    switch(type) {
+    case GATEWAY_RECORD_OUTPUT: {
+        struct gateway_record_output record;
+        memcpy(&record, payload, sizeof(record));
+        struct wlr_output* wlr_output = wlr_headless_add_output(replay->headless, record.width, record.height);
+        if(wlr_output == NULL) { break; }
+        /* Headless outputs start at 60 Hz, frames are paced at the recorded
+         * refresh rate only with a custom mode. */
+        if(record.refresh > 0 && wlr_output->refresh != record.refresh)
         {
-            view->x = output_layout->x;
-            view->y = output_layout->y;
-            view->width = output->wlr_output->width;
-            view->height = output->wlr_output->height;
+            wlr_output_set_custom_mode(wlr_output, record.width, record.height, record.refresh);
         }
-
-        if(view->xwayland_surface != NULL)
+        if(wlr_output->scale != record.scale) { wlr_output_set_scale(wlr_output, record.scale); }
+        if(!wlr_output_commit(wlr_output))
         {
-            int32_t w = view->width, h = view->height;
-            struct wlr_xwayland_surface_size_hints size_hints = {0};
-            if(view->xwayland_surface->size_hints != NULL)
-            { size_hints = *view->xwayland_surface->size_hints; }
-            if(size_hints.min_width > w) { w = size_hints.min_width; }
-            if(size_hints.min_height > h) { h = size_hints.min_height; }
-            if(size_hints.max_width > 0 && size_hints.max_width < w) { w = size_hints.max_width; }
-            if(size_hints.max_height > 0 && size_hints.max_height < h) { h = size_hints.max_height; }
+            wlr_log(WLR_ERROR, "Failed to apply the recorded mode %ux%u@%d mHz, scale %.2f",
+                record.width, record.height, record.refresh, record.scale);
+        }
+        break;
+    }
+    case GATEWAY_RECORD_KEY: {
+        struct gateway_record_key record;
+        memcpy(&record, payload, sizeof(record));
+        struct wlr_event_keyboard_key event = {
+            .time_msec = time_msec, .keycode = record.keycode,
+            .update_state = true, .state = record.state,
+        };
+        wlr_keyboard_notify_key(replay->keyboard->keyboard, &event);
+        break;
+    }
+    case GATEWAY_RECORD_MOTION: {
+        struct gateway_record_motion record;
+        memcpy(&record, payload, sizeof(record));
+        struct wlr_event_pointer_motion event = {
+            .device = replay->pointer, .time_msec = time_msec,
+            .delta_x = record.dx, .delta_y = record.dy,
+            .unaccel_dx = record.unaccel_dx, .unaccel_dy = record.unaccel_dy,
+        };
+        wl_signal_emit(&pointer->events.motion, &event);
+        break;
+    }
+    case GATEWAY_RECORD_MOTION_ABSOLUTE: {
+        struct gateway_record_motion_absolute record;
+        memcpy(&record, payload, sizeof(record));
+        struct wlr_event_pointer_motion_absolute event = {
+            .device = replay->pointer, .time_msec = time_msec, .x = record.x, .y = record.y,
+        };
+        wl_signal_emit(&pointer->events.motion_absolute, &event);
+        break;
+    }
+    case GATEWAY_RECORD_BUTTON: {
+        struct gateway_record_button record;
+        memcpy(&record, payload, sizeof(record));
+        struct wlr_event_pointer_button event = {
+            .device = replay->pointer, .time_msec = time_msec,
+            .button = record.button, .state = record.state,
+        };
+        wl_signal_emit(&pointer->events.button, &event);
+        break;
+    }
+    case GATEWAY_RECORD_AXIS: {
+        struct gateway_record_axis record;
+        memcpy(&record, payload, sizeof(record));
+        struct wlr_event_pointer_axis event = {
+            .device = replay->pointer, .time_msec = time_msec,
+            .source = record.source, .orientation = record.orientation,
+            .delta = record.delta, .delta_discrete = record.delta_discrete,
+        };
+        wl_signal_emit(&pointer->events.axis, &event);
+        break;
+    }
+    case GATEWAY_RECORD_FRAME:
+        wl_signal_emit(&pointer->events.frame, pointer);
+        break;
+    case GATEWAY_RECORD_SURFACE: {
+        struct gateway_record_surface record;
+        memcpy(&record, payload, sizeof(record));
+        if(record.event < GATEWAY_RECORD_SURFACE_EVENT_COUNT) { replay->surfaces_recorded[record.event]++; }
+        break;
+    }
+    }
+}
 
-            wlr_xwayland_surface_configure(view->xwayland_surface, 0, 0,
-                w, h);
-        } else if(view->xdg_surface != NULL)
+/* Dispatches every record that is due and sleeps until the next one. */
+static int handle_replay_timer(void* data)
+{
+    struct tinywl_server* server = data;
+    struct gateway_replay* replay = &server->replay;
+    uint64_t now = get_time_ns();
+    while(replay->offset + sizeof(struct gateway_record_header) <= replay->size)
+    {
+        struct gateway_record_header header;
+        memcpy(&header, replay->data + replay->offset, sizeof(header));
+        if(header.type == 0 || header.type >= GATEWAY_RECORD_TYPE_COUNT ||
+            replay->offset + sizeof(header) + record_sizes[header.type] > replay->size)
+        {
+            wlr_log(WLR_ERROR, "Input log is corrupt at byte %zu", replay->offset);
+            break;
+        }
+        uint64_t due_ns = replay->next_ns + (uint64_t)header.delta_us * 1000;
+        if(due_ns > now)
         {
-            int32_t w = view->width, h = view->height;
-            if(view->xdg_surface->toplevel->current.min_width > w) { w = view->xdg_surface->toplevel->current.min_width; }
-            if(view->xdg_surface->toplevel->current.min_height > h) { h = view->xdg_surface->toplevel->current.min_height; }
-            if(view->xdg_surface->toplevel->current.max_width > 0 &&
-        view->xdg_surface->toplevel->current.max_width < w) { w = view->xdg_surface->toplevel->current.max_width; }
-            if(view->xdg_surface->toplevel->current.max_height > 0 &&
-        view->xdg_surface->toplevel->current.max_height < h) { h = view->xdg_surface->toplevel->current.max_height; }
-            wlr_xdg_toplevel_set_size(view->xdg_surface, w, h);
+            wl_event_source_timer_update(replay->timer, (due_ns - now + 999999) / 1000000);
+            return 0;
         }
+        replay->next_ns = due_ns;
+        replay_dispatch(server, header.type, replay->data + replay->offset + sizeof(header));
+        replay->offset += sizeof(header) + record_sizes[header.type];
+        replay->records++;
     }
+    replay_finish(server);
+    return 0;
 }
-static void panel_post_update(struct gateway_panel* panel)
+
+/* Called once the backend runs, the log's times count from here. */
+static void replay_start(struct tinywl_server* server)
 {
-    struct tinywl_view *view;
-    struct tinywl_view *_view_tmp;
-    wl_list_for_each_safe(view, _view_tmp, &panel->redirect_views, link)
+    struct gateway_replay* replay = &server->replay;
+    wlr_multi_for_each_backend(server->backend, replay_find_headless, replay);
+    if(replay->headless == NULL)
     {
-        wl_list_remove(&view->link);
-        wl_list_insert(&panel->views, &view->link);
+        wlr_log(WLR_ERROR, "Replay needs the headless backend");
+        wl_display_terminate(server->wl_display);
+        return;
     }
+    replay->keyboard = wlr_headless_add_input_device(replay->headless, WLR_INPUT_DEVICE_KEYBOARD);
+    replay->pointer = wlr_headless_add_input_device(replay->headless, WLR_INPUT_DEVICE_POINTER);
+    replay->start_ns = get_time_ns();
+    replay->next_ns = replay->start_ns;
+    replay->timer = wl_event_loop_add_timer(wl_display_get_event_loop(server->wl_display),
+        handle_replay_timer, server);
+    wl_event_source_timer_update(replay->timer, 1);
 }
-static void output_frame(struct wl_listener *listener, void *data) {
-	/* This function is called every time an output is ready to display a frame,
-	 * generally at the output's refresh rate (e.g. 60Hz). */
-	struct tinywl_output *output =
-		wl_container_of(listener, output, frame);
-	struct wlr_renderer *renderer = output->server->renderer;
 
-    panel_update(output->panel, output);
+static void output_record_frame(struct tinywl_output* output, uint64_t frame_start_ns,
+    uint64_t layout_us, uint64_t render_us)
+{
+    struct gateway_stats* stats = &output->server->stats;
+    struct gateway_frame_sample* sample = &output->samples[output->sample_head];
+    output->sample_head = (output->sample_head + 1) % GATEWAY_HUD_SAMPLES;
 
-	struct timespec now;
-	clock_gettime(CLOCK_MONOTONIC, &now);
+    sample->interval_us = 0;
+    sample->dropped = false;
+    if(output->last_frame_ns != 0)
+    {
+        sample->interval_us = (frame_start_ns - output->last_frame_ns) / 1000;
+        histogram_add(&stats->frame_interval, sample->interval_us);
+    }
+    output->last_frame_ns = frame_start_ns;
+    sample->layout_us = layout_us;
+    sample->render_us = render_us;
+    histogram_add(&stats->frame_layout, layout_us);
+    histogram_add(output->recording ? &stats->frame_render_recording : &stats->frame_render, render_us);
+    stats->frames++;
+    output->present_pending = true;
+    output->present_frame_ns = frame_start_ns;
+}
 
-	/* wlr_output_attach_render makes the OpenGL context current. */
-	if (!wlr_output_attach_render(output->wlr_output, NULL)) {
-		return;
-	}
-	/* The "effective" resolution can change if you rotate your outputs. */
-	int width, height;
-	wlr_output_effective_resolution(output->wlr_output, &width, &height);
+/* The latest sample is complete once its frame is on screen, or its commit
+ * failed. */
+static void output_frame_presented(struct tinywl_output* output, bool dropped)
+{
+    if(!output->present_pending) { return; }
+    output->present_pending = false;
+    struct gateway_frame_sample* sample =
+        &output->samples[(output->sample_head + GATEWAY_HUD_SAMPLES - 1) % GATEWAY_HUD_SAMPLES];
+    sample->dropped = dropped;
+    if(dropped) { output->server->stats.dropped_frames++; }
+    ipc_event(output->server, GATEWAY_IPC_EVENT_FRAME, "%s %u %u %u %d", output->wlr_output->name,
+        sample->interval_us, sample->layout_us, sample->render_us, sample->dropped);
+}
 
-	/* Begin the renderer (calls glViewport and some other GL sanity checks) */
-	wlr_renderer_begin(renderer, width, height);
+/* A frame is dropped when it reaches the screen more than one and a half
+ * refresh periods after it was started, so it missed the vblank it was drawn
+ * for. Time without damage between frames doesn't count. */
+static void output_present(struct wl_listener* listener, void* data)
+{
+    struct tinywl_output* output = wl_container_of(listener, output, present);
+    struct wlr_output_event_present* event = data;
+    if(!output->present_pending) { return; }
+    uint64_t presented_ns = event->when != NULL ?
+        (uint64_t)event->when->tv_sec * 1000000000ull + event->when->tv_nsec : get_time_ns();
+    uint64_t period_ns = event->refresh > 0 ? (uint64_t)event->refresh :
+        output->wlr_output->refresh > 0 ? 1000000000000ull / output->wlr_output->refresh : 0;
+    output_frame_presented(output, event->presented && period_ns > 0 &&
+        presented_ns > output->present_frame_ns &&
+        presented_ns - output->present_frame_ns > period_ns * 3 / 2);
+}
+
+/* Frame pacing overlay in the bottom left corner of the output. Drawn with
+ * quads only so it doesn't need any font.
+ *
+ *  - one column per frame, oldest to the left. Grey is the time between this
+ *    frame and the previous one, red if a vblank was missed. Layout (yellow)
+ *    and render (blue) time are stacked at the bottom of each column.
+ *  - the white line is one refresh period.
+ *  - the squares below are the views (cyan) and surfaces (magenta) drawn in
+ *    the last frame, one square each. */
+static void output_render_hud(struct tinywl_output* output, struct wlr_renderer* renderer,
+    int32_t width, int32_t height, int32_t views, int32_t surfaces)
+{
+    const int32_t column = 3;
+    const int32_t graph_height = 100;
+    const int32_t square = 4;
+    const double px_per_ms = 4.0;
+
+    float* projection = output->wlr_output->transform_matrix;
+    int32_t graph_width = GATEWAY_HUD_SAMPLES * column;
+    int32_t x0 = 8;
+    int32_t y0 = height - graph_height - 3 * (square + 2) - 8;
+
+    float background[4] = {0.0, 0.0, 0.0, 0.6};
+    struct wlr_box box = {
+        .x = x0 - 4, .y = y0 - 4,
+        .width = graph_width + 8, .height = graph_height + 3 * (square + 2) + 8,
+    };
+    wlr_render_rect(renderer, &box, background, projection);
+    damage_box(&output->damage, &box);
+
+    float interval_colour[4] = {0.5, 0.5, 0.5, 1.0};
+    float dropped_colour[4] = {0.9, 0.1, 0.1, 1.0};
+    float layout_colour[4] = {0.9, 0.8, 0.1, 1.0};
+    float render_colour[4] = {0.2, 0.4, 1.0, 1.0};
+    for(int i = 0; i < GATEWAY_HUD_SAMPLES; i++)
+    {
+        struct gateway_frame_sample* sample =
+            &output->samples[(output->sample_head + i) % GATEWAY_HUD_SAMPLES];
+        int32_t x = x0 + i * column;
+        int32_t bottom = y0 + graph_height;
+
+        int32_t h = sample->interval_us / 1000.0 * px_per_ms;
+        if(h > graph_height) { h = graph_height; }
+        box = (struct wlr_box){ .x = x, .y = bottom - h, .width = column - 1, .height = h };
+        wlr_render_rect(renderer, &box, sample->dropped ? dropped_colour : interval_colour, projection);
+
+        int32_t layout_h = sample->layout_us / 1000.0 * px_per_ms;
+        int32_t render_h = sample->render_us / 1000.0 * px_per_ms;
+        if(layout_h > graph_height) { layout_h = graph_height; }
+        if(layout_h + render_h > graph_height) { render_h = graph_height - layout_h; }
+        box = (struct wlr_box){ .x = x, .y = bottom - layout_h, .width = column - 1, .height = layout_h };
+        wlr_render_rect(renderer, &box, layout_colour, projection);
+        box = (struct wlr_box){ .x = x, .y = bottom - layout_h - render_h, .width = column - 1, .height = render_h };
+        wlr_render_rect(renderer, &box, render_colour, projection);
+    }
+
+    int32_t refresh = output->wlr_output->refresh;
+    if(refresh > 0)
+    {
+        int32_t h = 1000000.0 / refresh * px_per_ms;
+        if(h <= graph_height)
+        {
+            float line_colour[4] = {1.0, 1.0, 1.0, 0.8};
+            box = (struct wlr_box){ .x = x0, .y = y0 + graph_height - h, .width = graph_width, .height = 1 };
+            wlr_render_rect(renderer, &box, line_colour, projection);
+        }
+    }
+
+    float view_colour[4] = {0.1, 0.9, 0.9, 1.0};
+    float surface_colour[4] = {0.9, 0.1, 0.9, 1.0};
+    int32_t max_squares = graph_width / (square + 2);
+    for(int i = 0; i < views && i < max_squares; i++)
+    {
+        box = (struct wlr_box){ .x = x0 + i * (square + 2), .y = y0 + graph_height + 4,
+            .width = square, .height = square };
+        wlr_render_rect(renderer, &box, view_colour, projection);
+    }
+    for(int i = 0; i < surfaces && i < max_squares; i++)
+    {
+        box = (struct wlr_box){ .x = x0 + i * (square + 2), .y = y0 + graph_height + 4 + square + 2,
+            .width = square, .height = square };
+        wlr_render_rect(renderer, &box, surface_colour, projection);
+    }
+}
 
-	float color[4] = {0.3, 0.3, 0.3, 1.0};
-	wlr_renderer_clear(renderer, color);
+static const float background_colour[4] = {0.3, 0.3, 0.3, 1.0};
 
-    //Background wlr-layer-shell
+static void output_render_layer(struct tinywl_output* output, uint32_t layer,
+    struct gateway_damage* damage)
+{
     struct gateway_layer_surface* ls;
     wl_list_for_each_reverse(ls, &output->server->layer_surfaces, link) {
         if(!ls->mapped || ls->surface->output != output->wlr_output ||
-            ls->surface->current.layer != 0) { continue; }
+            ls->surface->current.layer != layer) { continue; }
         struct render_data rdata = {
             .output = output->wlr_output,
-            .ls = ls,
-            .renderer = renderer,
-            .when = &now,
+            .draws = &output->draws,
+            .damage = damage,
         };
         wlr_layer_surface_v1_for_each_surface(ls->surface,
             render_layer_surface, &rdata);
     }
+}
 
-    wl_list_for_each_reverse(ls, &output->server->layer_surfaces, link) {
-        if(!ls->mapped || ls->surface->output != output->wlr_output ||
-            ls->surface->current.layer != 1) { continue; }
-        struct render_data rdata = {
-            .output = output->wlr_output,
-            .ls = ls,
-            .renderer = renderer,
-            .when = &now,
-        };
-        wlr_layer_surface_v1_for_each_surface(ls->surface,
-            render_layer_surface, &rdata);
+/* The background and bottom layers (wallpapers, desktop widgets) hardly ever
+ * change, so they are drawn once into an offscreen buffer that is copied under
+ * the windows every frame. It is redrawn when one of their surfaces commits or
+ * the output changes size. The copy needs GLES 3, without it the layers are
+ * drawn every frame. Has to run before the output's renderer begin, returns
+ * whether the buffer can be used. */
+static bool output_update_background(struct tinywl_output* output, struct wlr_renderer* renderer,
+    int width, int height, struct timespec* when)
+{
+    if(!output->server->gles3) { return false; }
+    if(!output->background_dirty && output->background.fbo != 0 &&
+        output->background.width == width && output->background.height == height) { return true; }
+    if(!gateway_fbo_ensure(&output->background, width, height))
+    {
+        gateway_fbo_finish(&output->background);
+        return false;
     }
+    GLint target;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &target);
+    glBindFramebuffer(GL_FRAMEBUFFER, output->background.fbo);
+    wlr_renderer_begin(renderer, width, height);
+    wlr_renderer_clear(renderer, background_colour);
+    output_render_layer(output, ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND, NULL);
+    output_render_layer(output, ZWLR_LAYER_SHELL_V1_LAYER_BOTTOM, NULL);
+    draw_list_submit(&output->draws, output, renderer, width, height, when);
+    wlr_renderer_end(renderer);
+    glBindFramebuffer(GL_FRAMEBUFFER, target);
+    output->background_dirty = false;
+    output->damage.whole = true;
+    output->server->stats.background_renders++;
+    return true;
+}
+
+/* Replaces the clear and the background layers. */
+static void output_blit_background(struct tinywl_output* output, struct wlr_renderer* renderer)
+{
+    struct gateway_fbo* background = &output->background;
+    GLint target;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &target);
+    wlr_renderer_scissor(renderer, NULL);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, background->fbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target);
+    glBlitFramebuffer(0, 0, background->width, background->height,
+        0, 0, background->width, background->height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, target);
+}
+
+/* Adds the views of the output's panel to its draw list. */
+static void output_render_views(struct tinywl_output* output)
+{
+	/* The view has a position in layout coordinates. If you have two displays,
+	 * one next to the other, both 1080p, a view on the rightmost display might
+	 * have layout coordinates of 2000,100. We need to translate that to
+	 * output-local coordinates, or (2000 - 1920). */
+	double ox = 0, oy = 0;
+	wlr_output_layout_output_coords(
+			output->server->output_layout, output->wlr_output, &ox, &oy);
+	struct render_data rdata = {
+		.output = output->wlr_output,
+		.draws = &output->draws,
+		.damage = &output->damage,
+		.ox = ox,
+		.oy = oy,
+	};
 
 	/* Each subsequent window we render is rendered on top of the last. Because
 	 * our view list is ordered front-to-back, we iterate over it backwards. */
@@ -1231,12 +5612,8 @@ static void output_frame(struct wl_listener *listener, void *data) {
 	wl_list_for_each_reverse(view, &output->panel->views, link) {
         if(!output_contains_stack(output, view->stack_index) || view->is_fullscreen
             || view->focused_by == output->panel) { continue; }
-		struct render_data rdata = {
-			.output = output->wlr_output,
-			.view = view,
-			.renderer = renderer,
-			.when = &now,
-		};
+        output->frame_views++;
+        rdata.view = view;
         if(view->xdg_surface != NULL)
         {
     		/* This calls our render_surface function for each surface among the
@@ -1252,16 +5629,10 @@ static void output_frame(struct wl_listener *listener, void *data) {
     wl_list_for_each_reverse(view, &output->panel->views, link) {
         if(!output_contains_stack(output, view->stack_index) || !view->is_fullscreen
             || view->focused_by == output->panel) { continue; }
-        struct render_data rdata = {
-            .output = output->wlr_output,
-            .view = view,
-            .renderer = renderer,
-            .when = &now,
-        };
+        output->frame_views++;
+        rdata.view = view;
         if(view->xdg_surface != NULL)
         {
-            /* This calls our render_surface function for each surface among the
-             * xdg_surface's toplevel and popups. */
             wlr_xdg_surface_for_each_surface(view->xdg_surface,
                     render_surface, &rdata);
         } else if(view->xwayland_surface != NULL)
@@ -1273,16 +5644,10 @@ static void output_frame(struct wl_listener *listener, void *data) {
     wl_list_for_each_reverse(view, &output->panel->views, link) {
         if(!output_contains_stack(output, view->stack_index) ||
             view->focused_by != output->panel) { continue; }
-        struct render_data rdata = {
-            .output = output->wlr_output,
-            .view = view,
-            .renderer = renderer,
-            .when = &now,
-        };
+        output->frame_views++;
+        rdata.view = view;
         if(view->xdg_surface != NULL)
         {
-            /* This calls our render_surface function for each surface among the
-             * xdg_surface's toplevel and popups. */
             wlr_xdg_surface_for_each_surface(view->xdg_surface,
                     render_surface, &rdata);
         } else if(view->xwayland_surface != NULL)
@@ -1292,42 +5657,17 @@ static void output_frame(struct wl_listener *listener, void *data) {
         }
     }
     wl_list_for_each_reverse(view, &output->panel->redirect_views, link) {
-        struct render_data rdata = {
-            .output = output->wlr_output,
-            .view = view,
-            .renderer = renderer,
-            .when = &now,
-        };
+        output->frame_views++;
+        rdata.view = view;
         render_surface(view->xwayland_surface->surface,
             0, 0, &rdata);
     }
+}
 
-    wl_list_for_each_reverse(ls, &output->server->layer_surfaces, link) {
-        if(!ls->mapped || ls->surface->output != output->wlr_output ||
-            ls->surface->current.layer != 2) { continue; }
-        struct render_data rdata = {
-            .output = output->wlr_output,
-            .ls = ls,
-            .renderer = renderer,
-            .when = &now,
-        };
-        wlr_layer_surface_v1_for_each_surface(ls->surface,
-            render_layer_surface, &rdata);
-    }
-
-    wl_list_for_each_reverse(ls, &output->server->layer_surfaces, link) {
-        if(!ls->mapped || ls->surface->output != output->wlr_output ||
-            ls->surface->current.layer != 3) { continue; }
-        struct render_data rdata = {
-            .output = output->wlr_output,
-            .ls = ls,
-            .renderer = renderer,
-            .when = &now,
-        };
-        wlr_layer_surface_v1_for_each_surface(ls->surface,
-            render_layer_surface, &rdata);
-    }
-
+/* Brightness for outputs without a gamma ramp, blends black over the frame. */
+static void output_render_dim(struct tinywl_output* output, struct wlr_renderer* renderer)
+{
+    if(output->server->brightness >= 1.0) { return; }
     float matrix[9] = {0};
     matrix[0] = 2.0;
     matrix[4] = 2.0;
@@ -1336,6 +5676,199 @@ static void output_frame(struct wl_listener *listener, void *data) {
 
     float colour[4] = {0.0, 0.0, 0.0, 1.0 - output->server->brightness};
     wlr_render_quad_with_matrix(renderer, colour, matrix);
+}
+
+/* Keeps a copy of the finished frame for the outputs mirroring this one and
+ * has them show it. Called with the frame still bound. */
+static void output_feed_mirrors(struct tinywl_output* output, struct wlr_renderer* renderer)
+{
+    struct tinywl_server* server = output->server;
+    bool mirrored = false;
+    struct tinywl_output* mirror;
+    wl_list_for_each(mirror, &server->outputs, link) {
+        if(strcmp(mirror->mirror_of, output->wlr_output->name) == 0) { mirrored = true; }
+    }
+    if(!mirrored)
+    {
+        gateway_fbo_finish(&output->mirror_frame);
+        return;
+    }
+    if(!server->gles3) { return; }
+    int32_t width = output->wlr_output->width, height = output->wlr_output->height;
+    if(!gateway_fbo_ensure(&output->mirror_frame, width, height)) { return; }
+    GLint target;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &target);
+    wlr_renderer_scissor(renderer, NULL);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, target);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, output->mirror_frame.fbo);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, target);
+    output->frame_seq++;
+    wl_list_for_each(mirror, &server->outputs, link) {
+        if(strcmp(mirror->mirror_of, output->wlr_output->name) == 0)
+        { wlr_output_schedule_frame(mirror->wlr_output); }
+    }
+}
+
+/* Mirrors are left out of the layout and have no panel, nothing is laid out
+ * or drawn for them. They only scale the last frame of their source into
+ * their own buffer, letterboxed when the aspect ratios differ, and only when
+ * the source has a new one. Blitting needs GLES 3, without it mirrors stay
+ * black. */
+static void output_mirror_frame(struct tinywl_output* output)
+{
+    struct tinywl_server* server = output->server;
+    struct wlr_renderer* renderer = server->renderer;
+    struct tinywl_output* source = NULL;
+    struct tinywl_output* o;
+    wl_list_for_each(o, &server->outputs, link) {
+        if(o->mirror_of[0] == '\0' && strcmp(o->wlr_output->name, output->mirror_of) == 0) { source = o; }
+    }
+    uint64_t seq = source != NULL && source->mirror_frame.fbo != 0 ? source->frame_seq : 0;
+    if(output->mirror_shown && seq == output->mirror_seq) { return; }
+
+    /* The source's frame already has its brightness blended in when it has
+     * no gamma ramp, the mirror only adds its own ramp when the source does. */
+    bool gamma = source != NULL && source->gamma_active;
+    if(output->gamma_dirty || !output->mirror_shown || output->mirror_gamma != gamma)
+    {
+        output->mirror_gamma = gamma;
+        if(gamma) { output_apply_gamma(output); }
+        else
+        {
+            wlr_output_set_gamma(output->wlr_output, 0, NULL, NULL, NULL);
+            output->gamma_active = false;
+            output->gamma_dirty = false;
+        }
+    }
+
+    if(!wlr_output_attach_render(output->wlr_output, NULL)) { return; }
+    screencopy_finish_readbacks(server->screencopy, output);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int32_t width = output->wlr_output->width, height = output->wlr_output->height;
+    wlr_renderer_begin(renderer, width, height);
+    float black[4] = {0.0, 0.0, 0.0, 1.0};
+    wlr_renderer_clear(renderer, black);
+    if(seq != 0)
+    {
+        struct gateway_fbo* frame = &source->mirror_frame;
+        double scale = fmin((double)width / frame->width, (double)height / frame->height);
+        int32_t w = frame->width * scale, h = frame->height * scale;
+        int32_t x = (width - w) / 2, y = (height - h) / 2;
+        GLint target;
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &target);
+        wlr_renderer_scissor(renderer, NULL);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, frame->fbo);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target);
+        glBlitFramebuffer(0, 0, frame->width, frame->height, x, y, x + w, y + h,
+            GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        glBindFramebuffer(GL_FRAMEBUFFER, target);
+        if(gamma && !output->gamma_active && !output->gamma_pending) { output_render_dim(output, renderer); }
+    }
+    output->damage.whole = true;
+    output_submit_damage(output);
+    // The source's frame has its cursor in it either way
+    screencopy_output_frame(server->screencopy, output, &now, false);
+    screencopy_output_frame(server->screencopy, output, &now, true);
+    wlr_renderer_end(renderer);
+    bool committed = wlr_output_commit(output->wlr_output);
+    output_gamma_committed(output, committed);
+    if(committed)
+    {
+        output->mirror_seq = seq;
+        output->mirror_shown = true;
+    }
+    pixman_region32_clear(&output->damage.region);
+}
+
+static void output_frame(struct wl_listener *listener, void *data) {
+	/* This function is called every time an output is ready to display a frame,
+	 * generally at the output's refresh rate (e.g. 60Hz). */
+	struct tinywl_output *output =
+		wl_container_of(listener, output, frame);
+	struct wlr_renderer *renderer = output->server->renderer;
+    /* A powered off output has nothing to show, not even for screencopy. */
+    if(!output->wlr_output->enabled) { return; }
+    if(output->mirror_of[0] != '\0')
+    {
+        watchdog_enter(&output->server->watchdog, __func__);
+        output_mirror_frame(output);
+        watchdog_leave(&output->server->watchdog);
+        return;
+    }
+    watchdog_enter(&output->server->watchdog, __func__);
+    uint64_t frame_start_ns = get_time_ns();
+
+    panel_update(output->panel, output);
+    uint64_t layout_end_ns = get_time_ns();
+
+    /* When a client lets go of the gamma wlroots resets it, ours has to be
+     * put back. */
+    bool gamma_client = output_has_gamma_client(output);
+    if(gamma_client != output->gamma_client)
+    {
+        output->gamma_client = gamma_client;
+        output->gamma_dirty = true;
+    }
+    if(output->gamma_dirty) { output_apply_gamma(output); }
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* wlr_output_attach_render makes the OpenGL context current. */
+	if (!wlr_output_attach_render(output->wlr_output, NULL)) {
+        watchdog_leave(&output->server->watchdog);
+		return;
+	}
+    screencopy_finish_readbacks(output->server->screencopy, output);
+
+    /* Everything is drawn in buffer pixels, the logical size would leave
+     * part of a scaled output out of the viewport. */
+    int width = output->wlr_output->width, height = output->wlr_output->height;
+
+    uint64_t render_start_ns = get_time_ns();
+    bool background_cached = output_update_background(output, renderer, width, height, &now);
+    if(output->server->overview.active) { overview_update_thumbnails(output->server, renderer, &now); }
+
+	/* Begin the renderer (calls glViewport and some other GL sanity checks) */
+	wlr_renderer_begin(renderer, width, height);
+    int32_t last_views = output->frame_views, last_surfaces = output->frame_surfaces;
+    output->frame_views = 0;
+    output->frame_surfaces = 0;
+    output->frame_culled = 0;
+
+    if(background_cached)
+    {
+        output_blit_background(output, renderer);
+    } else
+    {
+        wlr_renderer_clear(renderer, background_colour);
+        output_render_layer(output, ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND, &output->damage);
+        output_render_layer(output, ZWLR_LAYER_SHELL_V1_LAYER_BOTTOM, &output->damage);
+    }
+
+    if(output->server->overview.active && output->panel == output->server->focused_panel)
+    {
+        draw_list_submit(&output->draws, output, renderer, width, height, &now);
+        overview_render(output, renderer);
+    } else
+    {
+        output_render_views(output);
+    }
+
+    output_render_layer(output, ZWLR_LAYER_SHELL_V1_LAYER_TOP, &output->damage);
+    output_render_layer(output, ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY, &output->damage);
+    draw_list_submit(&output->draws, output, renderer, width, height, &now);
+    if(output->server->bench.kind == GATEWAY_BENCH_DRAWS) { bench_count_draws(output); }
+
+    if(!output->gamma_active && !output->gamma_pending) { output_render_dim(output, renderer); }
+
+    if(output->server->hud_enabled)
+    {
+        // The counts of the previous frame, this one is still being drawn
+        output_render_hud(output, renderer, width, height, last_views, last_surfaces);
+    }
 
 	/* Hardware cursors are rendered by the GPU on a separate plane, and can be
 	 * moved around without re-rendering what's beneath them - which is more
@@ -1343,14 +5876,42 @@ static void output_frame(struct wl_listener *listener, void *data) {
 	 * reason, wlroots provides a software fallback, which we ask it to render
 	 * here. wlr_cursor handles configuring hardware vs software cursors for you,
 	 * and this function is a no-op when hardware cursors are in use. */
+    damage_frame_finish(&output->damage);
+    output_submit_damage(output);
+    screencopy_output_frame(output->server->screencopy, output, &now, false);
 	wlr_output_render_software_cursors(output->wlr_output, NULL);
+    output_feed_mirrors(output, renderer);
+
+    if(output->server->bench.kind == GATEWAY_BENCH_CAPTURE) { bench_capture_frame(output, renderer); }
+    if(output->server->bench.kind >= GATEWAY_BENCH_READBACK_SYNC) { bench_queue_readback(output); }
+    screencopy_output_frame(output->server->screencopy, output, &now, true);
 
 	/* Conclude rendering and swap the buffers, showing the final frame
 	 * on-screen. */
 	wlr_renderer_end(renderer);
-	wlr_output_commit(output->wlr_output);
+    uint64_t render_end_ns = get_time_ns();
+    output_record_frame(output, frame_start_ns, (layout_end_ns - frame_start_ns) / 1000,
+        (render_end_ns - render_start_ns) / 1000);
+    bool committed = wlr_output_commit(output->wlr_output);
+    pixman_region32_clear(&output->damage.region);
+    output_gamma_committed(output, committed);
+    if(!committed) { output_frame_presented(output, false); }
+	if(committed) {
+        latency_frame_committed(&output->server->stats.latency, output);
+        bench_frame_done(output->server);
+        struct gateway_startup* startup = &output->server->startup;
+        if(!startup->first_frame)
+        {
+            startup->first_frame = true;
+            startup_mark(startup, "first frame %s", output->wlr_output->name);
+            startup->deferred = wl_event_loop_add_idle(
+                wl_display_get_event_loop(output->server->wl_display),
+                handle_deferred_init, output->server);
+        }
+    }
 
     panel_post_update(output->panel);
+    watchdog_leave(&output->server->watchdog);
 }
 
 static void server_new_output(struct wl_listener *listener, void *data) {
@@ -1360,6 +5921,10 @@ static void server_new_output(struct wl_listener *listener, void *data) {
 		wl_container_of(listener, server, new_output);
 	struct wlr_output *wlr_output = data;
 
+    /* Layout happens in logical pixels, the output's size divided by its
+     * scale. The scale goes out with the modeset. */
+    wlr_output_set_scale(wlr_output, config_output_scale(server->config, wlr_output->name));
+
 	/* Some backends don't have modes. DRM+KMS does, and we need to set a mode
 	 * before we can use the output. The mode is a tuple of (width, height,
 	 * refresh rate), and each monitor supports only a specific set of modes. We
@@ -1379,17 +5944,52 @@ static void server_new_output(struct wl_listener *listener, void *data) {
 		if (!wlr_output_commit(wlr_output)) {
 			return;
 		}
-	}
+        if(!server->startup.first_frame)
+        {
+            startup_mark(&server->startup, "modeset %s", wlr_output->name);
+        }
+	} else if (!wlr_output_commit(wlr_output)) {
+        wlr_log(WLR_ERROR, "Failed to set scale on output %s", wlr_output->name);
+    }
 
 	/* Allocates and configures our state for this output */
 	struct tinywl_output *output =
 		calloc(1, sizeof(struct tinywl_output));
 	output->wlr_output = wlr_output;
 	output->server = server;
+    output->index = server->next_output_index++;
+    output->performance_mode = wlr_output->current_mode;
+    output->gamma_dirty = true;
+    output->capture_scale = 1.0;
+    if(server->bench.kind == GATEWAY_BENCH_READBACK_SCALED && wlr_output->height > 720)
+    {
+        output->capture_scale = 720.0 / wlr_output->height;
+    }
+    pixman_region32_init(&output->damage.region);
+    pixman_region32_init(&output->draws.covered);
+    output->damage.whole = true;
 	/* Sets up a listener for the frame notify event. */
 	output->frame.notify = output_frame;
 	wl_signal_add(&wlr_output->events.frame, &output->frame);
+    output->present.notify = output_present;
+    wl_signal_add(&wlr_output->events.present, &output->present);
 	wl_list_insert(&server->outputs, &output->link);
+    struct gateway_record_output record = {
+        .width = wlr_output->width, .height = wlr_output->height,
+        .refresh = wlr_output->refresh, .scale = wlr_output->scale,
+    };
+    record_write(server, GATEWAY_RECORD_OUTPUT, &record, sizeof(record));
+
+    const char* mirror = config_output_mirror(server->config, wlr_output->name);
+    if(mirror != NULL)
+    {
+        /* Not part of the layout, so no wl_output global, no panel and
+         * nothing the cursor can reach. */
+        snprintf(output->mirror_of, sizeof(output->mirror_of), "%s", mirror);
+        wlr_log(WLR_INFO, "Output %s mirrors %s", wlr_output->name, mirror);
+        output_apply_profile(output);
+        return;
+    }
 
     output->panel = server->focused_panel; //TODO add proper panel and output management.
     if(output->panel->main_output == NULL) { output->panel->main_output = output; }
@@ -1401,6 +6001,7 @@ static int32_t start = 0;
     output->stacks[0] = start;
     output->stacks[1] = start + 1;
     start += 2;
+    panel_ensure_stacks(output->panel, server->config, start);
 
     //Map the stacks
     for(int i = 0; i < output->stack_count; i++){
@@ -1420,6 +6021,11 @@ static int32_t start = 0;
 	 * output (such as DPI, scale factor, manufacturer, etc).
 	 */
 	wlr_output_layout_add_auto(server->output_layout, wlr_output);
+    output_apply_profile(output);
+    if(server->startup.deferred_done)
+    {
+        wlr_xcursor_manager_load(server->cursor_mgr, wlr_output->scale);
+    }
 }
 
 static void xdg_surface_request_fullscreen(struct wl_listener* listener, void* data)
@@ -1432,6 +6038,8 @@ static void xdg_surface_request_fullscreen(struct wl_listener* listener, void* d
 static void xdg_surface_map(struct wl_listener *listener, void *data) {
 	/* Called when the surface is mapped, or ready to display on-screen. */
 	struct tinywl_view *view = wl_container_of(listener, view, map);
+    ipc_event(view->server, GATEWAY_IPC_EVENT_MAP, "%u", view->id);
+    record_surface(view->server, GATEWAY_RECORD_SURFACE_MAP, view->id);
     wlr_xdg_toplevel_set_tiled(view->xdg_surface, UINT_MAX);
 	wl_list_remove(&view->link);    
     wl_list_insert(view->server->focused_panel->views.prev, &view->link);
@@ -1450,6 +6058,8 @@ static void xdg_surface_map(struct wl_listener *listener, void *data) {
 static void xdg_surface_unmap(struct wl_listener *listener, void *data) {
 	/* Called when the surface is unmapped, and should no longer be shown. */
 	struct tinywl_view *view = wl_container_of(listener, view, unmap);
+    ipc_event(view->server, GATEWAY_IPC_EVENT_UNMAP, "%u", view->id);
+    record_surface(view->server, GATEWAY_RECORD_SURFACE_UNMAP, view->id);
     if(view->focused_by != NULL) {
         if(view->link.next != &view->focused_by->views) {
             struct tinywl_view *new_view = wl_container_of(view->link.next, new_view, link);
@@ -1484,6 +6094,8 @@ static void xdg_surface_unmap(struct wl_listener *listener, void *data) {
 static void xdg_surface_destroy(struct wl_listener *listener, void *data) {
 	/* Called when the surface is destroyed and should never be shown again. */
 	struct tinywl_view *view = wl_container_of(listener, view, destroy);
+    screencopy_view_destroyed(view->server->screencopy, view);
+    overview_view_destroyed(view->server, view);
 	wl_list_remove(&view->link);
 	free(view);
 }
@@ -1491,6 +6103,9 @@ static void xdg_surface_destroy(struct wl_listener *listener, void *data) {
 static void xwayland_surface_unmap(struct wl_listener *listener, void *data) {
     /* Called when the surface is unmapped, and should no longer be shown. */
     struct tinywl_view *view = wl_container_of(listener, view, unmap);
+    ipc_event(view->server, GATEWAY_IPC_EVENT_UNMAP, "%u", view->id);
+    record_surface(view->server, GATEWAY_RECORD_SURFACE_UNMAP, view->id);
+    view->mapped = false;
     if(view->focused_by != NULL) {
         if(view->link.next != &view->focused_by->views) {
             struct tinywl_view *new_view = wl_container_of(view->link.next, new_view, link);
@@ -1520,13 +6135,28 @@ static void xwayland_surface_unmap(struct wl_listener *listener, void *data) {
 static void xwayland_surface_destroy(struct wl_listener *listener, void *data) {
     /* Called when the surface is destroyed and should never be shown again. */
     struct tinywl_view *view = wl_container_of(listener, view, destroy);
+    struct tinywl_server* server = view->server;
+    /* When Xwayland goes away its windows can be destroyed while still
+     * mapped, don't leave focus pointing at a freed view. */
+    if(view->mapped) { xwayland_surface_unmap(&view->unmap, NULL); }
+    screencopy_view_destroyed(server->screencopy, view);
+    overview_view_destroyed(server, view);
+    wl_list_remove(&view->map.link);
+    wl_list_remove(&view->unmap.link);
+    wl_list_remove(&view->destroy.link);
     wl_list_remove(&view->link);
     free(view);
+
+    server->xwayland_view_count--;
+    server_xwayland_idle_check(server);
 }
 
 static void xwayland_surface_map(struct wl_listener *listener, void *data) {
     /* Called when the surface is mapped, or ready to display on-screen. */
     struct tinywl_view *view = wl_container_of(listener, view, map);
+    ipc_event(view->server, GATEWAY_IPC_EVENT_MAP, "%u", view->id);
+    record_surface(view->server, GATEWAY_RECORD_SURFACE_MAP, view->id);
+    view->mapped = true;
     wl_list_remove(&view->link);    
     wl_list_insert(view->server->focused_panel->views.prev, &view->link);
     if(wl_list_length(&view->server->focused_panel->views) <= 1) {
@@ -1534,21 +6164,49 @@ static void xwayland_surface_map(struct wl_listener *listener, void *data) {
     }
 }
 
+static void layer_surface_damage_background(struct gateway_layer_surface* ls)
+{
+    struct tinywl_output* output;
+    wl_list_for_each(output, &ls->server->outputs, link) {
+        if(output->wlr_output == ls->surface->output) { output->background_dirty = true; }
+    }
+}
+
+static void layer_surface_commit(struct wl_listener* listener, void* data)
+{
+    struct gateway_layer_surface* ls = wl_container_of(listener, ls, commit);
+    bool background = ls->surface->current.layer <= ZWLR_LAYER_SHELL_V1_LAYER_BOTTOM;
+    // Moving out of the background has to clear it from the buffer too
+    if(background || ls->in_background) { layer_surface_damage_background(ls); }
+    ls->in_background = background;
+}
+
 static void layer_surface_map(struct wl_listener *listener, void *data) {
     /* Called when the surface is mapped, or ready to display on-screen. */
     struct gateway_layer_surface *view = wl_container_of(listener, view, map);
 
     view->mapped = true;
+    if(view->in_background) { layer_surface_damage_background(view); }
+    if(view->surface->output != NULL)
+    {
+        wlr_surface_send_enter(view->surface->surface, view->surface->output);
+    }
 }
  
 static void layer_surface_unmap(struct wl_listener *listener, void *data) {
-    struct gateway_layer_surface *view = wl_container_of(listener, view, map);
+    struct gateway_layer_surface *view = wl_container_of(listener, view, unmap);
     view->mapped = false;
+    if(view->in_background) { layer_surface_damage_background(view); }
 }
  
 static void layer_surface_destroy(struct wl_listener *listener, void *data) {
     struct gateway_layer_surface *view = wl_container_of(listener, view, destroy);
+    if(view->in_background) { layer_surface_damage_background(view); }
     wl_list_remove(&view->link);
+    wl_list_remove(&view->map.link);
+    wl_list_remove(&view->unmap.link);
+    wl_list_remove(&view->destroy.link);
+    wl_list_remove(&view->commit.link);
     free(view);
 }
 
@@ -1625,6 +6283,7 @@ static void server_new_xdg_surface(struct wl_listener *listener, void *data) {
 		calloc(1, sizeof(struct tinywl_view));
 	view->server = server;
 	view->xdg_surface = xdg_surface;
+    view->id = server->next_view_id++;
 
     /* Listen to the various events it can emit */
     view->map.notify = xdg_surface_map;
@@ -1657,6 +6316,9 @@ static void server_new_xwayland_surface(struct wl_listener *listener, void *data
         calloc(1, sizeof(struct tinywl_view));
     view->server = server;
     view->xwayland_surface = xwayland_surface;
+    view->id = server->next_view_id++;
+    server->xwayland_view_count++;
+    server_xwayland_idle_check(server);
  
     /* Listen to the various events it can emit */
     view->map.notify = xwayland_surface_map;
@@ -1670,6 +6332,169 @@ static void server_new_xwayland_surface(struct wl_listener *listener, void *data
     wl_list_insert(&server->focused_panel->unmapped_views, &view->link);
 }
 
+/* Xwayland is started lazily by wlroots on the first connection to the X
+ * socket. Once the last X11 window is gone for xwayland_idle_timeout seconds
+ * and no X11 client is connected either, it is torn down and a fresh lazy
+ * instance takes its place, so an idle Xwayland doesn't sit around for the
+ * whole session. */
+static void server_start_xwayland(struct tinywl_server* server);
+
+static void server_stop_xwayland(struct tinywl_server* server)
+{
+    if(server->xwayland == NULL) { return; }
+    if(server->xwayland_probe != NULL)
+    {
+        wl_event_source_remove(server->xwayland_probe);
+        close(server->xwayland_probe_fd);
+        server->xwayland_probe = NULL;
+        waitpid(server->xwayland_probe_pid, NULL, 0);
+    }
+    wl_list_remove(&server->new_xwayland_surface.link);
+    wl_list_remove(&server->xwayland_ready.link);
+    server->xwayland_running = false;
+    /* This destroys any remaining X11 surfaces, their views are cleaned up by
+     * xwayland_surface_destroy. */
+    wlr_xwayland_destroy(server->xwayland);
+    server->xwayland = NULL;
+    wl_event_source_timer_update(server->xwayland_idle_timer, 0);
+}
+
+/* Counts the X11 clients connected to display other than the compositor's
+ * own (the window manager and this query), -1 when the server can't be
+ * asked. Runs in a child. */
+static int xwayland_count_clients(const char* display)
+{
+    xcb_connection_t* connection = xcb_connect(display, NULL);
+    if(xcb_connection_has_error(connection))
+    {
+        xcb_disconnect(connection);
+        return -1;
+    }
+    xcb_res_client_id_spec_t spec = { .client = 0, .mask = XCB_RES_CLIENT_ID_MASK_LOCAL_CLIENT_PID };
+    xcb_res_query_client_ids_reply_t* reply = xcb_res_query_client_ids_reply(connection,
+        xcb_res_query_client_ids(connection, 1, &spec), NULL);
+    int count = -1;
+    if(reply != NULL)
+    {
+        // Only local clients have a pid, the server's own client has none
+        count = 0;
+        xcb_res_client_id_value_iterator_t ids = xcb_res_query_client_ids_ids_iterator(reply);
+        for(; ids.rem > 0; xcb_res_client_id_value_next(&ids))
+        {
+            if(xcb_res_client_id_value_value_length(ids.data) < 1) { continue; }
+            pid_t pid = *xcb_res_client_id_value_value(ids.data);
+            if(pid != getpid() && pid != getppid()) { count++; }
+        }
+        free(reply);
+    }
+    xcb_disconnect(connection);
+    return count;
+}
+
+static int handle_xwayland_probe(int fd, uint32_t mask, void* data)
+{
+    struct tinywl_server* server = data;
+    int8_t count = -1;
+    if(read(fd, &count, 1) != 1) { count = -1; }
+    wl_event_source_remove(server->xwayland_probe);
+    close(fd);
+    server->xwayland_probe = NULL;
+    waitpid(server->xwayland_probe_pid, NULL, 0);
+    if(server->xwayland_view_count > 0 || !server->xwayland_running) { return 0; }
+    if(count != 0)
+    {
+        /* Windowless clients like xclip holding a selection or xsettingsd
+         * still need the server. When it can't be asked, keep it. */
+        if(count < 0) { wlr_log(WLR_ERROR, "Could not count the X11 clients, keeping Xwayland"); }
+        server_xwayland_idle_check(server);
+        return 0;
+    }
+    wlr_log(WLR_INFO, "No X11 windows or clients for %u s, shutting Xwayland down",
+        server->config->xwayland_idle_timeout);
+    server_stop_xwayland(server);
+    server_start_xwayland(server);
+    return 0;
+}
+
+/* wlroots only reports windows, so the client count comes from the XRes
+ * extension. The query runs in a child: Xwayland may be waiting on the
+ * compositor, and blocking the event loop on its reply would deadlock. */
+static int handle_xwayland_idle(void* data)
+{
+    struct tinywl_server* server = data;
+    if(server->xwayland_view_count > 0 || !server->xwayland_running ||
+        server->xwayland_probe != NULL) { return 0; }
+    int fds[2];
+    if(pipe2(fds, O_CLOEXEC) < 0)
+    {
+        wlr_log(WLR_ERROR, "Could not create a pipe to count X11 clients: %s", strerror(errno));
+        return 0;
+    }
+    pid_t child = fork();
+    if(child < 0)
+    {
+        wlr_log(WLR_ERROR, "Could not fork to count X11 clients: %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+    if(child == 0)
+    {
+        int count = xwayland_count_clients(server->xwayland->display_name);
+        int8_t byte = count > 100 ? 100 : count;
+        if(write(fds[1], &byte, 1) < 0) { _exit(1); }
+        _exit(0);
+    }
+    close(fds[1]);
+    server->xwayland_probe_pid = child;
+    server->xwayland_probe_fd = fds[0];
+    server->xwayland_probe = wl_event_loop_add_fd(wl_display_get_event_loop(server->wl_display),
+        fds[0], WL_EVENT_READABLE, handle_xwayland_probe, server);
+    return 0;
+}
+
+static void server_xwayland_idle_check(struct tinywl_server* server)
+{
+    if(server->xwayland_view_count > 0 || !server->xwayland_running ||
+        server->config->xwayland_idle_timeout == 0)
+    {
+        wl_event_source_timer_update(server->xwayland_idle_timer, 0);
+        return;
+    }
+    wl_event_source_timer_update(server->xwayland_idle_timer,
+        server->config->xwayland_idle_timeout * 1000);
+}
+
+static void handle_xwayland_ready(struct wl_listener* listener, void* data)
+{
+    struct tinywl_server* server = wl_container_of(listener, server, xwayland_ready);
+    server->xwayland_running = true;
+    server->xwayland_starts++;
+    if(server->xwayland_starts == 1) { startup_mark(&server->startup, "xwayland ready"); }
+    wlr_log(WLR_INFO, "Xwayland started on %s", server->xwayland->display_name);
+    /* Something connected. If it never opens a window, the idle timer still
+     * checks whether it stays connected. */
+    server_xwayland_idle_check(server);
+}
+
+static void server_start_xwayland(struct tinywl_server* server)
+{
+    server->xwayland = wlr_xwayland_create(server->wl_display, server->compositor, true);
+    if(server->xwayland == NULL)
+    {
+        wlr_log(WLR_ERROR, "Could not set up Xwayland");
+        return;
+    }
+    server->new_xwayland_surface.notify = server_new_xwayland_surface;
+    wl_signal_add(&server->xwayland->events.new_surface,
+            &server->new_xwayland_surface);
+    server->xwayland_ready.notify = handle_xwayland_ready;
+    wl_signal_add(&server->xwayland->events.ready, &server->xwayland_ready);
+    /* The display can change between instances, anything launched from now
+     * on should find the new one. */
+    setenv("DISPLAY", server->xwayland->display_name, true);
+}
+
 static void server_new_layer_surface(struct wl_listener *listener, void *data) {
     /* This event is raised when wlr_xdg_shell receives a new xdg surface from a
      * client, either a toplevel (application window) or popup. */
@@ -1689,6 +6514,8 @@ static void server_new_layer_surface(struct wl_listener *listener, void *data) {
     wl_signal_add(&layer_surface->events.unmap, &view->unmap);
     view->destroy.notify = layer_surface_destroy;
     wl_signal_add(&layer_surface->events.destroy, &view->destroy);
+    view->commit.notify = layer_surface_commit;
+    wl_signal_add(&layer_surface->surface->events.commit, &view->commit);
 
     if(view->surface->output == NULL)
     {
@@ -1697,8 +6524,12 @@ static void server_new_layer_surface(struct wl_listener *listener, void *data) {
     uint32_t w = view->surface->current.desired_width;
     uint32_t h = view->surface->current.desired_height;
     uint32_t anchor = view->surface->current.anchor;
-    if(anchor & (1|2) == (1|2)) { h = view->surface->output->height; }
-    if(anchor & (4|8) == (4|8)) { w = view->surface->output->width; }
+    /* Layer surfaces are sized in logical pixels, like everything else in
+     * the layout. */
+    int output_width, output_height;
+    wlr_output_effective_resolution(view->surface->output, &output_width, &output_height);
+    if((anchor & (1|2)) == (1|2)) { h = output_height; }
+    if((anchor & (4|8)) == (4|8)) { w = output_width; }
 
     wlr_layer_surface_v1_configure(view->surface, w, h);
  
@@ -1714,44 +6545,641 @@ static void server_new_xdg_decoration(struct wl_listener* listener, void* data)
     );
 }
 
+/* Runtime control socket. The protocol is line based so it is trivial to
+ * drive from scripts, see the README for the list of requests. Every request
+ * is answered by zero or more data lines followed by "ok" or "error <why>".
+ * Subscribed clients additionally receive lines starting with "event ". */
+
+#define GATEWAY_IPC_MAX_LINE 4096
+#define GATEWAY_IPC_MAX_PENDING (1 << 20)
+
+struct gateway_ipc_client {
+    struct wl_list link;
+    struct tinywl_server* server;
+    int fd;
+    struct wl_event_source* source;
+    uint32_t events;
+
+    char read_buffer[GATEWAY_IPC_MAX_LINE];
+    size_t read_len;
+    char* write_buffer;
+    size_t write_len, write_cap;
+    bool broken; // out of memory for its replies, dropped on the next event
+};
+
+static const char* ipc_event_names[] = { "focus", "map", "unmap", "frame" };
+
+static void ipc_client_destroy(struct gateway_ipc_client* client)
+{
+    wl_list_remove(&client->link);
+    wl_event_source_remove(client->source);
+    close(client->fd);
+    free(client->write_buffer);
+    free(client);
+}
+
+/* Returns false if the connection is broken, the caller gets to drop it. */
+static bool ipc_client_flush(struct gateway_ipc_client* client)
+{
+    if(client->broken) { return false; }
+    while(client->write_len > 0)
+    {
+        // MSG_NOSIGNAL, a client going away must not SIGPIPE the compositor
+        ssize_t written = send(client->fd, client->write_buffer, client->write_len, MSG_NOSIGNAL);
+        if(written < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+            if(errno == EINTR) { continue; }
+            return false;
+        }
+        memmove(client->write_buffer, client->write_buffer + written, client->write_len - written);
+        client->write_len -= written;
+    }
+    wl_event_source_fd_update(client->source,
+        WL_EVENT_READABLE | (client->write_len > 0 ? WL_EVENT_WRITABLE : 0));
+    return true;
+}
+
+static void ipc_client_vprintf(struct gateway_ipc_client* client, const char* format, va_list args)
+{
+    char line[GATEWAY_IPC_MAX_LINE];
+    int len = vsnprintf(line, sizeof(line) - 1, format, args);
+    if(len < 0) { return; }
+    if(len > (int)sizeof(line) - 2) { len = sizeof(line) - 2; }
+    line[len++] = '\n';
+
+    if(client->broken) { return; }
+    if(client->write_len + len > client->write_cap)
+    {
+        size_t cap = client->write_cap == 0 ? 4096 : client->write_cap;
+        while(cap < client->write_len + len) { cap *= 2; }
+        char* buffer = realloc(client->write_buffer, cap);
+        if(buffer == NULL)
+        {
+            /* Replies can't be dropped without the client losing track of
+             * them, so it goes. Shutting the socket down makes sure
+             * ipc_client_handle runs for it even when it isn't reading. */
+            wlr_log(WLR_ERROR, "Dropping IPC client, out of memory for its replies");
+            client->broken = true;
+            shutdown(client->fd, SHUT_RDWR);
+            return;
+        }
+        client->write_buffer = buffer;
+        client->write_cap = cap;
+    }
+    memcpy(client->write_buffer + client->write_len, line, len);
+    client->write_len += len;
+}
+
+static void ipc_client_printf(struct gateway_ipc_client* client, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    ipc_client_vprintf(client, format, args);
+    va_end(args);
+}
+
+static void ipc_event(struct tinywl_server* server, enum gateway_ipc_event event, const char* format, ...)
+{
+    struct gateway_ipc_client* client;
+    wl_list_for_each(client, &server->ipc_clients, link) {
+        if(!(client->events & (1u << event))) { continue; }
+        va_list args;
+        va_start(args, format);
+        char line[GATEWAY_IPC_MAX_LINE];
+        vsnprintf(line, sizeof(line), format, args);
+        va_end(args);
+        ipc_client_printf(client, "event %s %s", ipc_event_names[event], line);
+
+        /* A subscriber that stops reading loses its subscriptions rather than
+         * growing our memory without bound. Broken connections are cleaned up
+         * by ipc_client_handle once the hangup comes in. */
+        if(client->write_len > GATEWAY_IPC_MAX_PENDING)
+        {
+            wlr_log(WLR_ERROR, "IPC client isn't reading its events, unsubscribing it");
+            client->events = 0;
+            ipc_client_printf(client, "event overflow");
+        }
+        ipc_client_flush(client);
+    }
+}
+
+static struct tinywl_view* ipc_find_view(struct tinywl_server* server, const char* id)
+{
+    if(id == NULL) { return server->focused_panel->focused_view; }
+    // "foo" or "3x" must not turn into view 0 or 3
+    char* end = NULL;
+    errno = 0;
+    unsigned long view_id = strtoul(id, &end, 10);
+    if(end == id || *end != '\0' || errno != 0 || id[0] == '-' || view_id > UINT32_MAX) { return NULL; }
+    struct tinywl_view* view;
+    wl_list_for_each(view, &server->focused_panel->views, link) {
+        if(view->id == view_id) { return view; }
+    }
+    return NULL;
+}
+
+/* Free text like titles is one field of a line: spaces, '%' and control
+ * characters become %XX, and an empty or missing string is "-". */
+static const char* ipc_escape(const char* text, char* out, size_t size)
+{
+    if(text == NULL || text[0] == '\0') { return "-"; }
+    if(strcmp(text, "-") == 0) { return "%2D"; }
+    size_t len = 0;
+    for(const unsigned char* c = (const unsigned char*)text; *c != '\0' && len + 4 < size; c++)
+    {
+        if(*c <= ' ' || *c == '%' || *c == 0x7f)
+        {
+            len += snprintf(out + len, size - len, "%%%02X", *c);
+        } else
+        {
+            out[len++] = *c;
+        }
+    }
+    out[len] = '\0';
+    return out;
+}
+
+static void ipc_list_views(struct gateway_ipc_client* client)
+{
+    struct tinywl_server* server = client->server;
+    struct tinywl_view* view;
+    wl_list_for_each(view, &server->focused_panel->views, link) {
+        const char* kind = view->xwayland_surface != NULL ? "x11" : "xdg";
+        const char* app_id = NULL;
+        const char* title = NULL;
+        if(view->xwayland_surface != NULL) {
+            app_id = view->xwayland_surface->class;
+            title = view->xwayland_surface->title;
+        } else if(view->xdg_surface != NULL && view->xdg_surface->role == WLR_XDG_SURFACE_ROLE_TOPLEVEL) {
+            app_id = view->xdg_surface->toplevel->app_id;
+            title = view->xdg_surface->toplevel->title;
+        }
+        char app_id_field[256], title_field[1024];
+        ipc_client_printf(client, "view %u %s %d %d %d %d %d %d %d %s %s",
+            view->id, kind, view->x, view->y, view->width, view->height, view->stack_index,
+            view->focused_by != NULL, view->is_fullscreen,
+            ipc_escape(app_id, app_id_field, sizeof(app_id_field)),
+            ipc_escape(title, title_field, sizeof(title_field)));
+    }
+}
+
+static void ipc_list_outputs(struct gateway_ipc_client* client)
+{
+    struct tinywl_output* output;
+    wl_list_for_each(output, &client->server->outputs, link) {
+        struct wlr_output_layout_output* layout = wlr_output_layout_get(
+            client->server->output_layout, output->wlr_output);
+        char stacks[128] = "";
+        if(output->mirror_of[0] != '\0') { snprintf(stacks, sizeof(stacks), "mirror:%s", output->mirror_of); }
+        for(int i = 0; i < output->stack_count; i++) {
+            size_t len = strlen(stacks);
+            snprintf(stacks + len, sizeof(stacks) - len, i == 0 ? "%d" : ",%d", output->stacks[i]);
+        }
+        ipc_client_printf(client, "output %s %d %d %d %d %d %.2f %s %s",
+            output->wlr_output->name, layout != NULL ? layout->x : 0, layout != NULL ? layout->y : 0,
+            output->wlr_output->width, output->wlr_output->height, output->wlr_output->refresh,
+            output->wlr_output->scale, stacks,
+            output->gamma_client ? "client" : output->gamma_active ? "gamma" : "blend");
+    }
+}
+
+static void ipc_list_stacks(struct gateway_ipc_client* client)
+{
+    struct gateway_panel* panel = client->server->focused_panel;
+    for(int i = 0; i < panel->stack_count; i++) {
+        struct gateway_panel_stack* stack = &panel->stacks[i];
+        ipc_client_printf(client, "stack %d %d %d %d %d %d %d", i, stack->mapped,
+            stack->current_x, stack->width, stack->height, stack->max_items, stack->item_count);
+    }
+}
+
+static void ipc_list_panels(struct gateway_ipc_client* client)
+{
+    /* There is only one panel for now, see server_new_output. */
+    struct gateway_panel* panel = client->server->focused_panel;
+    ipc_client_printf(client, "panel 0 %d %d %d %d", wl_list_length(&panel->views),
+        wl_list_length(&panel->outputs), panel->stack_count,
+        panel->focused_view != NULL ? (int)panel->focused_view->id : -1);
+}
+
+static void ipc_print_histogram(struct gateway_ipc_client* client, const char* name,
+    struct gateway_histogram* hist)
+{
+    ipc_client_printf(client, "histogram %s %lu %lu %lu %lu %lu %lu", name, hist->count,
+        hist->count > 0 ? hist->sum_us / hist->count : 0, histogram_percentile(hist, 50.0),
+        histogram_percentile(hist, 90.0), histogram_percentile(hist, 99.0), hist->max_us);
+}
+
+static void ipc_list_stats(struct gateway_ipc_client* client)
+{
+    struct tinywl_server* server = client->server;
+    struct gateway_stats* stats = &server->stats;
+    ipc_client_printf(client, "stat frames %lu", stats->frames);
+    ipc_client_printf(client, "stat dropped_frames %lu", stats->dropped_frames);
+    ipc_client_printf(client, "stat background_renders %lu", stats->background_renders);
+    ipc_client_printf(client, "stat draws_submitted %lu", stats->draws_submitted);
+    ipc_client_printf(client, "stat draws_culled %lu", stats->draws_culled);
+    ipc_client_printf(client, "stat overview_thumbnail_renders %lu", server->overview.thumbnail_renders);
+    ipc_client_printf(client, "stat stalls %lu", server->watchdog.stalls);
+    ipc_client_printf(client, "stat latency_expired %lu", stats->latency.expired);
+    ipc_client_printf(client, "stat brightness %.2f", server->brightness);
+    ipc_client_printf(client, "stat color_temperature %u", server->color_temperature);
+    ipc_client_printf(client, "stat xwayland_running %d", server->xwayland_running);
+    ipc_client_printf(client, "stat xwayland_starts %u", server->xwayland_starts);
+    ipc_client_printf(client, "stat idle_inhibitors %d", server->idle_inhibitors);
+    ipc_client_printf(client, "stat power_profile %s", server->battery_profile ? "battery" : "performance");
+    ipc_client_printf(client, "stat idle_blanked %d", server->idle_blanked);
+    ipc_client_printf(client, "stat clipboard_cached %lu", server->clipboard.cached);
+    ipc_client_printf(client, "stat clipboard_too_large %lu", server->clipboard.too_large);
+    ipc_client_printf(client, "stat clipboard_failed %lu", server->clipboard.failed);
+    ipc_client_printf(client, "stat clipboard_pastes %lu", server->clipboard.pastes);
+    ipc_client_printf(client, "stat clipboard_paste_bytes %lu", server->clipboard.paste_bytes);
+    ipc_print_histogram(client, "frame_interval", &stats->frame_interval);
+    ipc_print_histogram(client, "frame_layout", &stats->frame_layout);
+    ipc_print_histogram(client, "frame_render", &stats->frame_render);
+    ipc_print_histogram(client, "frame_render_recording", &stats->frame_render_recording);
+    if(server->screencopy != NULL)
+    {
+        ipc_client_printf(client, "stat screencopy_frames %lu", server->screencopy->frames_copied);
+        ipc_print_histogram(client, "screencopy_readback", &server->screencopy->readback);
+        ipc_print_histogram(client, "screencopy_latency", &server->screencopy->latency);
+    }
+    ipc_print_histogram(client, "stall_duration", &server->watchdog.stall_durations);
+    char name[64];
+    for(int k = 0; k < GATEWAY_LATENCY_KIND_COUNT; k++) {
+        snprintf(name, sizeof(name), "%s_latency", latency_kind_names[k]);
+        ipc_print_histogram(client, name, &stats->latency.total[k]);
+    }
+}
+
+static void ipc_list_clients(struct gateway_ipc_client* ipc_client)
+{
+    struct tinywl_server* server = ipc_client->server;
+    uint64_t now_ns = get_time_ns();
+    struct gateway_client* client;
+    wl_list_for_each(client, &server->clients, link) {
+        gateway_client_tick(client, now_ns);
+        int32_t views = 0;
+        struct tinywl_view* view;
+        wl_list_for_each(view, &server->focused_panel->views, link) {
+            struct wlr_surface* surface = view->xdg_surface != NULL ? view->xdg_surface->surface :
+                view->xwayland_surface != NULL ? view->xwayland_surface->surface : NULL;
+            if(surface != NULL && wl_resource_get_client(surface->resource) == client->client) { views++; }
+        }
+        char name[64];
+        ipc_client_printf(ipc_client, "client %d %s %d %d %.1f %.1f %lu %lu %lu %u",
+            client->pid, ipc_escape(client->name, name, sizeof(name)), client->surfaces, views, client->commit_rate,
+            client->frame_rate, client->shm_bytes / 1024, client->dmabuf_bytes / 1024,
+            client->input_events, gateway_client_fps_cap(client));
+    }
+}
+
+static void ipc_list_startup(struct gateway_ipc_client* client)
+{
+    struct gateway_startup* startup = &client->server->startup;
+    for(int32_t i = 0; i < startup->mark_count; i++)
+    {
+        ipc_client_printf(client, "startup %lu %s", startup->marks[i].ns / 1000,
+            startup->marks[i].name);
+    }
+}
+
+/* Swaps the position of two views anywhere in the list. */
+static void view_swap(struct tinywl_view* a, struct tinywl_view* b)
+{
+    if(a == b) { return; }
+    if(b->link.next == &a->link) { list_swap(&b->link, &a->link); return; }
+    struct wl_list* a_prev = a->link.prev;
+    wl_list_remove(&a->link);
+    wl_list_insert(&b->link, &a->link);
+    wl_list_remove(&b->link);
+    wl_list_insert(a_prev, &b->link);
+}
+
+static void ipc_handle_request(struct gateway_ipc_client* client, char* line)
+{
+    struct tinywl_server* server = client->server;
+    char* save = NULL;
+    char* request = strtok_r(line, " \t", &save);
+    if(request == NULL) { return; }
+
+    if(strcmp(request, "views") == 0) {
+        ipc_list_views(client);
+    } else if(strcmp(request, "outputs") == 0) {
+        ipc_list_outputs(client);
+    } else if(strcmp(request, "stacks") == 0) {
+        ipc_list_stacks(client);
+    } else if(strcmp(request, "panels") == 0) {
+        ipc_list_panels(client);
+    } else if(strcmp(request, "stats") == 0) {
+        ipc_list_stats(client);
+    } else if(strcmp(request, "startup") == 0) {
+        ipc_list_startup(client);
+    } else if(strcmp(request, "clients") == 0) {
+        ipc_list_clients(client);
+    } else if(strcmp(request, "focus") == 0) {
+        struct tinywl_view* view = ipc_find_view(server, strtok_r(NULL, " \t", &save));
+        if(view == NULL) { ipc_client_printf(client, "error no such view"); return; }
+        focus_view(view, server->focused_panel, false);
+        center_mouse(server);
+    } else if(strcmp(request, "swap") == 0) {
+        struct tinywl_view* a = ipc_find_view(server, strtok_r(NULL, " \t", &save));
+        char* second = strtok_r(NULL, " \t", &save);
+        struct tinywl_view* b = second != NULL ? ipc_find_view(server, second) : NULL;
+        if(a == NULL || b == NULL) { ipc_client_printf(client, "error no such view"); return; }
+        view_swap(a, b);
+        center_mouse(server);
+    } else if(strcmp(request, "fullscreen") == 0) {
+        struct tinywl_view* view = ipc_find_view(server, strtok_r(NULL, " \t", &save));
+        if(view == NULL) { ipc_client_printf(client, "error no such view"); return; }
+        view->is_fullscreen = !view->is_fullscreen;
+    } else if(strcmp(request, "close") == 0) {
+        struct tinywl_view* view = ipc_find_view(server, strtok_r(NULL, " \t", &save));
+        if(view == NULL) { ipc_client_printf(client, "error no such view"); return; }
+        server_close_view(server, view);
+    } else if(strcmp(request, "brightness") == 0 || strcmp(request, "temperature") == 0) {
+        char* arg = strtok_r(NULL, " \t", &save);
+        char* end = NULL;
+        double value = arg != NULL ? strtod(arg, &end) : 0;
+        if(arg == NULL || *end != '\0' || !isfinite(value)) { ipc_client_printf(client, "error expected a number"); return; }
+        if(request[0] == 'b') {
+            server_set_brightness(server, value, server->color_temperature);
+        } else {
+            if(value < 1000 || value > 10000) { ipc_client_printf(client, "error temperature out of range"); return; }
+            server_set_brightness(server, server->brightness, value);
+        }
+    } else if(strcmp(request, "capture_scale") == 0) {
+        char* name = strtok_r(NULL, " \t", &save);
+        char* arg = strtok_r(NULL, " \t", &save);
+        struct tinywl_output* output = NULL, *o;
+        wl_list_for_each(o, &server->outputs, link) {
+            if(name != NULL && strcmp(o->wlr_output->name, name) == 0) { output = o; }
+        }
+        if(output == NULL) { ipc_client_printf(client, "error no such output"); return; }
+        char* end = NULL;
+        double scale = arg != NULL ? strtod(arg, &end) : 0;
+        if(arg == NULL || *end != '\0' || !isfinite(scale) || scale <= 0 || scale > 1) {
+            ipc_client_printf(client, "error expected a scale in (0, 1]");
+            return;
+        }
+        if(server->screencopy == NULL || !server->screencopy->async) {
+            ipc_client_printf(client, "error scaled capture needs GLES 3");
+            return;
+        }
+        output->capture_scale = scale;
+    } else if(strcmp(request, "power_profile") == 0) {
+        char* profile = strtok_r(NULL, " \t", &save);
+        if(profile == NULL) {
+            ipc_client_printf(client, "power_profile %s", server->battery_profile ? "battery" : "performance");
+        } else if(strcmp(profile, "battery") == 0 || strcmp(profile, "performance") == 0) {
+            server_set_power_profile(server, profile[0] == 'b');
+        } else {
+            ipc_client_printf(client, "error expected battery or performance");
+            return;
+        }
+    } else if(strcmp(request, "client_fps") == 0) {
+        char* pid = strtok_r(NULL, " \t", &save);
+        char* arg = strtok_r(NULL, " \t", &save);
+        char* end = NULL;
+        long fps = arg != NULL ? strtol(arg, &end, 10) : -1;
+        if(pid == NULL || arg == NULL || *end != '\0' || fps < 0) {
+            ipc_client_printf(client, "error expected a pid and a frame rate");
+            return;
+        }
+        bool found = false;
+        struct gateway_client* gclient;
+        wl_list_for_each(gclient, &server->clients, link) {
+            if(gclient->pid == atoi(pid)) { gclient->fps_cap = fps; found = true; }
+        }
+        if(!found) { ipc_client_printf(client, "error no such client"); return; }
+    } else if(strcmp(request, "spawn") == 0) {
+        char* cmd = save != NULL ? save + strspn(save, " \t") : NULL;
+        if(cmd == NULL || *cmd == '\0') { ipc_client_printf(client, "error nothing to spawn"); return; }
+        server_spawn(server, cmd);
+    } else if(strcmp(request, "subscribe") == 0 || strcmp(request, "unsubscribe") == 0) {
+        bool subscribe = request[0] == 's';
+        char* name;
+        while((name = strtok_r(NULL, " \t", &save)) != NULL) {
+            uint32_t i = 0;
+            while(i < GATEWAY_IPC_EVENT_COUNT && strcmp(name, ipc_event_names[i]) != 0) { i++; }
+            if(i == GATEWAY_IPC_EVENT_COUNT) {
+                ipc_client_printf(client, "error unknown event %s", name);
+                return;
+            }
+            if(subscribe) { client->events |= 1u << i; }
+            else { client->events &= ~(1u << i); }
+        }
+    } else {
+        ipc_client_printf(client, "error unknown request %s", request);
+        return;
+    }
+    ipc_client_printf(client, "ok");
+}
+
+static int ipc_client_handle(int fd, uint32_t mask, void* data)
+{
+    struct gateway_ipc_client* client = data;
+    watchdog_enter(&client->server->watchdog, __func__);
+
+    if(mask & WL_EVENT_WRITABLE)
+    {
+        if(!ipc_client_flush(client)) { ipc_client_destroy(client); goto done; }
+    }
+    if(mask & WL_EVENT_READABLE)
+    {
+        ssize_t len = read(fd, client->read_buffer + client->read_len,
+            sizeof(client->read_buffer) - client->read_len);
+        if(len <= 0)
+        {
+            if(len < 0 && (errno == EAGAIN || errno == EINTR)) { goto done; }
+            ipc_client_destroy(client);
+            goto done;
+        }
+        client->read_len += len;
+
+        char* start = client->read_buffer;
+        char* end;
+        while((end = memchr(start, '\n', client->read_len - (start - client->read_buffer))) != NULL)
+        {
+            *end = '\0';
+            ipc_handle_request(client, start);
+            start = end + 1;
+        }
+        client->read_len -= start - client->read_buffer;
+        memmove(client->read_buffer, start, client->read_len);
+        if(client->read_len == sizeof(client->read_buffer))
+        {
+            wlr_log(WLR_ERROR, "Dropping IPC client, request too long");
+            ipc_client_destroy(client);
+            goto done;
+        }
+        if(!ipc_client_flush(client)) { ipc_client_destroy(client); }
+    } else if(mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR))
+    {
+        ipc_client_destroy(client);
+    }
+
+done:
+    watchdog_leave(&client->server->watchdog);
+    return 0;
+}
+
+static int ipc_handle_connection(int fd, uint32_t mask, void* data)
+{
+    struct tinywl_server* server = data;
+    int client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(client_fd < 0)
+    {
+        wlr_log(WLR_ERROR, "IPC accept failed: %s", strerror(errno));
+        return 0;
+    }
+    struct gateway_ipc_client* client = calloc(1, sizeof(struct gateway_ipc_client));
+    client->server = server;
+    client->fd = client_fd;
+    client->source = wl_event_loop_add_fd(wl_display_get_event_loop(server->wl_display),
+        client_fd, WL_EVENT_READABLE, ipc_client_handle, client);
+    wl_list_insert(&server->ipc_clients, &client->link);
+    return 0;
+}
+
+static bool ipc_init(struct tinywl_server* server, const char* wayland_socket)
+{
+    const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if(runtime_dir == NULL)
+    {
+        wlr_log(WLR_ERROR, "XDG_RUNTIME_DIR is not set, no IPC socket");
+        return false;
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int len = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/gateway.%s.sock",
+        runtime_dir, wayland_socket);
+    if(len >= (int)sizeof(addr.sun_path))
+    {
+        wlr_log(WLR_ERROR, "IPC socket path too long");
+        return false;
+    }
+
+    server->ipc_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(server->ipc_fd < 0)
+    {
+        wlr_log(WLR_ERROR, "Could not create IPC socket: %s", strerror(errno));
+        return false;
+    }
+    unlink(addr.sun_path);
+    if(bind(server->ipc_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(server->ipc_fd, 8) < 0)
+    {
+        wlr_log(WLR_ERROR, "Could not bind IPC socket %s: %s", addr.sun_path, strerror(errno));
+        close(server->ipc_fd);
+        server->ipc_fd = -1;
+        return false;
+    }
+    strcpy(server->ipc_path, addr.sun_path);
+    server->ipc_source = wl_event_loop_add_fd(wl_display_get_event_loop(server->wl_display),
+        server->ipc_fd, WL_EVENT_READABLE, ipc_handle_connection, server);
+    setenv("GATEWAY_SOCK", server->ipc_path, true);
+    wlr_log(WLR_INFO, "IPC listening on %s", server->ipc_path);
+    return true;
+}
+
+static void ipc_finish(struct tinywl_server* server)
+{
+    struct gateway_ipc_client* client;
+    struct gateway_ipc_client* tmp;
+    wl_list_for_each_safe(client, tmp, &server->ipc_clients, link) {
+        ipc_client_destroy(client);
+    }
+    if(server->ipc_source == NULL) { return; }
+    wl_event_source_remove(server->ipc_source);
+    close(server->ipc_fd);
+    unlink(server->ipc_path);
+}
+
 int main(int argc, char *argv[]) {
 	wlr_log_init(WLR_DEBUG, NULL);
+    struct tinywl_server server = {0}; // GATEWAY CONFIGURATION, see config_set_defaults
+    startup_init(&server.startup);
 	char *startup_cmd = NULL;
+    const char* record_path = NULL;
 
 	int c;
-	while ((c = getopt(argc, argv, "s:h")) != -1) {
+    server.bench.target_frames = 600;
+    server.bench.output_width = 1920;
+    server.bench.output_height = 1080;
+	while ((c = getopt(argc, argv, "s:b:n:g:r:p:h")) != -1) {
 		switch (c) {
 		case 's':
 			startup_cmd = optarg;
 			break;
+        case 'b':
+            while(server.bench.kind < GATEWAY_BENCH_COUNT &&
+                strcmp(optarg, bench_names[server.bench.kind]) != 0) { server.bench.kind++; }
+            if(server.bench.kind == GATEWAY_BENCH_COUNT) {
+                printf("Unknown benchmark %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'n':
+            server.bench.target_frames = strtoul(optarg, NULL, 10);
+            break;
+        case 'g': {
+            int length = 0;
+            if(sscanf(optarg, "%dx%d%n", &server.bench.output_width, &server.bench.output_height, &length) != 2 ||
+                optarg[length] != '\0' || server.bench.output_width <= 0 || server.bench.output_height <= 0) {
+                printf("Expected -g <width>x<height>\n");
+                return 1;
+            }
+            break;
+        }
+        case 'r':
+            record_path = optarg;
+            break;
+        case 'p':
+            if(!replay_load(&server.replay, optarg)) { return 1; }
+            break;
 		default:
-			printf("Usage: %s [-s startup command]\n", argv[0]);
+			printf("Usage: %s [-s startup command] [-b benchmark [-n frames] [-g WxH]] [-r record file | -p replay file]\n", argv[0]);
 			return 0;
 		}
 	}
 	if (optind < argc) {
-		printf("Usage: %s [-s startup command]\n", argv[0]);
+		printf("Usage: %s [-s startup command] [-b benchmark [-n frames] [-g WxH]] [-r record file | -p replay file]\n", argv[0]);
 		return 0;
 	}
+    if(server.replay.data != NULL && (server.bench.kind != GATEWAY_BENCH_NONE || record_path != NULL))
+    {
+        printf("-p doesn't go with -b or -r\n");
+        return 1;
+    }
+    if(server.bench.kind != GATEWAY_BENCH_NONE || server.replay.data != NULL)
+    {
+        /* Benchmarks run on one headless output with no input devices, so they
+         * behave the same everywhere. Replays add theirs from the log. */
+        setenv("WLR_BACKENDS", "headless", 1);
+        setenv("WLR_LIBINPUT_NO_DEVICES", "1", 1);
+        setenv("WLR_HEADLESS_OUTPUTS", "0", 1);
+    }
 
                     // ENVIRONMENT SETUP
     setenv("QT_QPA_PLATFORMTHEME","qt5ct", 1);
     setenv("QT_QPA_PLATFORM", "wayland", 1);
     setenv("MOZ_ENABLE_WAYLAND", "1", 1);
 
-    struct tinywl_server server; // GATEWAY CONFIGURATION
-    server.config = calloc(1, sizeof(struct gateway_config));
-    server.config->terminal = "foot";
-    server.config->launcher = "fuzzel -b1f301fff -tffffffff -l20";
-    server.config->mouse_sens = 0.5;
-    server.config->kbd_layout = "us";
-    server.config->kbd_variant = "dvorak";
-    server.config->window_gaps = 8;
+    server.config = config_load();
+    startup_mark(&server.startup, "config");
 
 
     server.brightness = 1.0;
+    // Something on screen has to change every frame for the capture benchmark
+    server.hud_enabled = server.bench.kind == GATEWAY_BENCH_CAPTURE;
+    server.color_temperature = server.config->color_temperature;
     server.passthrough_enabled = false;
 
+    latency_init(&server.stats.latency);
+    wl_list_init(&server.ipc_clients);
+    wl_list_init(&server.clients);
+
 	/* The Wayland display is managed by libwayland. It handles accepting
 	 * clients from the Unix socket, manging Wayland globals, and so on. */
 	server.wl_display = wl_display_create();
@@ -1764,12 +7192,19 @@ int main(int argc, char *argv[]) {
 	 * if the backend does not support hardware cursors (some older GPUs
 	 * don't). */
 	server.backend = wlr_backend_autocreate(server.wl_display);
+    if(server.bench.kind != GATEWAY_BENCH_NONE)
+    {
+        wlr_multi_for_each_backend(server.backend, bench_add_output, &server.bench);
+    }
+    startup_mark(&server.startup, "backend autocreate");
 
 	/* If we don't provide a renderer, autocreate makes a GLES2 renderer for us.
 	 * The renderer is responsible for defining the various pixel formats it
 	 * supports for shared memory, this configures that for clients. */
 	server.renderer = wlr_backend_get_renderer(server.backend);
 	wlr_renderer_init_wl_display(server.renderer, server.wl_display);
+    server.gles3 = renderer_is_gles3(server.renderer);
+    startup_mark(&server.startup, "renderer init");
 
 	/* This creates some hands-off wlroots interfaces. The compositor is
 	 * necessary for clients to allocate surfaces and the data device manager
@@ -1778,12 +7213,25 @@ int main(int argc, char *argv[]) {
 	 * the clients cannot set the selection directly without compositor approval,
 	 * see the handling of the request_set_selection event below.*/
 	server.compositor = wlr_compositor_create(server.wl_display, server.renderer);
+    startup_mark(&server.startup, "global compositor");
 	wlr_data_device_manager_create(server.wl_display);
+    wlr_primary_selection_v1_device_manager_create(server.wl_display);
+    startup_mark(&server.startup, "global data device");
+
+    /* Surfaces are tracked regardless of role so commits can be followed for
+     * the latency tracing. */
+    server.new_surface.notify = server_new_surface;
+    wl_signal_add(&server.compositor->events.new_surface, &server.new_surface);
+
+    // Dump the runtime stats to the log on SIGUSR1
+    server.stats_signal = wl_event_loop_add_signal(
+        wl_display_get_event_loop(server.wl_display), SIGUSR1, handle_stats_signal, &server);
 
 	/* Creates an output layout, which a wlroots utility for working with an
 	 * arrangement of screens in a physical layout. */
 	server.output_layout = wlr_output_layout_create();
     server.xdg_output_manager = wlr_xdg_output_manager_v1_create(server.wl_display, server.output_layout);
+    startup_mark(&server.startup, "global xdg output");
 
 	/* Configure a listener to be notified when new outputs are available on the
 	 * backend. */
@@ -1797,12 +7245,7 @@ int main(int argc, char *argv[]) {
     wl_list_init(&panel->redirect_views);
     wl_list_init(&panel->outputs);
 
-    panel->stacks = calloc(4, sizeof(struct gateway_panel));
-    panel->stack_count = 4;
-    panel->stacks[0].max_items = 1;
-    panel->stacks[1].max_items = 1;
-    panel->stacks[2].max_items = 2;
-    panel->stacks[3].max_items = 2;
+    panel_apply_config(panel, server.config);
     server.focused_panel = panel;
 
 	/* Set up our list of views and the xdg-shell. The xdg-shell is a Wayland
@@ -1815,17 +7258,19 @@ int main(int argc, char *argv[]) {
 	server.new_xdg_surface.notify = server_new_xdg_surface;
 	wl_signal_add(&server.xdg_shell->events.new_surface,
 			&server.new_xdg_surface);
+    startup_mark(&server.startup, "global xdg shell");
 
     server.decoration_manager = wlr_xdg_decoration_manager_v1_create(server.wl_display);
     server.new_toplevel_decoration.notify = server_new_xdg_decoration;
     wl_signal_add(&server.decoration_manager->events.new_toplevel_decoration,
             &server.new_toplevel_decoration);
+    startup_mark(&server.startup, "global xdg decoration");
 
-    // XWayland
-    server.xwayland = wlr_xwayland_create(server.wl_display, server.compositor, false);
-    server.new_xwayland_surface.notify = server_new_xwayland_surface;
-    wl_signal_add(&server.xwayland->events.new_surface,
-            &server.new_xwayland_surface);
+    // XWayland, started on demand
+    server.xwayland_idle_timer = wl_event_loop_add_timer(
+        wl_display_get_event_loop(server.wl_display), handle_xwayland_idle, &server);
+    server_start_xwayland(&server);
+    startup_mark(&server.startup, "xwayland setup");
 
     // Layer Shell
     server.layer_shell = wlr_layer_shell_v1_create(server.wl_display);
@@ -1833,13 +7278,37 @@ int main(int argc, char *argv[]) {
     wl_signal_add(&server.layer_shell->events.new_surface,
             &server.new_layer_surface);
     wl_list_init(&server.layer_surfaces);
-
-    // Wlr Screencopy
-    server.screencopy = wlr_screencopy_manager_v1_create(server.wl_display);
+    startup_mark(&server.startup, "global layer shell");
+
+    // Wlr Screencopy is set up in server_deferred_init
+
+    // Gamma control, clients that use it take over brightness of that output
+    server.gamma_control_manager = wlr_gamma_control_manager_v1_create(server.wl_display);
+    startup_mark(&server.startup, "global gamma control");
+
+    // Viewporter, clients crop and scale their buffers through it
+    wlr_viewporter_create(server.wl_display);
+    startup_mark(&server.startup, "global viewporter");
+
+    // Output power, idle notification and idle inhibit
+    server.output_power_manager = wlr_output_power_manager_v1_create(server.wl_display);
+    server.output_power_set_mode.notify = server_set_output_power;
+    wl_signal_add(&server.output_power_manager->events.set_mode, &server.output_power_set_mode);
+    server.idle = wlr_idle_create(server.wl_display);
+    server.idle_inhibit_manager = wlr_idle_inhibit_v1_create(server.wl_display);
+    server.new_idle_inhibitor.notify = server_new_idle_inhibitor;
+    wl_signal_add(&server.idle_inhibit_manager->events.new_inhibitor, &server.new_idle_inhibitor);
+    server.idle_timer = wl_event_loop_add_timer(
+        wl_display_get_event_loop(server.wl_display), handle_idle_timer, &server);
+    server.last_activity_ns = get_time_ns();
+    server_idle_arm(&server);
+    startup_mark(&server.startup, "global idle");
 
     // Relative and constrained pointer
     server.relative_pointer = wlr_relative_pointer_manager_v1_create(server.wl_display);
+    startup_mark(&server.startup, "global relative pointer");
     server.pointer_constraints = wlr_pointer_constraints_v1_create(server.wl_display);
+    startup_mark(&server.startup, "global pointer constraints");
 
 	/*
 	 * Creates a cursor, which is a wlroots utility for tracking the cursor
@@ -1851,9 +7320,11 @@ int main(int argc, char *argv[]) {
 	/* Creates an xcursor manager, another wlroots utility which loads up
 	 * Xcursor themes to source cursor images from and makes sure that cursor
 	 * images are available at all scale factors on the screen (necessary for
-	 * HiDPI support). We add a cursor theme at scale factor 1 to begin with. */
+	 * HiDPI support). We add a cursor theme at scale factor 1 to begin with,
+	 * the other scales are loaded after the first frame. */
 	server.cursor_mgr = wlr_xcursor_manager_create(NULL, 24);
 	wlr_xcursor_manager_load(server.cursor_mgr, 1);
+    startup_mark(&server.startup, "xcursor theme");
 
 	/*
 	 * wlr_cursor *only* displays an image on screen. It does not move around
@@ -1895,45 +7366,63 @@ int main(int argc, char *argv[]) {
 	server.request_set_selection.notify = seat_request_set_selection;
 	wl_signal_add(&server.seat->events.request_set_selection,
 			&server.request_set_selection);
+    server.request_set_primary_selection.notify = seat_request_set_primary_selection;
+    wl_signal_add(&server.seat->events.request_set_primary_selection,
+        &server.request_set_primary_selection);
+    clipboard_init(&server.clipboard, &server);
+    startup_mark(&server.startup, "global seat");
 
 	/* Add a Unix socket to the Wayland display. */
 	const char *socket = wl_display_add_socket_auto(server.wl_display);
 	if (!socket) {
-        wlr_xwayland_destroy(server.xwayland);
+        server_stop_xwayland(&server);
 		wlr_backend_destroy(server.backend);
 		return 1;
 	}
 
+    if(record_path != NULL && !record_open(&server.record, record_path))
+    {
+        server_stop_xwayland(&server);
+        wlr_backend_destroy(server.backend);
+        return 1;
+    }
+
 	/* Start the backend. This will enumerate outputs and inputs, become the DRM
 	 * master, etc */
 	if (!wlr_backend_start(server.backend)) {
-        wlr_xwayland_destroy(server.xwayland);
+        server_stop_xwayland(&server);
 		wlr_backend_destroy(server.backend);
 		wl_display_destroy(server.wl_display);
 		return 1;
 	}
+    startup_mark(&server.startup, "backend start");
+    if(server.config->mlock)
+    {
+        sched_lock_memory(&server.sched);
+        startup_mark(&server.startup, "mlock");
+    }
+    if(server.replay.data != NULL) { replay_start(&server); }
+    server.startup.deferred_fallback = wl_event_loop_add_timer(
+        wl_display_get_event_loop(server.wl_display), handle_deferred_init_fallback, &server);
+    wl_event_source_timer_update(server.startup.deferred_fallback, 1000);
 
 	/* Set the WAYLAND_DISPLAY and DISPLAY environment variables to our sockets and run the
 	 * startup command if requested. */
 	setenv("WAYLAND_DISPLAY", socket, true);
-    setenv("DISPLAY", server.xwayland->display_name, true);
+    ipc_init(&server, socket);
+    config_watch(&server);
 	if (startup_cmd) {
-		if (fork() == 0) {
-			execl("/bin/sh", "/bin/sh", "-c", startup_cmd, (void *)NULL);
-		}
+        server_spawn(&server, startup_cmd);
+        startup_mark(&server.startup, "spawn -s");
     }
 
     char startup_file_path[512];
     strcpy(startup_file_path, getenv("HOME"));
     strcat(startup_file_path, "/.config/gateway/startup.sh");
     if( access(startup_file_path, X_OK ) == 0 ) {
-        char* args[2];
-        args[0] = "startup.sh";
-        args[1] = NULL;
-        if(fork() == 0)
-        {
-            execvp(startup_file_path, args);
-        }
+        char* args[] = { "startup.sh", NULL };
+        server_spawn_argv(&server, startup_file_path, args);
+        startup_mark(&server.startup, "spawn startup.sh");
     }
 
 
@@ -1943,10 +7432,18 @@ int main(int argc, char *argv[]) {
 	 * frame events at the refresh rate, and so on. */
 	wlr_log(WLR_INFO, "Running Wayland compositor on WAYLAND_DISPLAY=%s",
 			socket);
+    watchdog_init(&server.watchdog, wl_display_get_event_loop(server.wl_display),
+        server.config->watchdog_ms);
+    sched_apply(&server.sched, server.config);
 	wl_display_run(server.wl_display);
 
 	/* Once wl_display_run returns, we shut down the server. */
-    wlr_xwayland_destroy(server.xwayland);
+    watchdog_finish(&server.watchdog);
+    ipc_finish(&server);
+    server_log_stats(&server);
+    record_close(&server.record);
+    if(server.stats.latency.trace_file != NULL) { fclose(server.stats.latency.trace_file); }
+    server_stop_xwayland(&server);
 	wl_display_destroy_clients(server.wl_display);
 	wl_display_destroy(server.wl_display);
 	return 0;
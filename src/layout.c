@@ -0,0 +1,116 @@
+/*
+    Copyright (C) 2020 Sam H Smith
+    Contact: sam.henning.smith@protonmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "layout.h"
+
+static bool layout_output_has_stack(const struct gateway_layout_output* output, int32_t s)
+{
+    for(int i = 0; i < output->stack_count; i++)
+    {
+        if(output->stacks[i] == s)
+        { return true; }
+    }
+    return false;
+}
+
+static int32_t layout_clamp_size(int32_t size, int32_t min, int32_t max)
+{
+    if(min > size) { size = min; }
+    if(max > 0 && max < size) { size = max; }
+    return size < 1 ? 1 : size;
+}
+
+int64_t gateway_layout_arrange(struct gateway_panel_stack* stacks, int32_t stack_count,
+    const struct gateway_layout_output* output, int32_t gaps,
+    struct gateway_layout_view* views, int32_t view_count)
+{
+    int32_t x = output->box.x;
+    int32_t last_stack = -1;
+    for(int i = 0; i < stack_count; i++)
+    {
+        if(!stacks[i].mapped) { continue; }
+        last_stack = i;
+        stacks[i].item_count = 0;
+        if(!layout_output_has_stack(output, i)) { continue; }
+        stacks[i].current_y = output->box.y;
+        stacks[i].current_x = x;
+        stacks[i].height = output->box.height;
+        stacks[i].width = output->box.width / output->stack_count;
+        x += stacks[i].width;
+    }
+
+    for(int32_t v = 0; v < view_count; v++)
+    {
+        views[v].stack_index = last_stack;
+        views[v].placed = false;
+    }
+    if(last_stack < 0) { return 0; }
+    stacks[last_stack].item_count = view_count;
+
+    /* Every move goes to a lower stack, so a view moves at most stack_count
+     * times. */
+    int64_t moves = 0;
+    for(int32_t v = 0; v < view_count; v++)
+    {
+        struct gateway_layout_view* view = &views[v];
+        while(true)
+        {
+            int32_t sid = view->stack_index;
+            for(int i = view->stack_index - 1; i >= 0; i--)
+            {
+                if(!stacks[i].mapped) { continue; }
+                if(stacks[i].item_count < stacks[i].max_items &&
+                    (stacks[i].item_count + 2 <= stacks[sid].item_count || stacks[i].item_count < 1))
+                {
+                    sid = i;
+                    break;
+                }
+            }
+            if(sid == view->stack_index) { break; }
+
+            stacks[view->stack_index].item_count--;
+            stacks[sid].item_count++;
+            view->stack_index = sid;
+            moves++;
+        }
+    }
+
+    for(int32_t v = 0; v < view_count; v++)
+    {
+        struct gateway_layout_view* view = &views[v];
+        if(!layout_output_has_stack(output, view->stack_index)) { continue; }
+        struct gateway_panel_stack* stack = &stacks[view->stack_index];
+        int32_t height = stack->height / stack->item_count;
+        view->placed = true;
+        view->box.width = stack->width - 2*gaps;
+        view->box.height = height - 2*gaps;
+        view->box.x = stack->current_x + gaps;
+        view->box.y = stack->current_y + gaps;
+        stack->current_y += height;
+        if(view->box.width < 1) { view->box.width = 1; }
+        if(view->box.height < 1) { view->box.height = 1; }
+
+        if(view->fullscreen)
+        {
+            view->box = output->box;
+        }
+        view->width = layout_clamp_size(view->box.width, view->min_width, view->max_width);
+        view->height = layout_clamp_size(view->box.height, view->min_height, view->max_height);
+    }
+    return moves;
+}
@@ -0,0 +1,66 @@
+/*
+    Copyright (C) 2020 Sam H Smith
+    Contact: sam.henning.smith@protonmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* The tiling layout, plain data in and out with no wlroots or wayland types,
+ * so it can be benchmarked and fuzzed on its own, see tools/. */
+
+#ifndef GATEWAY_LAYOUT_H
+#define GATEWAY_LAYOUT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct gateway_layout_box {
+    int32_t x, y, width, height;
+};
+
+/* A column of views. A panel has a number of them, each output shows some. */
+struct gateway_panel_stack {
+    int32_t width, height, current_y, current_x, max_items, item_count;
+    bool mapped;
+};
+
+struct gateway_layout_output {
+    struct gateway_layout_box box; // logical pixels, in layout coordinates
+    const int32_t* stacks;         // indices into the panel's stacks
+    int32_t stack_count;
+};
+
+struct gateway_layout_view {
+    bool fullscreen;
+    /* Size hints of the client, 0 for none. */
+    int32_t min_width, min_height;
+    int32_t max_width, max_height;
+
+    /* Filled in by gateway_layout_arrange. */
+    int32_t stack_index; // -1 if no stack is mapped
+    bool placed;         // on a stack of this output, box and size are set
+    struct gateway_layout_box box; // the space the view gets
+    int32_t width, height;         // what to ask the client for, box clamped to the hints
+};
+
+/* Lays views out in order. Every view starts on the last mapped stack and
+ * moves to an earlier one while that one has room and is emptier by at least
+ * two, or empty. Stacks of the output split its width evenly, and views share
+ * the height of their stack. Boxes are never smaller than 1x1, however many
+ * views or gaps there are. Returns the number of moves between stacks. */
+int64_t gateway_layout_arrange(struct gateway_panel_stack* stacks, int32_t stack_count,
+    const struct gateway_layout_output* output, int32_t gaps,
+    struct gateway_layout_view* views, int32_t view_count);
+
+#endif
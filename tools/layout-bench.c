@@ -0,0 +1,79 @@
+/*
+    Copyright (C) 2020 Sam H Smith
+    Contact: sam.henning.smith@protonmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* Times gateway_layout_arrange for growing numbers of views.
+ * make layout-bench && ./layout-bench [iterations] */
+
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "layout.h"
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+int main(int argc, char** argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 1000;
+    if(iterations < 1) { iterations = 1; }
+
+    // The default config, four stacks of at most 8 views, two on this output
+    struct gateway_panel_stack stacks[4] = {0};
+    for(int i = 0; i < 4; i++)
+    {
+        stacks[i].mapped = true;
+        stacks[i].max_items = 8;
+    }
+    const int32_t output_stacks[2] = {0, 1};
+    struct gateway_layout_output output = {
+        .box = {0, 0, 1920, 1080},
+        .stacks = output_stacks,
+        .stack_count = 2,
+    };
+
+    const int32_t counts[] = {1, 10, 100, 1000, 10000};
+    printf("%8s %12s %12s %10s\n", "views", "ns/layout", "ns/view", "moves");
+    for(size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+    {
+        int32_t count = counts[c];
+        struct gateway_layout_view* views = calloc(count, sizeof(struct gateway_layout_view));
+        if(views == NULL) { return 1; }
+        for(int32_t v = 0; v < count; v++)
+        {
+            views[v].min_width = v % 3 == 0 ? 200 : 0;
+            views[v].max_height = v % 5 == 0 ? 400 : 0;
+        }
+
+        int64_t moves = 0;
+        uint64_t start = get_time_ns();
+        for(int i = 0; i < iterations; i++)
+        {
+            moves = gateway_layout_arrange(stacks, 4, &output, 4, views, count);
+        }
+        uint64_t ns = (get_time_ns() - start) / iterations;
+        printf("%8d %12llu %12.1f %10lld\n", count, (unsigned long long)ns,
+            (double)ns / count, (long long)moves);
+        free(views);
+    }
+    return 0;
+}
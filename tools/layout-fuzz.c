@@ -0,0 +1,202 @@
+/*
+    Copyright (C) 2020 Sam H Smith
+    Contact: sam.henning.smith@protonmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* Feeds gateway_layout_arrange random stacks, outputs and views and checks
+ * that it terminates with sane results. Built with -DGATEWAY_LIBFUZZER and
+ * -fsanitize=fuzzer this is a libFuzzer target, otherwise it runs the files
+ * given on the command line, or random inputs when there are none.
+ * make layout-fuzz && ./layout-fuzz [-n runs] [files...] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "layout.h"
+
+#define FUZZ_MAX_STACKS 16
+#define FUZZ_MAX_VIEWS 4096
+
+struct fuzz_input {
+    const uint8_t* data;
+    size_t size, offset;
+};
+
+// Past the end every read is 0, so short inputs still make a layout
+static uint32_t fuzz_read(struct fuzz_input* in, int bytes)
+{
+    uint32_t value = 0;
+    for(int i = 0; i < bytes; i++)
+    {
+        value <<= 8;
+        if(in->offset < in->size) { value |= in->data[in->offset++]; }
+    }
+    return value;
+}
+
+static void fuzz_check(bool ok, const char* what)
+{
+    if(ok) { return; }
+    fprintf(stderr, "layout-fuzz: %s\n", what);
+    abort();
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    struct fuzz_input in = { data, size, 0 };
+    struct gateway_panel_stack stacks[FUZZ_MAX_STACKS] = {0};
+    int32_t stack_count = fuzz_read(&in, 1) % (FUZZ_MAX_STACKS + 1);
+    for(int i = 0; i < stack_count; i++)
+    {
+        uint32_t byte = fuzz_read(&in, 1);
+        stacks[i].mapped = byte & 1;
+        stacks[i].max_items = (int32_t)(byte >> 1) - 8; // some are negative
+    }
+
+    int32_t output_stacks[FUZZ_MAX_STACKS];
+    int32_t output_stack_count = 0;
+    uint32_t on_output = fuzz_read(&in, 2);
+    for(int i = 0; i < stack_count; i++)
+    {
+        if(on_output & (1u << i)) { output_stacks[output_stack_count++] = i; }
+    }
+    struct gateway_layout_output output = {
+        .box = {
+            (int16_t)fuzz_read(&in, 2), (int16_t)fuzz_read(&in, 2),
+            fuzz_read(&in, 2) % 8192 + 1, fuzz_read(&in, 2) % 8192 + 1,
+        },
+        .stacks = output_stacks,
+        .stack_count = output_stack_count,
+    };
+    int32_t gaps = fuzz_read(&in, 2) % 4096;
+
+    int32_t view_count = fuzz_read(&in, 2) % (FUZZ_MAX_VIEWS + 1);
+    struct gateway_layout_view* views = calloc(view_count ? view_count : 1, sizeof(struct gateway_layout_view));
+    if(views == NULL) { return 0; }
+    for(int32_t v = 0; v < view_count; v++)
+    {
+        uint32_t flags = fuzz_read(&in, 1);
+        views[v].fullscreen = flags & 1;
+        if(flags & 2) { views[v].min_width = (int16_t)fuzz_read(&in, 2); }
+        if(flags & 4) { views[v].min_height = (int16_t)fuzz_read(&in, 2); }
+        if(flags & 8) { views[v].max_width = (int16_t)fuzz_read(&in, 2); }
+        if(flags & 16) { views[v].max_height = (int16_t)fuzz_read(&in, 2); }
+    }
+
+    int64_t moves = gateway_layout_arrange(stacks, stack_count, &output, gaps, views, view_count);
+    fuzz_check(moves >= 0 && moves <= (int64_t)view_count * stack_count, "too many moves");
+
+    int32_t counts[FUZZ_MAX_STACKS] = {0};
+    for(int32_t v = 0; v < view_count; v++)
+    {
+        struct gateway_layout_view* view = &views[v];
+        fuzz_check(view->stack_index >= -1 && view->stack_index < stack_count, "stack out of range");
+        if(view->stack_index < 0)
+        {
+            fuzz_check(!view->placed, "placed without a stack");
+            continue;
+        }
+        fuzz_check(stacks[view->stack_index].mapped, "view on an unmapped stack");
+        counts[view->stack_index]++;
+
+        bool on_this_output = false;
+        for(int i = 0; i < output_stack_count; i++)
+        {
+            if(output_stacks[i] == view->stack_index) { on_this_output = true; }
+        }
+        fuzz_check(view->placed == on_this_output, "placed on the wrong output");
+        if(!view->placed) { continue; }
+
+        fuzz_check(view->box.width >= 1 && view->box.height >= 1, "empty box");
+        fuzz_check(view->width >= 1 && view->height >= 1, "empty configure size");
+        fuzz_check(view->max_width < 1 || view->width <= view->max_width, "wider than max_width");
+        fuzz_check(view->max_height < 1 || view->height <= view->max_height, "taller than max_height");
+        if(view->fullscreen)
+        {
+            fuzz_check(memcmp(&view->box, &output.box, sizeof(output.box)) == 0, "fullscreen view not on the output");
+        } else
+        {
+            struct gateway_panel_stack* stack = &stacks[view->stack_index];
+            fuzz_check(view->box.x >= output.box.x, "left of the output");
+            fuzz_check(view->box.y >= output.box.y, "above the output");
+            fuzz_check(view->box.y + view->box.height <= stack->current_y + gaps ||
+                view->box.height == 1, "below its stack");
+        }
+    }
+    for(int i = 0; i < stack_count; i++)
+    {
+        fuzz_check(counts[i] == stacks[i].item_count, "item_count does not match the views");
+    }
+
+    free(views);
+    return 0;
+}
+
+#ifndef GATEWAY_LIBFUZZER
+static int fuzz_file(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if(file == NULL) { perror(path); return 1; }
+    uint8_t* data = NULL;
+    size_t size = 0, capacity = 0;
+    while(true)
+    {
+        if(size == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 4096;
+            data = realloc(data, capacity);
+            if(data == NULL) { fclose(file); return 1; }
+        }
+        size_t n = fread(data + size, 1, capacity - size, file);
+        if(n == 0) { break; }
+        size += n;
+    }
+    fclose(file);
+    LLVMFuzzerTestOneInput(data, size);
+    free(data);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    int runs = 100000;
+    int first = 1;
+    if(argc > 2 && strcmp(argv[1], "-n") == 0)
+    {
+        runs = atoi(argv[2]);
+        first = 3;
+    }
+    if(first < argc)
+    {
+        for(int i = first; i < argc; i++)
+        {
+            if(fuzz_file(argv[i]) != 0) { return 1; }
+        }
+        return 0;
+    }
+
+    uint8_t data[1024];
+    srand(1);
+    for(int run = 0; run < runs; run++)
+    {
+        size_t size = rand() % sizeof(data);
+        for(size_t i = 0; i < size; i++) { data[i] = rand(); }
+        LLVMFuzzerTestOneInput(data, size);
+    }
+    printf("layout-fuzz: %d runs passed\n", runs);
+    return 0;
+}
+#endif